@@ -0,0 +1,525 @@
+/*
+ * bench-load.c
+ *
+ * Copyright 2013 by Anthony Howe. All rights reserved.
+ *
+ *
+ * Description
+ * -----------
+ *
+ * SMTP load generator for benchmarks.  Each of -c threads runs
+ * sessions of -m messages back to back until -n messages in all, or
+ * -d seconds, are done.  Message sizes are picked at random from the
+ * -s list; repeat a size to weigh it.  Each message is timed from MAIL
+ * to the reply to its dot, and the times are kept in a histogram.
+ *
+ *	bench-load [-PT][-c sessions][-d seconds][-m messages][-n total][-s size,...][-t timeout] host[:port]
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#ifdef HAVE_OPENSSL_SSL_H
+# include <openssl/ssl.h>
+# define GETOPT_TLS	"T"
+#else
+# define GETOPT_TLS
+#endif
+
+#include "histogram.h"
+
+#define MAX_SIZES		32
+#define LINE_LENGTH		80		/* Body line with CRLF. */
+#define IN_SIZE			4096
+
+static char usage[] =
+"usage: bench-load [-P"
+#ifdef HAVE_OPENSSL_SSL_H
+"T"
+#endif
+"][-c sessions][-d seconds][-m messages][-n total]\n"
+"       [-s size,...][-t timeout] host[:port]\n"
+"\n"
+"-c sessions\tconcurrent sessions; default 10\n"
+"-d seconds\trun for this long instead of -n messages\n"
+"-m messages\tmessages per session; default 10\n"
+"-n total\tmessages to send in all; default 10000\n"
+"-P\t\tpipeline MAIL, RCPT, and DATA in one write\n"
+"-s size,...\tmessage sizes in bytes, picked at random; default 4096\n"
+#ifdef HAVE_OPENSSL_SSL_H
+"-T\t\tSTARTTLS before sending mail\n"
+#endif
+"-t timeout\treply timeout in seconds; default 60\n"
+"\n"
+"The last line of output is a summary for scripts, eg. bench.sh:\n"
+"\n"
+"RESULT messages N failed N seconds S rate R p50 MS p90 MS p99 MS p999 MS\n"
+"\n"
+;
+
+typedef struct {
+	int fd;
+#ifdef HAVE_OPENSSL_SSL_H
+	SSL *ssl;
+#endif
+	unsigned seed;
+	long in_offset;
+	long in_length;
+	char in[IN_SIZE];
+	unsigned long messages;
+	unsigned long failed;
+	Histogram latency;
+} Load;
+
+static int pipelining;
+static int starttls;
+static int concurrency = 10;
+static long timeout = 60;
+static long per_session = 10;
+static long total = 10000;
+static long duration;
+static int nsizes;
+static long sizes[MAX_SIZES];
+static char *body;
+static struct addrinfo *server;
+static char *host;
+
+static long started;
+static uint64_t stop_at;
+static pthread_mutex_t load_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef HAVE_OPENSSL_SSL_H
+static SSL_CTX *tls_ctx;
+#endif
+
+static uint64_t
+monotonicUs(void)
+{
+	struct timespec now;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Claim the next message to send, or return 0 when done.
+ */
+static int
+loadNext(void)
+{
+	int more;
+
+	if (0 < duration)
+		return monotonicUs() < stop_at;
+
+	(void) pthread_mutex_lock(&load_mutex);
+	if ((more = started < total))
+		started++;
+	(void) pthread_mutex_unlock(&load_mutex);
+
+	return more;
+}
+
+static int
+loadWrite(Load *load, const char *data, long length)
+{
+	long n;
+
+	for ( ; 0 < length; data += n, length -= n) {
+#ifdef HAVE_OPENSSL_SSL_H
+		if (load->ssl != NULL) {
+			if ((n = SSL_write(load->ssl, data, (int) length)) <= 0)
+				return -1;
+			continue;
+		}
+#endif
+		if ((n = send(load->fd, data, length, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Read one reply, single or multiline, and return its code or -1.
+ */
+static int
+loadReply(Load *load)
+{
+	long n;
+	char *line, *eol;
+
+	for (;;) {
+		line = load->in + load->in_offset;
+		if ((eol = memchr(line, '\n', load->in_length - load->in_offset)) != NULL) {
+			load->in_offset = eol+1 - load->in;
+			if (eol - line < 3)
+				continue;
+			if (eol - line == 3 || line[3] != '-')
+				return (int) strtol(line, NULL, 10);
+			continue;
+		}
+
+		n = load->in_length - load->in_offset;
+		memmove(load->in, line, n);
+		load->in_offset = 0;
+		load->in_length = n;
+		if (load->in_length == sizeof (load->in))
+			load->in_length = 0;
+
+#ifdef HAVE_OPENSSL_SSL_H
+		if (load->ssl != NULL)
+			n = SSL_read(load->ssl, load->in + load->in_length, (int) (sizeof (load->in) - load->in_length));
+		else
+#endif
+		n = recv(load->fd, load->in + load->in_length, sizeof (load->in) - load->in_length, 0);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		load->in_length += n;
+	}
+}
+
+static int
+loadCommand(Load *load, const char *command)
+{
+	if (loadWrite(load, command, strlen(command)))
+		return -1;
+
+	return loadReply(load);
+}
+
+static int
+loadConnect(Load *load)
+{
+	int on = 1;
+	struct timeval tv;
+
+	if ((load->fd = socket(server->ai_family, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+	(void) setsockopt(load->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	(void) setsockopt(load->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+	(void) setsockopt(load->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+
+	load->in_offset = load->in_length = 0;
+	if (connect(load->fd, server->ai_addr, server->ai_addrlen) || loadReply(load) != 220)
+		return -1;
+	if (loadCommand(load, "EHLO bench-load.example\r\n") != 250)
+		return -1;
+
+#ifdef HAVE_OPENSSL_SSL_H
+	if (starttls) {
+		if (loadCommand(load, "STARTTLS\r\n") != 220)
+			return -1;
+		if ((load->ssl = SSL_new(tls_ctx)) == NULL
+		|| !SSL_set_fd(load->ssl, load->fd)
+		|| SSL_connect(load->ssl) != 1)
+			return -1;
+		if (loadCommand(load, "EHLO bench-load.example\r\n") != 250)
+			return -1;
+	}
+#endif
+
+	return 0;
+}
+
+static void
+loadDisconnect(Load *load)
+{
+#ifdef HAVE_OPENSSL_SSL_H
+	if (load->ssl != NULL) {
+		(void) SSL_shutdown(load->ssl);
+		SSL_free(load->ssl);
+		load->ssl = NULL;
+	}
+#endif
+	if (0 <= load->fd)
+		(void) close(load->fd);
+	load->fd = -1;
+}
+
+/*
+ * Send one message and return 0, 1 if the server refused it, or -1
+ * if the session is lost.
+ */
+static int
+loadMessage(Load *load)
+{
+	int code;
+	long length;
+	uint64_t start;
+	static const char envelope[] = "MAIL FROM:<load@bench-load.example>\r\nRCPT TO:<sink@bench-sink.example>\r\nDATA\r\n";
+
+	/* Whole lines of the prepared body, then the dot. */
+	length = sizes[rand_r(&load->seed) % nsizes];
+	length = length < LINE_LENGTH ? LINE_LENGTH : length / LINE_LENGTH * LINE_LENGTH;
+
+	start = monotonicUs();
+	if (pipelining) {
+		if (loadWrite(load, envelope, sizeof (envelope)-1))
+			return -1;
+		if (loadReply(load) != 250 || loadReply(load) != 250 || loadReply(load) != 354)
+			return 1;
+	} else {
+		if (loadCommand(load, "MAIL FROM:<load@bench-load.example>\r\n") != 250)
+			return 1;
+		if (loadCommand(load, "RCPT TO:<sink@bench-sink.example>\r\n") != 250)
+			return 1;
+		if (loadCommand(load, "DATA\r\n") != 354)
+			return 1;
+	}
+	if (loadWrite(load, body, length) || loadWrite(load, ".\r\n", 3))
+		return -1;
+	if ((code = loadReply(load)) < 0)
+		return -1;
+	if (code / 100 != 2)
+		return 1;
+	histogramRecord(&load->latency, monotonicUs() - start);
+
+	return 0;
+}
+
+static void *
+loadWorker(void *data)
+{
+	int rc;
+	long sent;
+	Load *load = data;
+
+	sent = 0;
+	load->fd = -1;
+	while (loadNext()) {
+		if (load->fd < 0 && loadConnect(load)) {
+			load->failed++;
+			loadDisconnect(load);
+			continue;
+		}
+
+		if ((rc = loadMessage(load)) == 0)
+			load->messages++;
+		else
+			load->failed++;
+
+		if (rc < 0) {
+			loadDisconnect(load);
+			sent = 0;
+			continue;
+		}
+
+		/* Reset after a refusal; a pipelined group may leave
+		 * replies unread, so start a fresh session instead.
+		 */
+		if (0 < rc || per_session <= ++sent) {
+			if (rc == 0)
+				(void) loadCommand(load, "QUIT\r\n");
+			loadDisconnect(load);
+			sent = 0;
+		}
+	}
+
+	if (0 <= load->fd) {
+		(void) loadCommand(load, "QUIT\r\n");
+		loadDisconnect(load);
+	}
+
+	return NULL;
+}
+
+static int
+loadBody(void)
+{
+	int i;
+	long max, offset;
+
+	for (max = i = 0; i < nsizes; i++)
+		if (max < sizes[i])
+			max = sizes[i];
+	if (max < LINE_LENGTH)
+		max = LINE_LENGTH;
+
+	if ((body = malloc(max)) == NULL)
+		return -1;
+
+	/* A header line, the blank line, then body lines. */
+	for (offset = 0; offset + LINE_LENGTH <= max; offset += LINE_LENGTH) {
+		(void) memset(body + offset, 'a' + (offset / LINE_LENGTH) % 26, LINE_LENGTH-2);
+		body[offset + LINE_LENGTH-2] = '\r';
+		body[offset + LINE_LENGTH-1] = '\n';
+	}
+	(void) memcpy(body, "Subject: bench-load", sizeof ("Subject: bench-load")-1);
+	body[LINE_LENGTH-2] = '\r';
+	body[LINE_LENGTH-1] = '\n';
+	if (LINE_LENGTH * 2 <= offset)
+		(void) memcpy(body + LINE_LENGTH, "\r\n", 2);
+
+	return 0;
+}
+
+static int
+loadResolve(char *spec)
+{
+	int rc;
+	char *port;
+	struct addrinfo hints;
+
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	host = spec;
+	if ((spec = strdup(spec)) == NULL)
+		return -1;
+	if ((port = strrchr(spec, ':')) != NULL && strchr(spec, ':') == port)
+		*port++ = '\0';
+	else
+		port = "25";
+
+	if ((rc = getaddrinfo(spec, port, &hints, &server)) != 0) {
+		(void) fprintf(stderr, "%s: %s\n", host, gai_strerror(rc));
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, i;
+	char *stop;
+	double seconds;
+	uint64_t begin;
+	Load *loads;
+	pthread_t *threads;
+	Histogram latency;
+	unsigned long messages, failed;
+
+	while ((ch = getopt(argc, argv, "c:d:m:n:Ps:t:" GETOPT_TLS)) != -1) {
+		switch (ch) {
+		case 'c':
+			if ((concurrency = (int) strtol(optarg, NULL, 10)) <= 0)
+				concurrency = 1;
+			break;
+		case 'd':
+			duration = strtol(optarg, NULL, 10);
+			break;
+		case 'm':
+			if ((per_session = strtol(optarg, NULL, 10)) <= 0)
+				per_session = 1;
+			break;
+		case 'n':
+			total = strtol(optarg, NULL, 10);
+			break;
+		case 'P':
+			pipelining = 1;
+			break;
+		case 's':
+			for (stop = optarg; nsizes < MAX_SIZES && *stop != '\0'; stop++) {
+				sizes[nsizes++] = strtol(stop, &stop, 10);
+				if (*stop == 'k' || *stop == 'K')
+					sizes[nsizes-1] *= 1024, stop++;
+				if (*stop != ',')
+					break;
+			}
+			break;
+		case 't':
+			timeout = strtol(optarg, NULL, 10);
+			break;
+#ifdef HAVE_OPENSSL_SSL_H
+		case 'T':
+			starttls = 1;
+			break;
+#endif
+		default:
+			optind = argc;
+		}
+	}
+
+	if (argc <= optind) {
+		(void) fputs(usage, stderr);
+		return EXIT_FAILURE;
+	}
+
+	if (nsizes == 0)
+		sizes[nsizes++] = 4096;
+	if (loadResolve(argv[optind]) || loadBody()
+	|| (threads = calloc(concurrency, sizeof (*threads))) == NULL
+	|| (loads = calloc(concurrency, sizeof (*loads))) == NULL) {
+		(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+		return EXIT_FAILURE;
+	}
+
+#ifdef HAVE_OPENSSL_SSL_H
+	if (starttls) {
+		SSL_library_init();
+		SSL_load_error_strings();
+		if ((tls_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
+			(void) fprintf(stderr, "SSL_CTX_new failed\n");
+			return EXIT_FAILURE;
+		}
+		SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_NONE, NULL);
+	}
+#endif
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	begin = monotonicUs();
+	stop_at = begin + (uint64_t) duration * 1000000;
+	for (i = 0; i < concurrency; i++) {
+		loads[i].seed = (unsigned) begin ^ (unsigned) i;
+		if (pthread_create(&threads[i], NULL, loadWorker, &loads[i])) {
+			(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+			return EXIT_FAILURE;
+		}
+	}
+
+	memset(&latency, 0, sizeof (latency));
+	for (messages = failed = 0, i = 0; i < concurrency; i++) {
+		(void) pthread_join(threads[i], NULL);
+		messages += loads[i].messages;
+		failed += loads[i].failed;
+		histogramAdd(&latency, &loads[i].latency);
+	}
+	seconds = (monotonicUs() - begin) / 1e6;
+
+	(void) printf(
+		"%s: %lu messages, %lu failed in %.3fs, %.1f messages/s\n"
+		"latency ms: mean %.3f p50 %.3f p90 %.3f p99 %.3f p999 %.3f max %.3f\n",
+		host, messages, failed, seconds, messages / seconds,
+		latency.count == 0 ? 0.0 : latency.sum / 1000.0 / latency.count,
+		histogramQuantile(&latency, 0.5) / 1000.0, histogramQuantile(&latency, 0.9) / 1000.0,
+		histogramQuantile(&latency, 0.99) / 1000.0, histogramQuantile(&latency, 0.999) / 1000.0,
+		latency.max / 1000.0
+	);
+	(void) printf(
+		"RESULT messages %lu failed %lu seconds %.3f rate %.1f p50 %.3f p90 %.3f p99 %.3f p999 %.3f\n",
+		messages, failed, seconds, messages / seconds,
+		histogramQuantile(&latency, 0.5) / 1000.0, histogramQuantile(&latency, 0.9) / 1000.0,
+		histogramQuantile(&latency, 0.99) / 1000.0, histogramQuantile(&latency, 0.999) / 1000.0
+	);
+
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,270 @@
+/*
+ * bench-sink.c
+ *
+ * Copyright 2013 by Anthony Howe. All rights reserved.
+ *
+ *
+ * Description
+ * -----------
+ *
+ * Stub SMTP server for benchmarks that accepts and discards mail as
+ * fast as it can, a thread per connection.  Pipelined commands are
+ * answered together.  Latency and failures can be injected to see how
+ * roundhouse copes with a slow or unreliable server.
+ *
+ *	bench-sink [-d delay[,jitter]][-f percent][-x percent] [ip:]port
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define IN_SIZE			65536
+#define OUT_SIZE		8192
+
+static char usage[] =
+"usage: bench-sink [-d delay[,jitter]][-f percent][-x percent] [ip:]port\n"
+"\n"
+"-d delay,jitter\tmilliseconds to wait before each write of replies, plus\n"
+"\t\tup to jitter more at random; default 0\n"
+"-f percent\tof messages to answer 451 at the dot; default 0\n"
+"-x percent\tof messages to drop the connection at the dot; default 0\n"
+"\n"
+;
+
+static long delay;
+static long jitter;
+static int fail_percent;
+static int drop_percent;
+
+typedef struct {
+	int fd;
+	int data;				/* Reading message content. */
+	unsigned seed;
+	long in_length;
+	char in[IN_SIZE];
+	long out_length;
+	char out[OUT_SIZE];
+} Sink;
+
+static int
+sinkFlush(Sink *sink)
+{
+	long n, offset, ms;
+	struct timespec pause;
+
+	if (sink->out_length == 0)
+		return 0;
+
+	if (0 < delay || 0 < jitter) {
+		ms = delay + (0 < jitter ? rand_r(&sink->seed) % (jitter + 1) : 0);
+		pause.tv_sec = ms / 1000;
+		pause.tv_nsec = ms % 1000 * 1000000;
+		(void) nanosleep(&pause, NULL);
+	}
+
+	for (offset = 0; offset < sink->out_length; offset += n) {
+		if ((n = send(sink->fd, sink->out + offset, sink->out_length - offset, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+	sink->out_length = 0;
+
+	return 0;
+}
+
+static int
+sinkReply(Sink *sink, const char *reply)
+{
+	long length = strlen(reply);
+
+	if (sizeof (sink->out) - sink->out_length < length && sinkFlush(sink))
+		return -1;
+	memcpy(sink->out + sink->out_length, reply, length);
+	sink->out_length += length;
+
+	return 0;
+}
+
+static int
+sinkIsCommand(const char *line, const char *command)
+{
+	return strncasecmp(line, command, strlen(command)) == 0;
+}
+
+/*
+ * Answer one line.  Return 1 to close the connection, -1 on error.
+ */
+static int
+sinkLine(Sink *sink, const char *line, long length)
+{
+	if (sink->data) {
+		if ((length == 3 && memcmp(line, ".\r\n", 3) == 0) || (length == 2 && memcmp(line, ".\n", 2) == 0)) {
+			sink->data = 0;
+			if (0 < drop_percent && rand_r(&sink->seed) % 100 < drop_percent)
+				return 1;
+			if (0 < fail_percent && rand_r(&sink->seed) % 100 < fail_percent)
+				return sinkReply(sink, "451 4.3.0 injected failure\r\n");
+			return sinkReply(sink, "250 2.0.0 discarded\r\n");
+		}
+		return 0;
+	}
+
+	if (sinkIsCommand(line, "EHLO"))
+		return sinkReply(sink, "250-bench-sink\r\n250-PIPELINING\r\n250-8BITMIME\r\n250 XCLIENT ADDR NAME\r\n");
+	if (sinkIsCommand(line, "XCLIENT"))
+		return sinkReply(sink, "220 bench-sink ESMTP\r\n");
+	if (sinkIsCommand(line, "DATA")) {
+		sink->data = 1;
+		return sinkReply(sink, "354 end with dot\r\n");
+	}
+	if (sinkIsCommand(line, "QUIT")) {
+		(void) sinkReply(sink, "221 2.0.0 bye\r\n");
+		return 1;
+	}
+
+	return sinkReply(sink, "250 2.0.0 OK\r\n");
+}
+
+static void *
+sinkSession(void *data)
+{
+	int rc;
+	long n, offset;
+	char *line, *eol;
+	Sink *sink = data;
+
+	rc = sinkReply(sink, "220 bench-sink ESMTP\r\n");
+
+	while (rc == 0) {
+		if (sinkFlush(sink))
+			break;
+		if ((n = recv(sink->fd, sink->in + sink->in_length, sizeof (sink->in) - sink->in_length, 0)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		sink->in_length += n;
+
+		for (offset = 0; rc == 0; offset = eol+1 - sink->in) {
+			line = sink->in + offset;
+			if ((eol = memchr(line, '\n', sink->in_length - offset)) == NULL) {
+				/* Discard an over long line. */
+				if (sink->in_length - offset == sizeof (sink->in))
+					offset = sink->in_length;
+				break;
+			}
+			rc = sinkLine(sink, line, eol+1 - line);
+		}
+
+		sink->in_length -= offset;
+		memmove(sink->in, sink->in + offset, sink->in_length);
+	}
+
+	if (0 < rc)
+		(void) sinkFlush(sink);
+	(void) close(sink->fd);
+	free(sink);
+
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	char *port, *stop;
+	int ch, fd, on, rc;
+	unsigned connections;
+	pthread_t thread;
+	pthread_attr_t attr;
+	struct addrinfo hints, *address;
+	Sink *sink;
+
+	while ((ch = getopt(argc, argv, "d:f:x:")) != -1) {
+		switch (ch) {
+		case 'd':
+			delay = strtol(optarg, &stop, 10);
+			if (*stop == ',')
+				jitter = strtol(stop+1, NULL, 10);
+			break;
+		case 'f':
+			fail_percent = (int) strtol(optarg, NULL, 10);
+			break;
+		case 'x':
+			drop_percent = (int) strtol(optarg, NULL, 10);
+			break;
+		default:
+			optind = argc;
+		}
+	}
+
+	if (argc <= optind) {
+		(void) fputs(usage, stderr);
+		return EXIT_FAILURE;
+	}
+
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	/* [ip:]port */
+	if ((port = strrchr(argv[optind], ':')) != NULL)
+		*port++ = '\0';
+	if ((rc = getaddrinfo(port == NULL ? NULL : argv[optind], port == NULL ? argv[optind] : port, &hints, &address)) != 0) {
+		(void) fprintf(stderr, "%s: %s\n", argv[optind], gai_strerror(rc));
+		return EXIT_FAILURE;
+	}
+
+	on = 1;
+	if ((fd = socket(address->ai_family, SOCK_STREAM, 0)) < 0
+	|| setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on))
+	|| bind(fd, address->ai_addr, address->ai_addrlen)
+	|| listen(fd, 1024)) {
+		(void) fprintf(stderr, "%s: %s (%d)\n", argv[optind], strerror(errno), errno);
+		return EXIT_FAILURE;
+	}
+	freeaddrinfo(address);
+
+	connections = 0;
+	(void) signal(SIGPIPE, SIG_IGN);
+	(void) pthread_attr_init(&attr);
+	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (;;) {
+		if ((sink = malloc(sizeof (*sink))) == NULL) {
+			(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+			return EXIT_FAILURE;
+		}
+		if ((sink->fd = accept(fd, NULL, NULL)) < 0) {
+			free(sink);
+			continue;
+		}
+		(void) setsockopt(sink->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+		sink->data = 0;
+		sink->in_length = 0;
+		sink->out_length = 0;
+		sink->seed = (unsigned) time(NULL) ^ ++connections * 2654435761U;
+		if (pthread_create(&thread, &attr, sinkSession, sink)) {
+			(void) close(sink->fd);
+			free(sink);
+		}
+	}
+
+	/*@notreached@*/
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+#!/bin/sh
+#
+# bench.sh
+#
+# Copyright 2013 by Anthony Howe. All rights reserved.
+#
+# Measure what roundhouse adds and how it scales with the number of
+# down stream servers.  bench-load sends through roundhouse to 1, 2,
+# 4, and 8 bench-sink servers, and first straight to one bench-sink
+# for a baseline.  Reports messages/s, client latency percentiles, and
+# the CPU time and peak RSS of roundhouse, read from /proc (Linux).
+#
+#	sh bench.sh [bench-load options]
+#
+# Environment:
+#
+#	BENCH_LOAD	bench-load options; default "-c 50 -n 20000 -s 1k,4k,4k,64k"
+#	BENCH_SINK	bench-sink options, eg. "-d 1,4 -f 1"
+#	BENCH_ARGS	extra roundhouse options, eg. "-E 4" or "-k key.pem"
+#	BENCH_SERVERS	server counts; default "1 2 4 8"
+#	BENCH_PORT	roundhouse port; default 2525; sinks use the next ones
+#
+
+LOAD_ARGS="${*:-${BENCH_LOAD:--c 50 -n 20000 -s 1k,4k,4k,64k}}"
+SERVERS="${BENCH_SERVERS:-1 2 4 8}"
+PORT="${BENCH_PORT:-2525}"
+HZ=`getconf CLK_TCK`
+
+sinks=""
+roundhouse=""
+
+cleanup()
+{
+	[ -n "$roundhouse" ] && kill $roundhouse 2>/dev/null
+	[ -n "$sinks" ] && kill $sinks 2>/dev/null
+	wait 2>/dev/null
+	roundhouse=""
+	sinks=""
+}
+trap cleanup EXIT INT TERM
+
+# Start n sinks on the ports after PORT; sets $sinks and $hosts.
+start_sinks()
+{
+	hosts=""
+	i=1
+	while [ $i -le $1 ]; do
+		./bench-sink $BENCH_SINK 127.0.0.1:`expr $PORT + $i` &
+		sinks="$sinks $!"
+		hosts="$hosts 127.0.0.1:`expr $PORT + $i`"
+		i=`expr $i + 1`
+	done
+	sleep 1
+}
+
+# User plus system clock ticks of a process.
+cpu_ticks()
+{
+	awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+report()
+{
+	# $1 label, $2 bench-load RESULT line, $3 CPU seconds, $4 peak RSS KB
+	echo "$2" | awk -v label="$1" -v cpu="$3" -v rss="$4" '{
+		printf "%-8s %9s %8s %8s %8s %8s %8s %8s %8s\n", label, $9, $11, $13, $15, $17, $5, cpu, rss
+	}'
+}
+
+printf "%-8s %9s %8s %8s %8s %8s %8s %8s %8s\n" servers msg/s p50ms p90ms p99ms p999ms failed cpu-s rss-kb
+echo "bench-load $LOAD_ARGS" >&2
+
+start_sinks 1
+result=`./bench-load $LOAD_ARGS $hosts | grep '^RESULT'`
+report direct "$result" - -
+cleanup
+
+for n in $SERVERS; do
+	start_sinks $n
+	./roundhouse -d -i 127.0.0.1:$PORT $BENCH_ARGS $hosts 2>/dev/null &
+	roundhouse=$!
+
+	# Wait for it to listen; the probe message doubles as a warm up.
+	tries=0
+	until ./bench-load -c 1 -n 1 127.0.0.1:$PORT >/dev/null; do
+		tries=`expr $tries + 1`
+		[ $tries -ge 20 ] && echo "roundhouse did not start" >&2 && exit 1
+		sleep 0.5
+	done
+
+	before=`cpu_ticks $roundhouse`
+	result=`./bench-load $LOAD_ARGS 127.0.0.1:$PORT | grep '^RESULT'`
+	after=`cpu_ticks $roundhouse`
+	rss=`awk '/^VmHWM:/ { print $2 }' /proc/$roundhouse/status`
+
+	report $n "$result" `echo $before $after $HZ | awk '{ printf "%.2f", ($2 - $1) / $3 }'` $rss
+	cleanup
+done
@@ -0,0 +1,117 @@
+/*
+ * histogram.c
+ *
+ * Copyright 2013 by Anthony Howe. All rights reserved.
+ *
+ *
+ * Description
+ * -----------
+ *
+ * HDR style histogram with a fixed number of buckets.  Values below
+ * 2*HISTOGRAM_SUB each have a bucket of their own; above that every
+ * power of two range is split into HISTOGRAM_SUB equal buckets.  This
+ * keeps the relative error the same from microseconds to hours, and a
+ * record is a shift, a count leading zeros, and an increment.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "histogram.h"
+
+static int
+histogramIndex(uint64_t value)
+{
+	int msb;
+
+	if (value < 2 * HISTOGRAM_SUB)
+		return (int) value;
+
+	if ((uint64_t) 1 << HISTOGRAM_BITS <= value)
+		return HISTOGRAM_BUCKETS-1;
+
+#ifdef __GNUC__
+	msb = 63 - __builtin_clzll(value);
+#else
+	for (msb = HISTOGRAM_SUB_BITS; (value >> (msb+1)) != 0; msb++)
+		;
+#endif
+	return ((msb - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + (int) (value >> (msb - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB;
+}
+
+/*
+ * The largest value counted in a bucket.
+ */
+static uint64_t
+histogramHigh(int index)
+{
+	int shift;
+
+	if (index < 2 * HISTOGRAM_SUB)
+		return index;
+
+	shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+
+	return ((uint64_t) (HISTOGRAM_SUB + (index & (HISTOGRAM_SUB-1)) + 1) << shift) - 1;
+}
+
+void
+histogramRecord(Histogram *hist, uint64_t value)
+{
+	hist->buckets[histogramIndex(value)]++;
+	hist->count++;
+	hist->sum += value;
+	if (hist->max < value)
+		hist->max = value;
+}
+
+void
+histogramAdd(Histogram *total, const Histogram *hist)
+{
+	int i;
+
+	if (hist->count == 0)
+		return;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		total->buckets[i] += hist->buckets[i];
+	total->count += hist->count;
+	total->sum += hist->sum;
+	if (total->max < hist->max)
+		total->max = hist->max;
+}
+
+uint64_t
+histogramQuantile(const Histogram *hist, double quantile)
+{
+	int i;
+	uint64_t rank, seen, high;
+
+	if (hist->count == 0)
+		return 0;
+
+	rank = (uint64_t) (quantile * hist->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	for (seen = i = 0; i < HISTOGRAM_BUCKETS-1; i++) {
+		if (rank <= (seen += hist->buckets[i]))
+			break;
+	}
+
+	high = histogramHigh(i);
+
+	return hist->max < high ? hist->max : high;
+}
+
+uint64_t
+histogramCountBelow(const Histogram *hist, uint64_t value)
+{
+	int i;
+	uint64_t seen;
+
+	for (seen = i = 0; i < HISTOGRAM_BUCKETS && histogramHigh(i) <= value; i++)
+		seen += hist->buckets[i];
+
+	return seen;
+}
@@ -0,0 +1,86 @@
+/*
+ * histogram.h
+ *
+ * Copyright 2013 by Anthony Howe. All rights reserved.
+ *
+ * Log-linear latency histogram.
+ */
+
+#ifndef __histogram_h__
+#define __histogram_h__	1
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Each power of two is split into HISTOGRAM_SUB buckets, so a value is
+ * placed within 1/HISTOGRAM_SUB (6%) of itself.  Values from zero up to
+ * 2^HISTOGRAM_BITS-1, about 12 days in microseconds, are counted.
+ */
+#define HISTOGRAM_SUB_BITS	4
+#define HISTOGRAM_SUB		(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BITS		40
+#define HISTOGRAM_BUCKETS	((HISTOGRAM_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+/**
+ * @param hist
+ *	A pointer to a Histogram, zeroed before first use.  Recording is
+ *	not locked; give each writing thread its own Histogram and sum
+ *	them with histogramAdd() to report.
+ *
+ * @param value
+ *	The value to count.  Values too large are counted in the last
+ *	bucket.
+ */
+extern void histogramRecord(Histogram *hist, uint64_t value);
+
+/**
+ * @param total
+ *	A pointer to a Histogram to add to.
+ *
+ * @param hist
+ *	A pointer to a Histogram to add.
+ */
+extern void histogramAdd(Histogram *total, const Histogram *hist);
+
+/**
+ * @param hist
+ *	A pointer to a Histogram.
+ *
+ * @param quantile
+ *	A fraction between 0.0 and 1.0, eg. 0.999.
+ *
+ * @return
+ *	The largest value in the bucket holding the quantile, limited by
+ *	the largest value recorded; zero when empty.
+ */
+extern uint64_t histogramQuantile(const Histogram *hist, double quantile);
+
+/**
+ * @param hist
+ *	A pointer to a Histogram.
+ *
+ * @param value
+ *	An upper bound.
+ *
+ * @return
+ *	The number of values counted in the buckets wholly at or below
+ *	value.
+ */
+extern uint64_t histogramCountBelow(const Histogram *hist, uint64_t value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __histogram_h__ */
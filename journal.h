@@ -0,0 +1,51 @@
+/*
+ * journal.h
+ *
+ * Copyright 2013 by Anthony Howe. All rights reserved.
+ *
+ * Session capture journal, written by roundhouse -j and read by
+ * roundhouse-replay.
+ */
+
+#ifndef __journal_h__
+#define __journal_h__	1
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JOURNAL_MAGIC		0x52484a4c	/* RHJL */
+#define JOURNAL_VERSION		1
+#define JOURNAL_RECORD_MAX	0xffff		/* Longest record data. */
+
+/*
+ * A journal is a JournalHeader followed by records appended in time
+ * order, each a JournalRecord and length bytes of data.  Records of
+ * concurrent sessions are interleaved.  Numbers are in host order; a
+ * journal is replayed on the kind of machine that wrote it.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+} JournalHeader;
+
+typedef enum {
+	JOURNAL_OPEN = 1,			/* Data is the client address. */
+	JOURNAL_INPUT,				/* Data is bytes read from the client. */
+	JOURNAL_CLOSE,				/* No data. */
+} JournalType;
+
+typedef struct {
+	uint64_t when;				/* Microseconds since the epoch. */
+	uint32_t session;			/* Unique among open sessions. */
+	uint16_t type;
+	uint16_t length;			/* Bytes of data that follow. */
+} JournalRecord;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __journal_h__ */
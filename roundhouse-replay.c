@@ -0,0 +1,735 @@
+/*
+ * roundhouse-replay.c
+ *
+ * Copyright 2013 by Anthony Howe. All rights reserved.
+ *
+ *
+ * Description
+ * -----------
+ *
+ * Replay the client sessions captured by roundhouse -j against one or
+ * more SMTP servers, in the original timing, faster by some factor, or
+ * as fast as the servers will go.  Sessions are handed to the servers
+ * in turn and run concurrently, each by a worker thread.
+ *
+ * The journal only holds what the clients sent, so each session is
+ * driven as an SMTP client: what was sent together is sent together,
+ * then the replies owed are read before going on.  STARTTLS is left
+ * out, roundhouse ended the TLS; the message body is only sent once
+ * DATA gets its 354.
+ *
+ *	roundhouse-replay [-v][-c sessions][-s speed][-t timeout] journal host[:port] ...
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "journal.h"
+
+#define MAX_SERVERS		32
+#define OPEN_BUCKETS		4096
+#define EXPECT_MAX		1024		/* Replies owed before a flush. */
+#define LINE_SIZE		1024
+#define OUT_SIZE		65536
+#define IN_SIZE			4096
+
+static char usage[] =
+"usage: roundhouse-replay [-v][-c sessions][-s speed][-t timeout]\n"
+"       journal host[:port] ...\n"
+"\n"
+"-c sessions\tmost sessions run at once; default 100\n"
+"-s speed\t1 replays in the original timing, 2 twice as fast, and\n"
+"\t\tso on; 0 runs as fast as the servers go; default 1\n"
+"-t timeout\tserver connect and reply timeout in seconds; default 60\n"
+"-v\t\treport each session that fails\n"
+"\n"
+"journal\t\tfile written by roundhouse -j\n"
+"host[:port]\tSMTP servers to replay to; sessions are given to each in\n"
+"\t\tturn; default port 25\n"
+"\n"
+;
+
+typedef struct {
+	uint64_t start;				/* When the session opened. */
+	long length;
+	long size;
+	const char **records;			/* Records in the mapped journal. */
+	long next_open;				/* Open sessions hash chain. */
+	uint32_t id;
+} Session;
+
+typedef struct {
+	unsigned long sessions;
+	unsigned long failed;
+	unsigned long messages;
+	unsigned long replies[4];
+	unsigned long long bytes;
+	uint64_t late;				/* Worst start behind schedule. */
+} Totals;
+
+typedef enum {
+	MODE_COMMAND,
+	MODE_DATA,
+} Mode;
+
+typedef enum {
+	REPLY_COMMAND,
+	REPLY_MESSAGE,				/* Dot or BDAT LAST. */
+} ReplyKind;
+
+typedef struct {
+	int fd;
+	int code;				/* Last reply code read. */
+	int quit;
+	Mode mode;
+	long bdat;				/* Chunk bytes still to send. */
+	int bdat_owed;				/* Reply owed once the chunk is sent. */
+	ReplyKind bdat_kind;
+	int expect;
+	char kinds[EXPECT_MAX];
+	long line_length;
+	char line[LINE_SIZE];
+	long out_length;
+	char out[OUT_SIZE];
+	long in_offset;
+	long in_length;
+	char in[IN_SIZE];
+	const char *error;
+	Totals totals;
+} Replay;
+
+static int verbose;
+static double speed = 1.0;
+static long timeout = 60;
+static int concurrency = 100;
+
+static int nservers;
+static char *hosts[MAX_SERVERS];
+static struct addrinfo *servers[MAX_SERVERS];
+
+static Session *sessions;
+static long nsessions;
+static long next_session;
+static uint64_t journal_start;			/* Earliest session start. */
+static uint64_t replay_begin;
+static Totals totals;
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+monotonicUs(void)
+{
+	struct timespec now;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void
+sleepUntil(uint64_t when)
+{
+	uint64_t now;
+	struct timespec delay;
+
+	while ((now = monotonicUs()) < when) {
+		delay.tv_sec = (when - now) / 1000000;
+		delay.tv_nsec = (when - now) % 1000000 * 1000;
+		(void) nanosleep(&delay, NULL);
+	}
+}
+
+/***********************************************************************
+ *** Journal
+ ***********************************************************************/
+
+static int
+sessionAdd(Session *session, const char *record)
+{
+	const char **records;
+
+	if (session->size <= session->length) {
+		session->size = session->size == 0 ? 16 : session->size * 2;
+		if ((records = realloc(session->records, session->size * sizeof (*records))) == NULL)
+			return -1;
+		session->records = records;
+	}
+	session->records[session->length++] = record;
+
+	return 0;
+}
+
+/*
+ * Map the journal and gather each session's records, in order.  A
+ * record cut short at the end, by a journal still being written, is
+ * ignored.
+ */
+static int
+journalLoad(const char *path)
+{
+	int fd;
+	Session *table;
+	struct stat sb;
+	JournalRecord record;
+	JournalHeader header;
+	const char *base, *next, *stop;
+	long i, *link, size, chains[OPEN_BUCKETS];
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &sb)) {
+		(void) fprintf(stderr, "%s: %s (%d)\n", path, strerror(errno), errno);
+		return -1;
+	}
+	if (sb.st_size < sizeof (header)) {
+		(void) fprintf(stderr, "%s: not a roundhouse journal\n", path);
+		return -1;
+	}
+	base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	(void) close(fd);
+	if (base == MAP_FAILED) {
+		(void) fprintf(stderr, "%s: %s (%d)\n", path, strerror(errno), errno);
+		return -1;
+	}
+	memcpy(&header, base, sizeof (header));
+	if (header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION) {
+		(void) fprintf(stderr, "%s: not a roundhouse journal\n", path);
+		return -1;
+	}
+
+	for (i = 0; i < OPEN_BUCKETS; i++)
+		chains[i] = -1;
+
+	size = 0;
+	stop = base + sb.st_size;
+	for (next = base + sizeof (header); next + sizeof (record) <= stop; next += sizeof (record) + record.length) {
+		/* Records are packed, so copy each header out. */
+		memcpy(&record, next, sizeof (record));
+		if (stop < next + sizeof (record) + record.length)
+			break;
+
+		/* Find the open session, unlinking it on close. */
+		for (link = &chains[record.session % OPEN_BUCKETS]; 0 <= *link; link = &sessions[*link].next_open) {
+			if (sessions[*link].id == record.session)
+				break;
+		}
+
+		switch (record.type) {
+		case JOURNAL_OPEN:
+			/* The same number still open is left over from a
+			 * daemon that did not stop cleanly.
+			 */
+			if (0 <= *link)
+				*link = sessions[*link].next_open;
+
+			if (size <= nsessions) {
+				size = size == 0 ? 1024 : size * 2;
+				if ((table = realloc(sessions, size * sizeof (*sessions))) == NULL)
+					goto error0;
+				sessions = table;
+			}
+			memset(&sessions[nsessions], 0, sizeof (*sessions));
+			sessions[nsessions].id = record.session;
+			sessions[nsessions].start = record.when;
+			if (nsessions == 0 || record.when < journal_start)
+				journal_start = record.when;
+			sessions[nsessions].next_open = chains[record.session % OPEN_BUCKETS];
+			chains[record.session % OPEN_BUCKETS] = nsessions++;
+			break;
+
+		case JOURNAL_INPUT:
+			if (*link < 0)
+				break;
+			if (sessionAdd(&sessions[*link], next))
+				goto error0;
+			break;
+
+		case JOURNAL_CLOSE:
+			if (*link < 0)
+				break;
+			if (sessionAdd(&sessions[*link], next))
+				goto error0;
+			*link = sessions[*link].next_open;
+			break;
+		}
+	}
+
+	return 0;
+error0:
+	(void) fprintf(stderr, "%s: %s (%d)\n", path, strerror(errno), errno);
+	return -1;
+}
+
+/***********************************************************************
+ *** SMTP Client
+ ***********************************************************************/
+
+static int
+replaySend(Replay *replay)
+{
+	long n, offset;
+
+	for (offset = 0; offset < replay->out_length; offset += n) {
+		if ((n = send(replay->fd, replay->out + offset, replay->out_length - offset, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			replay->error = "write error";
+			return -1;
+		}
+	}
+	replay->totals.bytes += replay->out_length;
+	replay->out_length = 0;
+
+	return 0;
+}
+
+static int
+replayOut(Replay *replay, const char *data, long length)
+{
+	long n;
+
+	for ( ; 0 < length; data += n, length -= n) {
+		if (replay->out_length == sizeof (replay->out) && replaySend(replay))
+			return -1;
+		n = sizeof (replay->out) - replay->out_length;
+		if (length < n)
+			n = length;
+		memcpy(replay->out + replay->out_length, data, n);
+		replay->out_length += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Read one reply, single or multiline, and return its code or -1.
+ */
+static int
+replayReply(Replay *replay)
+{
+	long n;
+	char *line, *eol;
+
+	for (;;) {
+		line = replay->in + replay->in_offset;
+		if ((eol = memchr(line, '\n', replay->in_length - replay->in_offset)) != NULL) {
+			replay->in_offset = eol+1 - replay->in;
+			if (eol - line < 3)
+				continue;
+			if (eol - line == 3 || line[3] != '-')
+				return (int) strtol(line, NULL, 10);
+			continue;
+		}
+
+		/* Keep the partial line and read more. */
+		n = replay->in_length - replay->in_offset;
+		memmove(replay->in, line, n);
+		replay->in_offset = 0;
+		replay->in_length = n;
+		if (replay->in_length == sizeof (replay->in))
+			replay->in_length = 0;
+
+		if ((n = recv(replay->fd, replay->in + replay->in_length, sizeof (replay->in) - replay->in_length, 0)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			replay->error = n == 0 ? "server closed connection" : errno == EAGAIN ? "reply timeout" : "read error";
+			return -1;
+		}
+		replay->in_length += n;
+	}
+}
+
+static void
+replayCount(Replay *replay, int code, ReplyKind kind)
+{
+	if (200 <= code && code < 600)
+		replay->totals.replies[code / 100 - 2]++;
+	if (kind == REPLY_MESSAGE && code / 100 == 2)
+		replay->totals.messages++;
+	replay->code = code;
+}
+
+/*
+ * Send what is gathered and read the replies owed.
+ */
+static int
+replayFlush(Replay *replay)
+{
+	int i, code;
+
+	if (replaySend(replay))
+		return -1;
+
+	for (i = 0; i < replay->expect; i++) {
+		if ((code = replayReply(replay)) < 0)
+			return -1;
+		replayCount(replay, code, replay->kinds[i]);
+	}
+	replay->expect = 0;
+
+	return 0;
+}
+
+static int
+replayExpect(Replay *replay, ReplyKind kind)
+{
+	if (replay->expect == EXPECT_MAX && replayFlush(replay))
+		return -1;
+	replay->kinds[replay->expect++] = kind;
+
+	return 0;
+}
+
+static int
+replayIsCommand(const char *line, long length, const char *command)
+{
+	long n = strlen(command);
+
+	return n <= length && strncasecmp(line, command, n) == 0
+		&& (length == n || line[n] == ' ' || line[n] == '\r' || line[n] == '\n');
+}
+
+static int
+replayLine(Replay *replay)
+{
+	char *stop;
+	long length = replay->line_length;
+	const char *line = replay->line;
+
+	if (replay->mode == MODE_DATA) {
+		if (replayOut(replay, line, length))
+			return -1;
+		if ((length == 3 && memcmp(line, ".\r\n", 3) == 0) || (length == 2 && memcmp(line, ".\n", 2) == 0)) {
+			replay->mode = MODE_COMMAND;
+			return replayExpect(replay, REPLY_MESSAGE);
+		}
+		return 0;
+	}
+
+	/* roundhouse answered STARTTLS itself and the rest was clear. */
+	if (replayIsCommand(line, length, "STARTTLS"))
+		return 0;
+
+	if (replayOut(replay, line, length))
+		return -1;
+
+	if (replayIsCommand(line, length, "BDAT")) {
+		replay->bdat = strtol(line+5, &stop, 10);
+		replay->bdat_kind = replayIsCommand(stop+1, length - (stop+1 - line), "LAST") ? REPLY_MESSAGE : REPLY_COMMAND;
+		replay->bdat_owed = 1;
+		if (replay->bdat <= 0) {
+			replay->bdat = 0;
+			replay->bdat_owed = 0;
+			return replayExpect(replay, replay->bdat_kind);
+		}
+		return 0;
+	}
+
+	if (replayExpect(replay, REPLY_COMMAND))
+		return -1;
+
+	if (replayIsCommand(line, length, "QUIT")) {
+		replay->quit = 1;
+	} else if (replayIsCommand(line, length, "DATA")) {
+		/* The client waited for the 354 before the body. */
+		if (replayFlush(replay))
+			return -1;
+		if (replay->code == 354)
+			replay->mode = MODE_DATA;
+	}
+
+	return 0;
+}
+
+/*
+ * Send what a client sent at one time, a line at a time, then read
+ * the replies owed.
+ */
+static int
+replayInput(Replay *replay, const char *data, long length)
+{
+	long n;
+	const char *eol;
+
+	while (0 < length && !replay->quit) {
+		if (0 < replay->bdat) {
+			n = length < replay->bdat ? length : replay->bdat;
+			if (replayOut(replay, data, n))
+				return -1;
+			data += n;
+			length -= n;
+			if ((replay->bdat -= n) == 0 && replay->bdat_owed) {
+				replay->bdat_owed = 0;
+				if (replayExpect(replay, replay->bdat_kind))
+					return -1;
+			}
+			continue;
+		}
+
+		eol = memchr(data, '\n', length);
+		n = eol == NULL ? length : eol+1 - data;
+
+		/* Pass an over long line on in pieces. */
+		if (sizeof (replay->line) - replay->line_length < n) {
+			if (replayOut(replay, replay->line, replay->line_length))
+				return -1;
+			replay->line_length = 0;
+			if (sizeof (replay->line) < n) {
+				if (replayOut(replay, data, n - 1))
+					return -1;
+				data += n - 1;
+				length -= n - 1;
+				n = 1;
+			}
+		}
+
+		memcpy(replay->line + replay->line_length, data, n);
+		replay->line_length += n;
+		data += n;
+		length -= n;
+
+		if (eol != NULL) {
+			if (replayLine(replay))
+				return -1;
+			replay->line_length = 0;
+		}
+	}
+
+	return replayFlush(replay);
+}
+
+static int
+replayConnect(Replay *replay, long index)
+{
+	int on = 1;
+	struct timeval tv;
+	struct addrinfo *server = servers[index % nservers];
+
+	if ((replay->fd = socket(server->ai_family, SOCK_STREAM, 0)) < 0) {
+		replay->error = "socket error";
+		return -1;
+	}
+
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+	(void) setsockopt(replay->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	(void) setsockopt(replay->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+	(void) setsockopt(replay->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+
+	if (connect(replay->fd, server->ai_addr, server->ai_addrlen)) {
+		replay->error = "connect error";
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Run one session, pacing its records by their journal times.
+ */
+static void
+replaySession(Replay *replay, long index)
+{
+	int code;
+	long i;
+	uint64_t begin;
+	JournalRecord record;
+	Session *session = &sessions[index];
+
+	replay->totals.sessions++;
+
+	begin = monotonicUs();
+	if (replayConnect(replay, index) || (code = replayReply(replay)) < 0)
+		goto error0;
+	replayCount(replay, code, REPLY_COMMAND);
+
+	for (i = 0; i < session->length && !replay->quit; i++) {
+		memcpy(&record, session->records[i], sizeof (record));
+		if (record.type == JOURNAL_CLOSE)
+			break;
+		if (0 < speed)
+			sleepUntil(begin + (uint64_t) ((record.when - session->start) / speed));
+		if (replayInput(replay, session->records[i] + sizeof (record), record.length))
+			goto error0;
+	}
+
+	(void) close(replay->fd);
+	return;
+error0:
+	replay->totals.failed++;
+	if (verbose)
+		(void) fprintf(stderr, "session %ld to %s: %s: %s (%d)\n", index, hosts[index % nservers], replay->error, strerror(errno), errno);
+	if (0 <= replay->fd)
+		(void) close(replay->fd);
+}
+
+static void *
+replayWorker(void *data)
+{
+	long index;
+	uint64_t due, now;
+	Replay *replay = data;
+
+	for (;;) {
+		(void) pthread_mutex_lock(&replay_mutex);
+		index = next_session++;
+		(void) pthread_mutex_unlock(&replay_mutex);
+		if (nsessions <= index)
+			break;
+
+		if (0 < speed) {
+			due = replay_begin + (uint64_t) ((sessions[index].start - journal_start) / speed);
+			sleepUntil(due);
+			if (due + replay->totals.late < (now = monotonicUs()))
+				replay->totals.late = now - due;
+		}
+
+		memset(replay, 0, offsetof(Replay, totals));
+		replay->fd = -1;
+		replaySession(replay, index);
+	}
+
+	return NULL;
+}
+
+/***********************************************************************
+ *** Main
+ ***********************************************************************/
+
+static int
+serverResolve(int index, char *host)
+{
+	int rc;
+	char *port;
+	struct addrinfo hints;
+
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	/* host, host:port, [ipv6], or [ipv6]:port */
+	hosts[index] = host;
+	if ((host = strdup(host)) == NULL)
+		return -1;
+	port = "25";
+	if (*host == '[') {
+		host++;
+		if ((port = strchr(host, ']')) != NULL) {
+			*port++ = '\0';
+			port = *port == ':' ? port+1 : "25";
+		}
+	} else if ((port = strchr(host, ':')) != NULL && strchr(port+1, ':') == NULL) {
+		*port++ = '\0';
+	} else {
+		port = "25";
+	}
+
+	if ((rc = getaddrinfo(host, port, &hints, &servers[index])) != 0) {
+		(void) fprintf(stderr, "%s: %s\n", hosts[index], gai_strerror(rc));
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, i;
+	double seconds;
+	pthread_t *threads;
+	Replay *replays;
+
+	while ((ch = getopt(argc, argv, "c:s:t:v")) != -1) {
+		switch (ch) {
+		case 'c':
+			if ((concurrency = (int) strtol(optarg, NULL, 10)) <= 0)
+				concurrency = 1;
+			break;
+		case 's':
+			speed = strtod(optarg, NULL);
+			break;
+		case 't':
+			timeout = strtol(optarg, NULL, 10);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			optind = argc;
+		}
+	}
+
+	if (argc < optind + 2) {
+		(void) fputs(usage, stderr);
+		return EXIT_FAILURE;
+	}
+
+	if (journalLoad(argv[optind]))
+		return EXIT_FAILURE;
+
+	for (nservers = 0, optind++; optind < argc && nservers < MAX_SERVERS; optind++, nservers++) {
+		if (serverResolve(nservers, argv[optind]))
+			return EXIT_FAILURE;
+	}
+
+	if (nsessions < concurrency)
+		concurrency = nsessions < 1 ? 1 : (int) nsessions;
+	if ((threads = calloc(concurrency, sizeof (*threads))) == NULL
+	|| (replays = calloc(concurrency, sizeof (*replays))) == NULL) {
+		(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+		return EXIT_FAILURE;
+	}
+
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	replay_begin = monotonicUs();
+	for (i = 0; i < concurrency; i++) {
+		if (pthread_create(&threads[i], NULL, replayWorker, &replays[i])) {
+			(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+			return EXIT_FAILURE;
+		}
+	}
+	for (i = 0; i < concurrency; i++) {
+		(void) pthread_join(threads[i], NULL);
+		totals.sessions += replays[i].totals.sessions;
+		totals.failed += replays[i].totals.failed;
+		totals.messages += replays[i].totals.messages;
+		totals.bytes += replays[i].totals.bytes;
+		totals.replies[0] += replays[i].totals.replies[0];
+		totals.replies[1] += replays[i].totals.replies[1];
+		totals.replies[2] += replays[i].totals.replies[2];
+		totals.replies[3] += replays[i].totals.replies[3];
+		if (totals.late < replays[i].totals.late)
+			totals.late = replays[i].totals.late;
+	}
+	seconds = (monotonicUs() - replay_begin) / 1e6;
+
+	(void) printf(
+		"sessions %lu failed %lu messages %lu in %.3fs: %.1f sessions/s %.1f messages/s\n",
+		totals.sessions, totals.failed, totals.messages, seconds,
+		totals.sessions / seconds, totals.messages / seconds
+	);
+	(void) printf(
+		"replies 2xx %lu 3xx %lu 4xx %lu 5xx %lu, bytes out %llu, worst start lag %.3fs\n",
+		totals.replies[0], totals.replies[1], totals.replies[2], totals.replies[3],
+		totals.bytes, totals.late / 1e6
+	);
+
+	return totals.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
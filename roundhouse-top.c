@@ -0,0 +1,204 @@
+/*
+ * roundhouse-top.c
+ *
+ * Copyright 2013 by Anthony Howe. All rights reserved.
+ *
+ *
+ * Description
+ * -----------
+ *
+ * Live view of a running roundhouse, read from the statistics segment
+ * it keeps in POSIX shared memory.  The segment is only read; the
+ * counters in each thread's slot are summed and rates are worked out
+ * from one reading to the next.
+ *
+ *	roundhouse-top [-n name][-i seconds][-1]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+static char usage[] =
+"usage: roundhouse-top [-1][-i seconds][-n name]\n"
+"\n"
+"-1\t\tprint one reading of the counters and exit\n"
+"-i seconds\tinterval between screen updates; default 2\n"
+"-n name\t\tshared memory segment name; default " STATS_NAME "\n"
+"\n"
+;
+
+typedef struct {
+	StatsThread thread;
+	uint64_t threads;
+	StatsServer servers[STATS_SERVERS];
+} StatsTotal;
+
+static void
+statsSum(StatsHeader *hdr, StatsTotal *total)
+{
+	uint32_t i, j;
+	StatsThread *slot;
+	StatsServer *server;
+
+	memset(total, 0, sizeof (*total));
+
+	for (i = 0; i < hdr->nslots; i++) {
+		slot = STATS_SLOT(hdr, i);
+		if (slot->sessions == 0)
+			continue;
+
+		total->threads += slot->in_use != 0;
+		total->thread.sessions += slot->sessions;
+		total->thread.sessions_ended += slot->sessions_ended;
+		total->thread.messages += slot->messages;
+		total->thread.client_in += slot->client_in;
+		total->thread.client_out += slot->client_out;
+
+		for (j = 0; j < hdr->nservers && j < STATS_SERVERS; j++) {
+			server = STATS_SERVER(slot, j);
+			total->servers[j].connects += server->connects;
+			total->servers[j].disconnects += server->disconnects;
+			total->servers[j].write_errors += server->write_errors;
+			total->servers[j].bytes_out += server->bytes_out;
+			total->servers[j].replies[0] += server->replies[0];
+			total->servers[j].replies[1] += server->replies[1];
+			total->servers[j].replies[2] += server->replies[2];
+			total->servers[j].replies[3] += server->replies[3];
+		}
+	}
+}
+
+#define RATE(now, was, field)	(((now)->field - (was)->field) / seconds)
+
+static void
+statsPrint(StatsHeader *hdr, StatsTotal *now, StatsTotal *was, double seconds, int clear)
+{
+	uint32_t j;
+	StatsServer *server, *before;
+	unsigned long uptime = (unsigned long) (time(NULL) - hdr->started);
+
+	if (clear)
+		(void) fputs("\033[H\033[2J", stdout);
+
+	(void) printf(
+		"roundhouse pid %lu up %lud%02lu:%02lu:%02lu threads %lu\n\n",
+		(unsigned long) hdr->pid, uptime / 86400, uptime / 3600 % 24,
+		uptime / 60 % 60, uptime % 60, (unsigned long) now->threads
+	);
+	(void) printf(
+		"sessions %lu active %.1f/s, messages %lu %.1f/s, client in %.0f B/s out %.0f B/s\n\n",
+		(unsigned long) (now->thread.sessions - now->thread.sessions_ended),
+		RATE(now, was, thread.sessions),
+		(unsigned long) now->thread.messages, RATE(now, was, thread.messages),
+		RATE(now, was, thread.client_in), RATE(now, was, thread.client_out)
+	);
+
+	(void) printf(
+		"%-32s %5s %8s %8s %8s %8s %10s %8s %8s\n",
+		"server", "conn", "2xx/s", "3xx/s", "4xx/s", "5xx/s", "out B/s", "discon", "wr err"
+	);
+	for (j = 0; j < hdr->nservers && j < STATS_SERVERS; j++) {
+		server = &now->servers[j];
+		before = &was->servers[j];
+		(void) printf(
+			"%-32.32s %5ld %8.1f %8.1f %8.1f %8.1f %10.0f %8lu %8lu\n",
+			hdr->hosts[j], (long) (server->connects - server->disconnects),
+			(server->replies[0] - before->replies[0]) / seconds,
+			(server->replies[1] - before->replies[1]) / seconds,
+			(server->replies[2] - before->replies[2]) / seconds,
+			(server->replies[3] - before->replies[3]) / seconds,
+			(server->bytes_out - before->bytes_out) / seconds,
+			(unsigned long) server->disconnects,
+			(unsigned long) server->write_errors
+		);
+	}
+
+	(void) fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, fd, once;
+	struct stat sb;
+	StatsHeader *hdr;
+	unsigned interval;
+	const char *name;
+	StatsTotal totals[2];
+	struct timespec then, now;
+
+	once = 0;
+	interval = 2;
+	name = STATS_NAME;
+
+	while ((ch = getopt(argc, argv, "1i:n:")) != -1) {
+		switch (ch) {
+		case '1':
+			once = 1;
+			break;
+		case 'i':
+			if ((interval = (unsigned) strtoul(optarg, NULL, 10)) == 0)
+				interval = 1;
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		default:
+			(void) fputs(usage, stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+		(void) fprintf(stderr, "%s: %s (%d)\n", name, strerror(errno), errno);
+		return EXIT_FAILURE;
+	}
+	if (fstat(fd, &sb) || sb.st_size < STATS_HEADER_SIZE) {
+		(void) fprintf(stderr, "%s: segment too small\n", name);
+		return EXIT_FAILURE;
+	}
+	hdr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	(void) close(fd);
+	if (hdr == MAP_FAILED) {
+		(void) fprintf(stderr, "%s: %s (%d)\n", name, strerror(errno), errno);
+		return EXIT_FAILURE;
+	}
+	if (hdr->magic != STATS_MAGIC || hdr->version != STATS_VERSION
+	|| sb.st_size < STATS_HEADER_SIZE + hdr->nslots * hdr->slot_size) {
+		(void) fprintf(stderr, "%s: not a roundhouse statistics segment\n", name);
+		return EXIT_FAILURE;
+	}
+
+	statsSum(hdr, &totals[0]);
+	(void) clock_gettime(CLOCK_MONOTONIC, &then);
+
+	if (once) {
+		/* Rates since the daemon started. */
+		memset(&totals[1], 0, sizeof (totals[1]));
+		statsPrint(hdr, &totals[0], &totals[1], (double) (time(NULL) - hdr->started + 1), 0);
+		return EXIT_SUCCESS;
+	}
+
+	for (ch = 1; ; ch = !ch) {
+		(void) sleep(interval);
+		(void) clock_gettime(CLOCK_MONOTONIC, &now);
+		statsSum(hdr, &totals[ch]);
+		statsPrint(
+			hdr, &totals[ch], &totals[!ch],
+			(now.tv_sec - then.tv_sec) + (now.tv_nsec - then.tv_nsec) / 1e9, 1
+		);
+		then = now;
+	}
+
+	/*@notreached@*/
+	return EXIT_SUCCESS;
+}
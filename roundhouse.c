@@ -27,13 +27,13 @@
  * Build for Unix using GCC
  * ------------------------
  *
- *	gcc -02 -o -Icom/snert/include roundhouse roundhouse.c -lsnert
+ *	gcc -02 -o -Icom/snert/include roundhouse roundhouse.c histogram.c scanner.c -lsnert -lrt
  *
  *
  * Build for Windows using GCC
  * ---------------------------
  *
- *	gcc -DNDEBUG -02 -Icom/snert/include -mno-cygwin -mwindows -o roundhouse roundhouse.c -lsnert -lws2_32
+ *	gcc -DNDEBUG -02 -Icom/snert/include -mno-cygwin -mwindows -o roundhouse roundhouse.c histogram.c scanner.c -lsnert -lws2_32
  */
 
 /***********************************************************************
@@ -73,7 +73,9 @@
 
 #include <com/snert/lib/version.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #ifdef __sun__
@@ -99,6 +101,39 @@
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#ifdef HAVE_POLL_H
+# include <poll.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#ifdef HAVE_DIRENT_H
+# include <dirent.h>
+#endif
+#ifdef HAVE_NETDB_H
+# include <netdb.h>
+#endif
+#ifdef HAVE_ARPA_INET_H
+# include <arpa/inet.h>
+#endif
+#if defined(HAVE_ARPA_NAMESER_H) && defined(HAVE_RESOLV_H)
+# include <netinet/in.h>
+# include <arpa/nameser.h>
+# include <resolv.h>
+# define HAVE_RES_QUERY
+#endif
+#if defined(__linux__) && defined(SPLICE_F_NONBLOCK)
+# define HAVE_SPLICE
+#endif
 
 #include <com/snert/lib/io/Log.h>
 #include <com/snert/lib/io/socket2.h>
@@ -115,6 +150,11 @@
 #include <com/snert/lib/util/Token.h>
 #include <com/snert/lib/util/getopt.h>
 
+#include "histogram.h"
+#include "journal.h"
+#include "scanner.h"
+#include "stats.h"
+
 #if LIBSNERT_MAJOR < 1 || LIBSNERT_MINOR < 75
 # error "LibSnert/1.75 or better is required"
 #endif
@@ -136,17 +176,162 @@ static const char log_init[] = "init error %s(%d): %s (%d)";
  *** Global Variables
  ***********************************************************************/
 
+#ifndef CLIENT_BUFFER_SIZE
+#define CLIENT_BUFFER_SIZE		(16 * SMTP_TEXT_LINE_LENGTH)
+#endif
+
+#ifndef PIPELINE_MAX
+#define PIPELINE_MAX			100
+#endif
+
+#define PIPELINE_SIZE			(PIPELINE_MAX+2)
+
+/* Replies kept per server to compare with the first server's. */
+#ifndef COMPARE_WINDOW
+#define COMPARE_WINDOW			16
+#endif
+
+/*
+ * Session states.  The client input states read from the client,
+ * the others wait on replies from the down stream servers.
+ */
+typedef enum {
+	STATE_WELCOME,				/* Waiting on server welcome banners. */
+	STATE_COMMAND,				/* Reading a client command. */
+	STATE_REPLIES,				/* Waiting on command replies. */
+	STATE_XCLIENT,				/* Waiting on XCLIENT replies. */
+	STATE_AUTH_USER,			/* Reading AUTH LOGIN user name. */
+	STATE_AUTH_PASS,			/* Reading AUTH LOGIN password. */
+	STATE_DATA,				/* Reading client message content. */
+	STATE_DOT,				/* Waiting on end of message replies. */
+	STATE_BDAT,				/* Reading a client BDAT chunk. */
+	STATE_BDAT_DATA,			/* Waiting on DATA replies to start a BDAT chunk. */
+	STATE_RESET,				/* Waiting on RSET before pooling. */
+	STATE_SHADOWS,				/* Waiting on shadows to catch up after QUIT. */
+	STATE_CLOSE				/* Session is over. */
+} SessionState;
+
+#define STATE_IS_INPUT(s)	((s) == STATE_COMMAND || (s) == STATE_AUTH_USER || (s) == STATE_AUTH_PASS || (s) == STATE_DATA || (s) == STATE_BDAT)
+
+/*
+ * How the BDAT chunks of a message go to a server: as BDAT to those
+ * with CHUNKING, else converted to DATA with dot stuffing.
+ */
+#define CHUNK_BDAT		0x1
+#define CHUNK_DATA		0x2
+
+struct connection;
+
+/*
+ * Identifies the socket behind an event; slot -1 is the client.
+ */
+typedef struct {
+	struct connection *conn;
+	int slot;
+} EventSource;
+
+/*
+ * How long a server took to reply in one exchange, a command written
+ * to all the servers, kept so the servers can be compared.
+ */
+typedef struct {
+	uint32_t exchange;
+	unsigned char phase;
+	uint64_t us;
+} ReplyTime;
+
+typedef struct {
+	Socket2 *socket;
+	EventSource event;
+	int code;				/* Last reply code read. */
+	int pending;				/* Replies still to come. */
+	int connecting;				/* Non-blocking connect in progress. */
+	char *out;				/* Output not yet taken by the server. */
+	long out_offset;
+	long out_length;
+	long out_size;
+	long out_held;				/* Commands held at the end of out. */
+	int xclient;				/* XCLIENT sent for this command. */
+	unsigned caps;				/* EHLO extensions, see capabilityGet(). */
+	int chunk;				/* CHUNK_BDAT or CHUNK_DATA for this message. */
+	uint64_t sent;				/* Start of the reply wait, see smtpConnExpect(). */
+	uint64_t due;				/* Reply deadline, see replyDue(). */
+	int phase_first;			/* Oldest pending reply in phases. */
+	unsigned char phases[PIPELINE_SIZE];	/* Phase of each pending reply. */
+	uint32_t exchanges[PIPELINE_SIZE];	/* Exchange of each pending reply. */
+	uint32_t exchange;			/* Last exchange expected. */
+	ReplyTime timed[COMPARE_WINDOW];	/* Recent replies by exchange. */
+	int write_error;			/* Dropped for a write error. */
+	int sampled_out;			/* Not sampled for this session or message. */
+	Socket2 *parked;			/* Set aside while sampled out of a message. */
+	long length;				/* Unparsed input in buffer. */
+	char buffer[SMTP_REPLY_LINE_LENGTH*5+1];
+	char reply[SMTP_REPLY_LINE_LENGTH*5+1];
+} Downstream;
+
+/*
+ * A message being written to the spool, through a window mapped onto
+ * the end of the file that moves along as the file grows.
+ */
 typedef struct {
+	int fd;
+	int error;
+	int rcpts;
+	char *base;				/* Mapped segment. */
+	off_t offset;				/* File offset of the segment. */
+	size_t length;				/* Bytes used in the segment. */
+	char name[64];
+} Spool;
+
+typedef struct connection {
 	char *id;
+	SessionState state;
+	uint64_t deadline;			/* Client idle or reply deadline. */
+	uint64_t due;				/* Earliest reply deadline of a server. */
 	int connected;
+	int lazy;				/* -L servers not yet connected. */
+	int replay;				/* -L command that woke the servers. */
+	int routed;				/* -R server routed to, else -1. */
+	int route_next;				/* -R next to fail over to. */
+	int route_length;
+	int route[MAX_ARGV_LENGTH];		/* -R servers in failover order. */
+	int isEhlo;
+	int isEOH;
+	int batch;				/* Pipelined commands relayed. */
+	char *answer;				/* -P primary's replies to relay. */
+	long answer_length;
+	long answer_size;
+	long answer_last;			/* Start of the last reply in answer. */
+	uint32_t exchange;			/* Commands written to all servers. */
+	int chunking;				/* CHUNK_ modes of a BDAT message in progress. */
+	int chunk_last;				/* This chunk is BDAT LAST. */
+	int chunk_tail;				/* Last two bytes relayed as DATA. */
+	long chunk_length;			/* Chunk bytes still to relay. */
+	const char *chunk_error;		/* Reply once the chunk is discarded. */
 	Socket2 *client;
-	Socket2 **servers;
+	EventSource event;
+	Downstream *servers;
+	long clientOffset;			/* Start of unread client input. */
+	long clientLength;			/* End of client input. */
+	char clientBuffer[CLIENT_BUFFER_SIZE];
 	long inputLength;
 	char input[SMTP_TEXT_LINE_LENGTH+1];
-	char reply[SMTP_REPLY_LINE_LENGTH*5+1];
+	char login[512];			/* AUTH LOGIN user name, base64. */
+	char xclient[SMTP_TEXT_LINE_LENGTH];
 	char client_addr[IPV6_STRING_SIZE];
 	char client_name[DOMAIN_SIZE];
 	ParsePath *mail;
+	char *helo;				/* Spool or -L: HELO or EHLO command. */
+	char *auth;				/* Spool: AUTH PLAIN command. */
+	unsigned spool_count;
+	Spool spool;
+	int pipes[4];				/* splice() and tee() pipes. */
+	StatsThread *stats;			/* This thread's live statistics. */
+	uint32_t journal;			/* Journal session number, or 0. */
+	char session_id[20];
+	void *loop;				/* Owning event loop, if any. */
+	struct connection *prev;
+	struct connection *next;
 } Connection;
 
 typedef struct {
@@ -157,6 +342,9 @@ typedef struct {
 
 static int debug;
 static int connect_all;
+static int primary_mode;
+static int lazy_connect;
+static int event_threads;
 static int server_quit;
 static int daemon_mode = 1;
 static char *user_id = NULL;
@@ -165,10 +353,22 @@ static char *windows_service;
 static char *interfaces = "[::0]:" QUOTE(SMTP_PORT) ",0.0.0.0:" QUOTE(SMTP_PORT);
 static long socket_timeout = SOCKET_TIMEOUT;
 static long connect_timeout = CONNECT_TIMEOUT;
+static int pool_max_idle;
+static long pool_idle_timeout = POOL_IDLE_TIMEOUT;
+static long pool_probe_interval = POOL_PROBE_INTERVAL;
+static long reply_floor = REPLY_TIMEOUT_FLOOR;
+static long reply_ceiling;
+static int health_failures = HEALTH_FAILURES;
+static long health_retry = HEALTH_RETRY;
+static long health_retry_max = HEALTH_RETRY_MAX;
+static long output_high_water = OUTPUT_HIGH_WATER;
+static int output_wait;
+static char *spool_dir;
+static char *metrics_listen;
+static char *journal_path;
 
 static int nservers;
 static char *smtp_host[MAX_ARGV_LENGTH];
-static SocketAddress *servers[MAX_ARGV_LENGTH];
 
 static ServerSignals signals;
 
@@ -178,29 +378,62 @@ static char *key_pass = NULL;
 static char *key_crt_pem = NULL;
 
 #ifdef HAVE_OPENSSL_SSL_H
-static const char ehlo_tls[] = "250-AUTH " AUTH_MECHANISMS "\r\n250-PIPELINING\r\n250 STARTTLS\r\n";
+static const char ehlo_tls[] = "250-AUTH " AUTH_MECHANISMS "\r\n250-CHUNKING\r\n250-PIPELINING\r\n250 STARTTLS\r\n";
 # define GETOPT_TLS	"c:C:k:K:"
 #else
 # define GETOPT_TLS
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+# define GETOPT_EVENT	"E:"
+#else
+# define GETOPT_EVENT
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+# define GETOPT_SPOOL	"S:"
+#else
+# define GETOPT_SPOOL
+#endif
+
 static const char reply_421[] = "421 service temporarily unavailable\r\n";
-static const char ehlo_basic[] = "250-AUTH " AUTH_MECHANISMS "\r\n250 PIPELINING\r\n";
+static const char ehlo_basic[] = "250-AUTH " AUTH_MECHANISMS "\r\n250-CHUNKING\r\n250 PIPELINING\r\n";
 static const char *ehlo_reply = ehlo_basic;
 
 static char *usage_message =
-"usage: " _NAME " [-Adqv][-i ip,...][-t timeout][-u name][-g name]\n"
+"usage: " _NAME " [-AdLPqv][-i ip,...][-t timeout][-u name][-g name]\n"
+#ifdef HAVE_SYS_EPOLL_H
+"       [-E threads]\n"
+#endif
 #ifdef HAVE_OPENSSL_SSL_H
 "       [-c ca_pem][-C ca_dir][-k key_crt_pem][-K key_pass]\n"
 #endif
-"       [-w add|remove] server ...\n"
+#ifdef HAVE_SYS_MMAN_H
+"       [-S dir]\n"
+#endif
+"       [-b size[,wait]][-j file][-m ip:port][-p max[,idle[,probe]]]\n"
+"       [-F failures[,retry[,max]]][-T floor[,ceiling]][-D rr|least]\n"
+"       [-R least|hash][-w add|remove] server ...\n"
 "\n"
 "-A\t\tall down stream servers must connect, else 421 the client.\n"
+"-b size,wait\tbytes of output queued per server before it is dropped;\n"
+"\t\tdefault " QUOTE(OUTPUT_HIGH_WATER) ". With wait, hold the client until\n"
+"\t\tthe queue drains instead\n"
 #ifdef HAVE_OPENSSL_SSL_H
 "-c ca_pem\tCertificate Authority root certificate chain file\n"
 "-C ca_dir\tCertificate Authority root certificate directory\n"
 #endif
 "-d\t\tdisable daemon mode and run as a foreground application\n"
+"-D rr|least\tspread the sessions over the addresses of a server name\n"
+"\t\tround robin, or to the one with the fewest; default rr\n"
+#ifdef HAVE_SYS_EPOLL_H
+"-E threads\tnumber of event loop threads to multiplex all sessions;\n"
+"\t\tdefault 0 for one thread per session\n"
+#endif
+"-F failures,retry,max\n"
+"\t\tskip a server after this many connect or welcome failures\n"
+"\t\tin a row, 0 never; try it again after retry seconds, doubled\n"
+"\t\tafter each failed try up to max; default 3,1,60\n"
 "-g name\t\trun as this group\n"
 "-i ip,...\tcomma separated list of IPv4 or IPv6 addresses and\n"
 "\t\toptional :port number to listen on for SMTP connections;\n"
@@ -210,14 +443,44 @@ static char *usage_message =
 "\t\tor explicitly set to an empty string then disable STARTTLS.\n"
 "-K key_pass\tpassword for private key; default no password\n"
 #endif
+"-j file\t\tappend what each client sends to a journal file, for\n"
+"\t\troundhouse-replay\n"
+"-L\t\tanswer the welcome and EHLO ourselves, and only connect to\n"
+"\t\tthe servers once the client sends a command that needs them\n"
+"-m ip:port\tserve down stream reply latency histograms per server and\n"
+"\t\tSMTP phase over HTTP in Prometheus text format, and at\n"
+"\t\t/compare a table of the servers side by side\n"
+"-P\t\tthe first server is the primary, whose replies are relayed\n"
+"\t\tto the client; the others are shadows, fed the same commands\n"
+"\t\tbut never waited on\n"
+"-p max,idle,probe\n"
+"\t\tkeep up to max idle connections per server for reuse by\n"
+"\t\tlater sessions; close them after idle seconds, default 30;\n"
+"\t\tNOOP those idle longer than probe seconds, default 5\n"
 "-q\t\tx1 slow quit, x2 quit now, x3 restart, x4 restart-if\n"
+"-R least|hash\trelay each session to only one server, the one with the\n"
+"\t\tfewest sessions or by client IP on a hash ring, failing\n"
+"\t\tover to the next should it not connect or welcome\n"
+#ifdef HAVE_SYS_MMAN_H
+"-S dir\t\tspool each message and accept it as soon as it is on disk,\n"
+"\t\tthen replay it to each server in the background\n"
+#endif
+"-T floor,ceiling\n"
+"\t\ttime out each server's replies by how long it usually takes\n"
+"\t\tin that SMTP phase, but no less than floor nor more than\n"
+"\t\tceiling seconds, default 10 and -t; 0 uses -t for all\n"
 "-t timeout\tclient socket timeout in seconds; default 300\n"
 "-u name\t\trun as this user\n"
 "-v\t\tx1 log SMTP; x2 SMTP and message headers; x3 everything\n"
 "-w add|remove\tadd or remove Windows service; ignored on unix\n"
 "\n"
-"server\t\thost[:port] of down stream mail server to forward mail to;\n"
-"\t\tdefault port " QUOTE(SMTP_PORT) "\n"
+"server\t\thost[:port][=percent[/by]] of down stream mail server to\n"
+"\t\tforward mail to; default port " QUOTE(SMTP_PORT) ". A host name\n"
+"\t\tor mx:domain is looked up again as its DNS records expire,\n"
+"\t\tand stands for all of its addresses, see -D. With percent,\n"
+"\t\tthe server only gets that share of the sessions, picked at\n"
+"\t\trandom or by client /ip, or of the messages, picked at random\n"
+"\t\t/msg or by /mail sender\n"
 "\n"
 _NAME " " _VERSION " " _COPYRIGHT "\n"
 ;
@@ -228,16 +491,262 @@ _NAME " " _VERSION " " _COPYRIGHT "\n"
 
 #undef syslog
 
+static void
+logWriteV(int level, const char *fmt, va_list args)
+{
+	if (logFile == NULL)
+		vsyslog(level, fmt, args);
+	else
+		LogV(level, fmt, args);
+}
+
+static void
+logWrite(int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	logWriteV(level, fmt, args);
+	va_end(args);
+}
+
+/***********************************************************************
+ *** Logging
+ ***********************************************************************/
+
+/*
+ * Once logStart() is called, each thread formats its log lines into a
+ * ring of its own and one log thread writes them out to syslog or the
+ * log file, so a session never waits on the write.  A ring has one
+ * writer and one reader, so neither takes a lock; the head and tail
+ * are only ever advanced, by the owner and the log thread each, after
+ * a memory barrier.  A line that does not fit is dropped and counted.
+ * Like the metrics blocks, a ring left by a thread that ends goes to
+ * the next thread that needs one.
+ */
+#define LOG_PAD			(-1)		/* Skip to the start of the ring. */
+#define LOG_ALIGN(n)		(((n) + sizeof (LogRecord) - 1) & ~(sizeof (LogRecord) - 1))
+
+typedef struct {
+	short level;
+	unsigned short length;			/* Text and its NUL that follow. */
+} LogRecord;
+
+typedef struct log_ring {
+	struct log_ring *next;
+	int in_use;
+	volatile unsigned long head;		/* Advanced by the owning thread. */
+	volatile unsigned long tail;		/* Advanced by the log thread. */
+	volatile unsigned long dropped;
+	char data[LOG_RING_SIZE];
+} LogRing;
+
+static pthread_t log_thread;
+static volatile int log_running;
+static pthread_key_t log_key;
+static LogRing *log_rings;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+logRelease(void *data)
+{
+	LogRing *ring = data;
+
+	(void) pthread_mutex_lock(&log_mutex);
+	ring->in_use = 0;
+	(void) pthread_mutex_unlock(&log_mutex);
+}
+
+static LogRing *
+logClaim(void)
+{
+	LogRing *ring;
+
+	(void) pthread_mutex_lock(&log_mutex);
+	for (ring = log_rings; ring != NULL; ring = ring->next) {
+		if (!ring->in_use)
+			break;
+	}
+	if (ring == NULL && (ring = calloc(1, sizeof (*ring))) != NULL) {
+		ring->next = log_rings;
+		log_rings = ring;
+	}
+	if (ring != NULL)
+		ring->in_use = 1;
+	(void) pthread_mutex_unlock(&log_mutex);
+
+	if (ring != NULL)
+		(void) pthread_setspecific(log_key, ring);
+
+	return ring;
+}
+
+/*
+ * Format a line into the calling thread's ring.  Return -1 if the
+ * line must be written directly instead.
+ */
+static int
+logPush(int level, const char *fmt, va_list args)
+{
+	LogRing *ring;
+	LogRecord *record;
+	unsigned long head, offset, need, pad;
+	char text[SMTP_TEXT_LINE_LENGTH * 2];
+	int length;
+
+	if ((ring = pthread_getspecific(log_key)) == NULL && (ring = logClaim()) == NULL)
+		return -1;
+
+	if ((length = vsnprintf(text, sizeof (text), fmt, args)) < 0)
+		return 0;
+	if (sizeof (text) <= length)
+		length = sizeof (text) - 1;
+
+	head = ring->head;
+	offset = head % LOG_RING_SIZE;
+	need = LOG_ALIGN(sizeof (*record) + length + 1);
+	pad = LOG_RING_SIZE - offset < need ? LOG_RING_SIZE - offset : 0;
+
+	if (LOG_RING_SIZE - (head - ring->tail) < pad + need) {
+		ring->dropped++;
+		return 0;
+	}
+	if (0 < pad) {
+		((LogRecord *) &ring->data[offset])->level = LOG_PAD;
+		head += pad;
+		offset = 0;
+	}
+
+	record = (LogRecord *) &ring->data[offset];
+	record->level = level;
+	record->length = length + 1;
+	memcpy(&record[1], text, length);
+	((char *) &record[1])[length] = '\0';
+
+	/* The record must be in place before the log thread sees it. */
+	__sync_synchronize();
+	ring->head = head + need;
+
+	return 0;
+}
+
+/*
+ * Write out what is in one ring.  Return the number of lines.
+ */
+static unsigned long
+logDrain(LogRing *ring)
+{
+	LogRecord *record;
+	unsigned long head, tail, lines, dropped;
+
+	lines = 0;
+	tail = ring->tail;
+	head = ring->head;
+	__sync_synchronize();
+
+	while (tail != head) {
+		record = (LogRecord *) &ring->data[tail % LOG_RING_SIZE];
+		if (record->level == LOG_PAD) {
+			tail += LOG_RING_SIZE - tail % LOG_RING_SIZE;
+			continue;
+		}
+		logWrite(record->level, "%s", (char *) &record[1]);
+		tail += LOG_ALIGN(sizeof (*record) + record->length);
+		lines++;
+	}
+
+	/* Done reading before the space is given back. */
+	__sync_synchronize();
+	ring->tail = tail;
+
+	if (0 < (dropped = ring->dropped)) {
+		ring->dropped -= dropped;
+		logWrite(LOG_WARN, "log overflow, %lu lines dropped", dropped);
+	}
+
+	return lines;
+}
+
+static void *
+logWriter(void *data)
+{
+	LogRing *ring;
+	unsigned long lines;
+	struct timespec pause = { 0, 10000000 };
+
+	do {
+		(void) pthread_mutex_lock(&log_mutex);
+		ring = log_rings;
+		(void) pthread_mutex_unlock(&log_mutex);
+
+		for (lines = 0; ring != NULL; ring = ring->next)
+			lines += logDrain(ring);
+		if (lines == 0 && log_running)
+			(void) nanosleep(&pause, NULL);
+	} while (log_running || 0 < lines);
+
+	return NULL;
+}
+
+static int
+logStart(void)
+{
+	if (pthread_key_create(&log_key, logRelease)) {
+		syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
+		return -1;
+	}
+
+	log_running = 1;
+	if (pthread_create(&log_thread, NULL, logWriter, NULL)) {
+		syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
+		log_running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write out what is left and go back to writing directly.
+ */
+static void
+logStop(void)
+{
+	LogRing *ring;
+
+	if (log_running) {
+		log_running = 0;
+		(void) pthread_join(log_thread, NULL);
+
+		/* Catch a line pushed as the log thread finished. */
+		for (ring = log_rings; ring != NULL; ring = ring->next)
+			(void) logDrain(ring);
+	}
+}
+
+/*
+ * Debug lines, SMTP and the like, are only logged with -v, and are
+ * dropped before they are formatted.
+ */
 void
 syslog(int level, const char *fmt, ...)
 {
+	int rc;
 	va_list args;
 
+	if (level == LOG_DEBUG && debug == 0)
+		return;
+
+	if (log_running) {
+		va_start(args, fmt);
+		rc = logPush(level, fmt, args);
+		va_end(args);
+		if (rc == 0)
+			return;
+	}
+
 	va_start(args, fmt);
-	if (logFile == NULL)
-		vsyslog(level, fmt, args);
-	else
-		LogV(level, fmt, args);
+	logWriteV(level, fmt, args);
 	va_end(args);
 }
 
@@ -262,512 +771,5425 @@ savePid(char *file)
 	return 0;
 }
 
-static long
-smtpConnPrint(Connection *conn, int index, const char *line)
+static uint64_t
+monotonicUs(void)
 {
-	Socket2 *s;
+	struct timespec now;
 
-	if (index < 0)
-		/* Sending to the client. */
-		syslog(LOG_DEBUG, LOG_FMT "< %s", LOG_ARG, line);
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
 
-	s = index < 0 ? conn->client : conn->servers[index];
-	if (s == NULL) {
-		/* Server in this slot has been disconnected. */
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/***********************************************************************
+ *** Server Resolution
+ ***********************************************************************/
+
+/*
+ * A server given by host name, or as mx:domain for the domain's most
+ * preferred mail exchangers, can stand for several addresses, such as
+ * a farm of test servers behind one name.  Each session connects to
+ * one of them, picked in turn or, with -D least, the one with fewest
+ * sessions.  A thread looks the names up again as their DNS records
+ * expire, keeping the last addresses should a look up fail.  An IP
+ * address or socket path is taken as is.
+ */
+typedef struct {
+	SocketAddress address;
+	unsigned long sessions;			/* Connected to it now. */
+} Target;
+
+typedef struct {
+	char *name;				/* Host or domain, else NULL for an address. */
+	int mx;					/* Look up the domain's MX hosts. */
+	unsigned port;
+	unsigned turn;				/* Next to pick round robin. */
+	uint64_t expires;			/* When to look the name up again. */
+	int length;
+	Target targets[RESOLVE_MAX_ADDRESSES];
+} Resolved;
+
+static int resolve_least;
+static int resolve_running;
+static pthread_t resolve_thread;
+static Resolved resolved[MAX_ARGV_LENGTH];
+static pthread_cond_t resolve_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t resolve_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+resolveSame(SocketAddress *a, SocketAddress *b)
+{
+	if (a->sa.sa_family != b->sa.sa_family)
 		return 0;
-	}
+	if (a->sa.sa_family == AF_INET)
+		return a->in.sin_port == b->in.sin_port && a->in.sin_addr.s_addr == b->in.sin_addr.s_addr;
+	if (a->sa.sa_family == AF_INET6)
+		return a->in6.sin6_port == b->in6.sin6_port && memcmp(&a->in6.sin6_addr, &b->in6.sin6_addr, sizeof (a->in6.sin6_addr)) == 0;
 
-	return socketWrite(s, (unsigned char *) line, strlen(line));
+	return memcmp(a, b, sizeof (*a)) == 0;
 }
 
+/*
+ * Return the index of an address among a server's, or -1.  Called
+ * with resolve_mutex held.
+ */
 static int
-smtpConnGetResponse(Connection *conn, int index, char *line, long size, int *code)
+resolveFind(Resolved *r, SocketAddress *address)
 {
-	Socket2 *s;
-	char *stop, *here;
-	long length, value;
+	int i;
 
-	if (conn == NULL || line == NULL)
-		return EFAULT;
-
-	s = conn->servers[index];
-	if (s == NULL) {
-		/* Server in this slot has been disconnected. */
-		return EFAULT;
+	for (i = 0; i < r->length; i++) {
+		if (resolveSame(&r->targets[i].address, address))
+			return i;
 	}
 
-	/* Ideally we should collect _all_ the response lines into a variable
-	 * length buffer (see com/snert/lib/util/Buf.h), but I don't see any
-	 * real need for it just yet.
-	 */
-
-	value = 450;
+	return -1;
+}
 
-	socketSetTimeout(s, socket_timeout / nservers);
+static void
+resolveAdd(Target *targets, int *length, const void *sa, socklen_t size)
+{
+	int i;
+	Target target;
 
-	length = 0;
-	here = line;
-	do {
-		errno = 0;
-		here += length;
-		switch (length = socketReadLine2(s, here, size - (here - line), 1)) {
-		case SOCKET_ERROR:
-			syslog(LOG_ERR, LOG_FMT "read error: %s (%d)", LOG_ARG, strerror(errno), errno);
-			return errno;
-		case SOCKET_EOF:
-			syslog(LOG_ERR, LOG_FMT "unexpected EOF", LOG_ARG);
-			return errno;
-		}
+	if (RESOLVE_MAX_ADDRESSES <= *length || sizeof (target.address) < size)
+		return;
 
-		/* Did we read sufficient characters for a response code? */
-		if (length < 4)
-			return EIO;
+	memset(&target, 0, sizeof (target));
+	memcpy(&target.address, sa, size);
 
-		syslog(LOG_DEBUG, LOG_FMT "#%d < %s", LOG_ARG, index, here);
+	for (i = 0; i < *length; i++) {
+		if (resolveSame(&targets[i].address, &target.address))
+			return;
+	}
+	targets[(*length)++] = target;
+}
 
-		value = strtol(here, &stop, 10);
-	} while (here + 3 == stop && here[3] == '-');
+/*
+ * Add a host's addresses by way of the system's resolver, which also
+ * knows the hosts file, but not how long the answer is good for.
+ */
+static void
+resolveAddrInfo(const char *host, unsigned port, Target *targets, int *length)
+{
+	char service[16];
+	struct addrinfo hints, *list, *ai;
 
-	if (code != NULL)
-		*code = value;
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_socktype = SOCK_STREAM;
+	(void) snprintf(service, sizeof (service), "%u", port);
 
-	return 0;
+	if (getaddrinfo(host, service, &hints, &list) == 0) {
+		for (ai = list; ai != NULL; ai = ai->ai_next)
+			resolveAdd(targets, length, ai->ai_addr, ai->ai_addrlen);
+		freeaddrinfo(list);
+	}
 }
 
+#ifdef HAVE_RES_QUERY
+/*
+ * Add a host's A and AAAA records, lowering ttl to the shortest seen
+ * in seconds.  Fall back on getaddrinfo() for a host DNS does not know.
+ */
 static void
-smtpConnDisconnect(Connection *conn, int index)
+resolveHost(const char *host, unsigned port, Target *targets, int *length, unsigned long *ttl)
 {
-	if (conn->servers[index] != NULL) {
-		syslog(LOG_DEBUG, LOG_FMT "#%d disconnecting from %s", LOG_ARG, index, smtp_host[index]);
-		socketClose(conn->servers[index]);
-		conn->servers[index] = NULL;
-		conn->connected--;
-		free(conn->mail);
+	ns_rr rr;
+	ns_msg msg;
+	int i, j, size, found;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+	unsigned char answer[RESOLVE_ANSWER_SIZE];
+	static const int types[] = { ns_t_a, ns_t_aaaa };
+
+	found = *length;
+	for (i = 0; i < sizeof (types) / sizeof (*types); i++) {
+		if ((size = res_query(host, ns_c_in, types[i], answer, sizeof (answer))) < 0 || ns_initparse(answer, size, &msg))
+			continue;
+
+		for (j = 0; j < ns_msg_count(msg, ns_s_an); j++) {
+			if (ns_parserr(&msg, ns_s_an, j, &rr))
+				break;
+			if (ns_rr_type(rr) != types[i])
+				continue;
+			if (ns_rr_ttl(rr) < *ttl)
+				*ttl = ns_rr_ttl(rr);
+
+			if (types[i] == ns_t_a && ns_rr_rdlen(rr) == sizeof (in.sin_addr)) {
+				memset(&in, 0, sizeof (in));
+				in.sin_family = AF_INET;
+				in.sin_port = htons(port);
+				memcpy(&in.sin_addr, ns_rr_rdata(rr), sizeof (in.sin_addr));
+				resolveAdd(targets, length, &in, sizeof (in));
+			} else if (types[i] == ns_t_aaaa && ns_rr_rdlen(rr) == sizeof (in6.sin6_addr)) {
+				memset(&in6, 0, sizeof (in6));
+				in6.sin6_family = AF_INET6;
+				in6.sin6_port = htons(port);
+				memcpy(&in6.sin6_addr, ns_rr_rdata(rr), sizeof (in6.sin6_addr));
+				resolveAdd(targets, length, &in6, sizeof (in6));
+			}
+		}
+	}
+
+	if (found == *length) {
+		resolveAddrInfo(host, port, targets, length);
+		if (found < *length && RESOLVE_TTL_MIN / 1000 < *ttl)
+			*ttl = RESOLVE_TTL_MIN / 1000;
 	}
 }
 
 /*
- * Perform man-in-the-middle AUTH LOGIN dialogue with the client
- * and convert the AUTH LOGIN into an AUTH PLAIN. The conn->input
- * buffer will then be forwarded to the SMTP servers.
- *
- *	>>> AUTH LOGIN
- *	334 VXNlcm5hbWU6
- *	>>> dGVzdA==
- *	334 UGFzc3dvcmQ6
- * 	>>> dEVzdDQy
- *	235 2.0.0 OK Authenticated
+ * Add the addresses of a domain's most preferred MX hosts that have
+ * any, else those of the domain itself when it has no MX (RFC 5321
+ * section 5.1).
  */
-int
-authLogin(Connection *conn)
+static void
+resolveMx(const char *domain, unsigned port, Target *targets, int *length, unsigned long *ttl)
 {
-	int rx;
-	int rc = -1;
-	Base64 base64;
-	long userLen, passLen;
-	char userB64[512], passB64[512], *buffer;
+	ns_rr rr;
+	ns_msg msg;
+	const unsigned char *rdata;
+	int i, j, size, count, preference;
+	unsigned char answer[RESOLVE_ANSWER_SIZE];
+	struct {
+		int preference;
+		char host[NS_MAXDNAME];
+	} mx[RESOLVE_MAX_ADDRESSES], swap;
+
+	count = 0;
+	if ((size = res_query(domain, ns_c_in, ns_t_mx, answer, sizeof (answer))) < 0 || ns_initparse(answer, size, &msg)) {
+		if (h_errno == NO_DATA)
+			resolveHost(domain, port, targets, length, ttl);
+		return;
+	}
 
-	if (conn->input[sizeof ("AUTH LOGIN")-1] == '\0') {
-		smtpConnPrint(conn, -1, "334 VXNlcm5hbWU6\r\n");
+	for (i = 0; i < ns_msg_count(msg, ns_s_an) && count < RESOLVE_MAX_ADDRESSES; i++) {
+		if (ns_parserr(&msg, ns_s_an, i, &rr))
+			break;
+		if (ns_rr_type(rr) != ns_t_mx || ns_rr_rdlen(rr) < 3)
+			continue;
+		if (ns_rr_ttl(rr) < *ttl)
+			*ttl = ns_rr_ttl(rr);
 
-		if (!socketHasInput(conn->client, socket_timeout))
-			goto error0;
+		rdata = ns_rr_rdata(rr);
+		mx[count].preference = ns_get16(rdata);
+		if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), rdata + NS_INT16SZ, mx[count].host, sizeof (mx[count].host)) < 0)
+			continue;
 
-		if ((userLen = socketReadLine2(conn->client, userB64, sizeof (userB64), 0)) < 0) {
-			syslog(LOG_ERR, LOG_FMT "client read error: %s (%d)%c", LOG_ARG, strerror(errno), errno, userLen == SOCKET_EOF ? '!' : ' ');
-			goto error0;
-		}
+		/* Skip a null MX (RFC 7505), "." for no mail. */
+		if (*mx[count].host == '\0')
+			continue;
 
-		syslog(LOG_DEBUG, LOG_FMT "> %s", LOG_ARG, userB64);
-	} else {
-		TextCopy(userB64, sizeof (userB64), conn->input+sizeof ("AUTH LOGIN"));
+		/* Keep them in order of preference. */
+		for (j = count++; 0 < j && mx[j].preference < mx[j-1].preference; j--) {
+			swap = mx[j];
+			mx[j] = mx[j-1];
+			mx[j-1] = swap;
+		}
 	}
 
-	smtpConnPrint(conn, -1, "334 UGFzc3dvcmQ6\r\n");
-
-	if (!socketHasInput(conn->client, socket_timeout))
-		goto error0;
+	if (count == 0 && ns_msg_count(msg, ns_s_an) == 0)
+		resolveHost(domain, port, targets, length, ttl);
 
-	if ((passLen = socketReadLine2(conn->client, passB64, sizeof (passB64), 0)) < 0) {
-		syslog(LOG_ERR, LOG_FMT "client read error: %s (%d)%c", LOG_ARG, strerror(errno), errno, passLen == SOCKET_EOF ? '!' : ' ');
-		goto error0;
+	/* Fall back on the next preference only when none of the
+	 * better ones have an address.
+	 */
+	for (i = 0; i < count && *length == 0; ) {
+		preference = mx[i].preference;
+		for ( ; i < count && mx[i].preference == preference; i++)
+			resolveHost(mx[i].host, port, targets, length, ttl);
 	}
-
-	syslog(LOG_DEBUG, LOG_FMT "> %s", LOG_ARG, passB64);
-
-	if ((base64 = Base64Create()) == NULL) {
+}
+#else
+static void
+resolveHost(const char *host, unsigned port, Target *targets, int *length, unsigned long *ttl)
+{
+	resolveAddrInfo(host, port, targets, length);
+	*ttl = RESOLVE_TTL_MIN / 1000;
+}
+#endif /* HAVE_RES_QUERY */
+
+/*
+ * Look up a server's name again and swap in its new addresses, which
+ * keep the session counts of those it had before.  Return -1 if none
+ * were found, in which case the old addresses are kept.
+ */
+static int
+resolveLookup(int index)
+{
+	long ms;
+	uint64_t now;
+	int i, j, length, changed;
+	unsigned long ttl;
+	Resolved *r = &resolved[index];
+	Target targets[RESOLVE_MAX_ADDRESSES];
+
+	length = 0;
+	ttl = RESOLVE_TTL_MAX / 1000;
+#ifdef HAVE_RES_QUERY
+	if (r->mx)
+		resolveMx(r->name, r->port, targets, &length, &ttl);
+	else
+#endif
+	resolveHost(r->name, r->port, targets, &length, &ttl);
+
+	ms = ttl * 1000 < RESOLVE_TTL_MIN ? RESOLVE_TTL_MIN : ttl * 1000;
+	now = monotonicUs();
+
+	(void) pthread_mutex_lock(&resolve_mutex);
+	if (length <= 0) {
+		r->expires = now + RESOLVE_RETRY * 1000;
+		length = r->length;
+		(void) pthread_mutex_unlock(&resolve_mutex);
+		syslog(LOG_ERR, "#%d %s look up failed, keeping %d addresses", index, smtp_host[index], length);
+		return -1;
+	}
+	changed = length != r->length;
+	for (i = 0; i < length; i++) {
+		if ((j = resolveFind(r, &targets[i].address)) < 0)
+			changed = 1;
+		else
+			targets[i].sessions = r->targets[j].sessions;
+	}
+	memcpy(r->targets, targets, length * sizeof (*targets));
+	r->length = length;
+	r->expires = now + ms * 1000;
+	(void) pthread_mutex_unlock(&resolve_mutex);
+
+	if (changed)
+		syslog(LOG_INFO, "#%d %s has %d addresses for %lds", index, smtp_host[index], length, ms / 1000);
+
+	return 0;
+}
+
+/*
+ * Parse a server's host[:port] or mx:domain[:port] and look it up the
+ * first time.  Return -1 on error.
+ */
+static int
+resolveInit(int index, const char *spec)
+{
+	int mx;
+	char *host, *port;
+	SocketAddress *address;
+	unsigned char ip[sizeof (struct in6_addr)];
+	Resolved *r = &resolved[index];
+
+	r->length = 0;
+	r->name = NULL;
+	if ((mx = 0 < TextInsensitiveStartsWith(spec, "mx:")))
+		spec += sizeof ("mx:")-1;
+#ifndef HAVE_RES_QUERY
+	if (mx) {
+		errno = ENOSYS;
+		return -1;
+	}
+#endif
+	if ((host = strdup(spec)) == NULL)
+		return -1;
+
+	/* A single colon separates the port from a host, more is an
+	 * IPv6 address without one.
+	 */
+	if ((port = strrchr(host, ':')) != NULL && strchr(host, ':') == port)
+		*port++ = '\0';
+	else
+		port = NULL;
+
+	if (!mx && (*host == '/' || *host == '[' || inet_pton(AF_INET, host, ip) == 1 || inet_pton(AF_INET6, host, ip) == 1)) {
+		free(host);
+		if ((address = socketAddressCreate(spec, SMTP_PORT)) == NULL)
+			return -1;
+		r->targets[0].address = *address;
+		r->targets[0].sessions = 0;
+		r->length = 1;
+		free(address);
+		return 0;
+	}
+
+	r->mx = mx;
+	r->name = host;
+	r->port = port == NULL ? SMTP_PORT : (unsigned) strtol(port, NULL, 10);
+
+	if (resolveLookup(index)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Pick a server's address for a new connection.  Return -1 if it has
+ * none.
+ */
+static int
+resolvePick(int index, SocketAddress *address)
+{
+	int i, j, pick;
+	Resolved *r = &resolved[index];
+
+	pick = -1;
+	(void) pthread_mutex_lock(&resolve_mutex);
+	if (0 < r->length) {
+		pick = r->turn++ % r->length;
+		if (resolve_least) {
+			/* Ties go round robin. */
+			for (i = 1; i < r->length; i++) {
+				j = (pick + i) % r->length;
+				if (r->targets[j].sessions < r->targets[pick].sessions)
+					pick = j;
+			}
+		}
+		*address = r->targets[pick].address;
+	}
+	(void) pthread_mutex_unlock(&resolve_mutex);
+
+	return pick < 0 ? -1 : 0;
+}
+
+/*
+ * Count a session connected to one of a server's addresses.  Return
+ * -1 if the address is no longer the server's.
+ */
+static int
+resolveHold(int index, SocketAddress *address)
+{
+	int i;
+	Resolved *r = &resolved[index];
+
+	(void) pthread_mutex_lock(&resolve_mutex);
+	if (0 <= (i = resolveFind(r, address)))
+		r->targets[i].sessions++;
+	(void) pthread_mutex_unlock(&resolve_mutex);
+
+	return i < 0 ? -1 : 0;
+}
+
+/*
+ * A session closed its connection or returned it to the pool.
+ */
+static void
+resolveDrop(int index, SocketAddress *address)
+{
+	int i;
+	Resolved *r = &resolved[index];
+
+	(void) pthread_mutex_lock(&resolve_mutex);
+	if (0 <= (i = resolveFind(r, address)) && 0 < r->targets[i].sessions)
+		r->targets[i].sessions--;
+	(void) pthread_mutex_unlock(&resolve_mutex);
+}
+
+static void *
+resolveWorker(void *data)
+{
+	int i;
+	uint64_t now;
+	struct timespec until;
+
+	(void) pthread_mutex_lock(&resolve_mutex);
+	while (resolve_running) {
+		(void) clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec++;
+		(void) pthread_cond_timedwait(&resolve_cond, &resolve_mutex, &until);
+
+		now = monotonicUs();
+		for (i = 0; resolve_running && i < nservers; i++) {
+			if (resolved[i].name == NULL || now < resolved[i].expires)
+				continue;
+			(void) pthread_mutex_unlock(&resolve_mutex);
+			(void) resolveLookup(i);
+			(void) pthread_mutex_lock(&resolve_mutex);
+		}
+	}
+	(void) pthread_mutex_unlock(&resolve_mutex);
+
+	return NULL;
+}
+
+/*
+ * Start the thread that looks up server names again, if any were given.
+ */
+static int
+resolveStart(void)
+{
+	int i;
+
+	for (i = 0; i < nservers; i++) {
+		if (resolved[i].name != NULL)
+			break;
+	}
+	if (nservers <= i)
+		return 0;
+
+	resolve_running = 1;
+	if (pthread_create(&resolve_thread, NULL, resolveWorker, NULL)) {
+		syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
+		resolve_running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+resolveStop(void)
+{
+	if (!resolve_running)
+		return;
+
+	(void) pthread_mutex_lock(&resolve_mutex);
+	resolve_running = 0;
+	(void) pthread_cond_signal(&resolve_cond);
+	(void) pthread_mutex_unlock(&resolve_mutex);
+	(void) pthread_join(resolve_thread, NULL);
+}
+
+/***********************************************************************
+ *** Connection Pool
+ ***********************************************************************/
+
+typedef struct {
+	Socket2 *socket;
+	uint64_t idle_since;
+} PoolEntry;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	int length;
+	PoolEntry *idle;
+} Pool;
+
+static Pool pools[MAX_ARGV_LENGTH];
+
+static int
+poolInit(void)
+{
+	int i;
+
+	for (i = 0; i < nservers; i++) {
+		if ((pools[i].idle = calloc(pool_max_idle, sizeof (*pools[i].idle))) == NULL)
+			return -1;
+		(void) pthread_mutex_init(&pools[i].mutex, NULL);
+	}
+
+	return 0;
+}
+
+static void
+poolFini(void)
+{
+	int i;
+
+	for (i = 0; i < nservers; i++) {
+		if (pools[i].idle == NULL)
+			continue;
+		while (0 < pools[i].length)
+			socketClose(pools[i].idle[--pools[i].length].socket);
+		free(pools[i].idle);
+		pools[i].idle = NULL;
+		(void) pthread_mutex_destroy(&pools[i].mutex);
+	}
+}
+
+/*
+ * Send a NOOP to an idle connection and check for a positive reply.
+ */
+static int
+poolProbe(Socket2 *s)
+{
+	char reply[SMTP_REPLY_LINE_LENGTH+1];
+	long length, size = 0;
+	struct pollfd fds;
+
+	if (send(s->fd, "NOOP\r\n", sizeof ("NOOP\r\n")-1, 0) != sizeof ("NOOP\r\n")-1)
+		return -1;
+
+	fds.fd = s->fd;
+	fds.events = POLLIN;
+	while (size < sizeof (reply)-1 && poll(&fds, 1, connect_timeout) == 1) {
+		if ((length = recv(s->fd, reply+size, sizeof (reply)-1-size, 0)) <= 0)
+			break;
+		size += length;
+		if (reply[size-1] == '\n')
+			return reply[0] == '2' && reply[3] == ' ' ? 0 : -1;
+	}
+
+	return -1;
+}
+
+/*
+ * Check out an idle, already greeted, connection to a server. The
+ * most recently returned connection is used first. Connections idle
+ * too long, that have something to say, likely a 421 timeout or EOF,
+ * or to an address the server's name no longer resolves to, are
+ * discarded.  The one returned is counted against its address.
+ */
+static Socket2 *
+poolGet(int index)
+{
+	uint64_t idle;
+	PoolEntry entry;
+	struct pollfd fds;
+	Pool *pool = &pools[index];
+
+	if (pool_max_idle <= 0)
+		return NULL;
+
+	for (;;) {
+		(void) pthread_mutex_lock(&pool->mutex);
+		if (pool->length <= 0) {
+			(void) pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+		entry = pool->idle[--pool->length];
+		(void) pthread_mutex_unlock(&pool->mutex);
+
+		idle = (monotonicUs() - entry.idle_since) / 1000;
+
+		fds.fd = entry.socket->fd;
+		fds.events = POLLIN;
+		if (idle <= pool_idle_timeout && poll(&fds, 1, 0) == 0
+		&& (idle <= pool_probe_interval || poolProbe(entry.socket) == 0)
+		&& resolveHold(index, &entry.socket->address) == 0)
+			return entry.socket;
+
+		socketClose(entry.socket);
+	}
+}
+
+/*
+ * Return a connection, already reset, to the idle pool. Return -1
+ * if the pool is full, in which case the caller closes it.
+ */
+static int
+poolPut(int index, Socket2 *socket)
+{
+	int i, rc = -1;
+	uint64_t now;
+	Pool *pool = &pools[index];
+
+	if (pool_max_idle <= 0)
+		return -1;
+
+	now = monotonicUs();
+
+	(void) pthread_mutex_lock(&pool->mutex);
+
+	/* Drop expired connections, oldest first. */
+	for (i = 0; i < pool->length && pool_idle_timeout < (now - pool->idle[i].idle_since) / 1000; i++)
+		socketClose(pool->idle[i].socket);
+	if (0 < i) {
+		pool->length -= i;
+		memmove(pool->idle, pool->idle+i, pool->length * sizeof (*pool->idle));
+	}
+
+	if (pool->length < pool_max_idle) {
+		pool->idle[pool->length].socket = socket;
+		pool->idle[pool->length].idle_since = now;
+		pool->length++;
+		rc = 0;
+	}
+
+	(void) pthread_mutex_unlock(&pool->mutex);
+
+	return rc;
+}
+
+/***********************************************************************
+ *** Server Health
+ ***********************************************************************/
+
+/*
+ * A circuit breaker per server, shared by all sessions.  Once a server
+ * has failed to connect or welcome health_failures times in a row, the
+ * circuit opens and sessions skip it, rather than each wait out the
+ * connect timeout.  After the retry delay one session is let through
+ * to try it; each failed trial doubles the delay, up to the maximum.
+ * A welcome closes the circuit.  Failures are only logged once every
+ * HEALTH_LOG_INTERVAL per server, with a count of those that were not.
+ */
+typedef enum {
+	HEALTH_CLOSED,				/* Connect as normal. */
+	HEALTH_OPEN,				/* Skip until the retry time. */
+	HEALTH_TRIAL,				/* One session is trying it. */
+} HealthState;
+
+typedef struct {
+	HealthState state;
+	int failures;				/* In a row. */
+	int trials;				/* Failed trials in a row. */
+	uint64_t retry;				/* When the next trial may start. */
+	uint64_t logged;			/* When a failure was last logged. */
+	unsigned long quiet;			/* Failures not logged since. */
+	unsigned long skips;			/* Connects not tried. */
+} Health;
+
+static Health health[MAX_ARGV_LENGTH];
+static pthread_mutex_t health_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long
+healthDelay(Health *h)
+{
+	int n;
+	long ms;
+
+	for (ms = health_retry, n = h->trials; 0 < n && ms < health_retry_max; n--)
+		ms *= 2;
+
+	return ms < health_retry_max ? ms : health_retry_max;
+}
+
+/*
+ * Return true if a session may connect to the server now.
+ */
+static int
+healthAllow(int index)
+{
+	int allow;
+	uint64_t now;
+	Health *h = &health[index];
+
+	if (health_failures <= 0)
+		return 1;
+
+	(void) pthread_mutex_lock(&health_mutex);
+	if (!(allow = h->state == HEALTH_CLOSED)) {
+		now = monotonicUs();
+		if ((allow = h->retry <= now)) {
+			/* Should the trial never report back, say the
+			 * session ended first, allow another later.
+			 */
+			h->state = HEALTH_TRIAL;
+			h->retry = now + healthDelay(h) * 1000;
+		} else {
+			h->skips++;
+		}
+	}
+	(void) pthread_mutex_unlock(&health_mutex);
+
+	return allow;
+}
+
+/*
+ * The server welcomed a session, close its circuit.
+ */
+static void
+healthUp(int index)
+{
+	HealthState was;
+	Health *h = &health[index];
+
+	(void) pthread_mutex_lock(&health_mutex);
+	was = h->state;
+	h->state = HEALTH_CLOSED;
+	h->failures = 0;
+	h->trials = 0;
+	(void) pthread_mutex_unlock(&health_mutex);
+
+	if (was != HEALTH_CLOSED)
+		syslog(LOG_INFO, "#%d %s is back, circuit closed", index, smtp_host[index]);
+}
+
+/*
+ * The server failed to connect or welcome.  Return true if the caller
+ * should log the failure.
+ */
+static int
+healthDown(int index)
+{
+	int log;
+	long delay;
+	uint64_t now;
+	unsigned long quiet;
+	Health *h = &health[index];
+
+	now = monotonicUs();
+	delay = 0;
+
+	(void) pthread_mutex_lock(&health_mutex);
+	h->failures++;
+	if (0 < health_failures && (h->state == HEALTH_TRIAL || (h->state == HEALTH_CLOSED && health_failures <= h->failures))) {
+		if (h->state == HEALTH_TRIAL)
+			h->trials++;
+		h->state = HEALTH_OPEN;
+		delay = healthDelay(h);
+		h->retry = now + delay * 1000;
+	}
+	quiet = 0;
+	if ((log = h->logged == 0 || HEALTH_LOG_INTERVAL <= (now - h->logged) / 1000)) {
+		quiet = h->quiet;
+		h->quiet = 0;
+		h->logged = now;
+	} else {
+		h->quiet++;
+	}
+	(void) pthread_mutex_unlock(&health_mutex);
+
+	if (0 < quiet)
+		syslog(LOG_ERR, "#%d %lu more failures of %s not logged", index, quiet, smtp_host[index]);
+	if (0 < delay)
+		syslog(LOG_ERR, "#%d %s down, circuit open, retry in %ldms", index, smtp_host[index], delay);
+
+	return log;
+}
+
+/***********************************************************************
+ *** Server Capabilities
+ ***********************************************************************/
+
+#define CAP_PIPELINING		0x0001
+#define CAP_CHUNKING		0x0002
+#define CAP_SIZE		0x0004
+#define CAP_8BITMIME		0x0008
+#define CAP_XCLIENT		0x0010
+#define CAP_STARTTLS		0x0020
+
+typedef struct {
+	unsigned caps;
+	long size;				/* SIZE limit, 0 if none given. */
+	uint64_t expires;			/* When to parse an EHLO reply again. */
+} Capabilities;
+
+static Capabilities capabilities[MAX_ARGV_LENGTH];
+static pthread_mutex_t capabilities_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	const char *keyword;
+	unsigned cap;
+} capability_keywords[] = {
+	{ "PIPELINING", CAP_PIPELINING },
+	{ "CHUNKING", CAP_CHUNKING },
+	{ "SIZE", CAP_SIZE },
+	{ "8BITMIME", CAP_8BITMIME },
+	{ "XCLIENT", CAP_XCLIENT },
+	{ "STARTTLS", CAP_STARTTLS },
+	{ NULL, 0 }
+};
+
+/*
+ * Return the capability named by one line of an EHLO reply, eg.
+ * "250-SIZE 10240000", else zero.
+ */
+static unsigned
+capabilityLine(const char *line, long *size)
+{
+	int i;
+	long length;
+	const char *keyword;
+
+	if (strlen(line) < 4)
+		return 0;
+
+	keyword = line + 4;
+	for (i = 0; capability_keywords[i].keyword != NULL; i++) {
+		length = strlen(capability_keywords[i].keyword);
+		if (0 < TextInsensitiveStartsWith(keyword, capability_keywords[i].keyword)
+		&& (keyword[length] == ' ' || keyword[length] == '\r' || keyword[length] == '\n' || keyword[length] == '\0')) {
+			if (size != NULL && capability_keywords[i].cap == CAP_SIZE)
+				*size = strtol(keyword + length, NULL, 10);
+			return capability_keywords[i].cap;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The capabilities of a server, parsed from its EHLO reply only when
+ * the cached set is due for a refresh.
+ */
+static unsigned
+capabilityGet(int index, const char *reply)
+{
+	long size;
+	unsigned caps;
+	uint64_t now;
+	const char *line;
+	Capabilities *entry = &capabilities[index];
+
+	now = monotonicUs();
+	(void) pthread_mutex_lock(&capabilities_mutex);
+
+	if (now < entry->expires) {
+		caps = entry->caps;
+		(void) pthread_mutex_unlock(&capabilities_mutex);
+		return caps;
+	}
+
+	/* Skip the first line, the server's greeting. */
+	size = 0;
+	caps = 0;
+	for (line = reply; (line = strchr(line, '\n')) != NULL && *++line != '\0'; )
+		caps |= capabilityLine(line, &size);
+
+	entry->caps = caps;
+	entry->size = size;
+	entry->expires = now + (uint64_t) CAPABILITY_REFRESH * 1000;
+
+	(void) pthread_mutex_unlock(&capabilities_mutex);
+
+	syslog(LOG_DEBUG, "#%d %s capabilities 0x%x size %ld", index, smtp_host[index], caps, size);
+
+	return caps;
+}
+
+/***********************************************************************
+ *** Latency Metrics
+ ***********************************************************************/
+
+/*
+ * SMTP phases timed for each down stream server, from sending the
+ * command, or from the reply before it when pipelined, to its reply.
+ */
+typedef enum {
+	PHASE_CONNECT,				/* Non-blocking connect. */
+	PHASE_WELCOME,				/* Connected to the 220 banner. */
+	PHASE_EHLO,
+	PHASE_MAIL,
+	PHASE_RCPT,
+	PHASE_DATA,				/* DATA to 354. */
+	PHASE_DOT,				/* End of message to its reply. */
+	PHASE_NONE
+} Phase;
+
+static const char *phase_names[] = {
+	"connect", "welcome", "ehlo", "mail", "rcpt", "data", "dot"
+};
+
+/* Prometheus histogram bucket bounds in microseconds. */
+static const uint64_t metrics_bounds[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+/*
+ * Each thread records into its own block of histograms, one for each
+ * server and phase, without locking.  Blocks last as long as the process
+ * so the counts only ever grow, and the block of a thread that ends is
+ * taken over by the next thread that needs one.
+ */
+/*
+ * A server's reply latency less that of the first server, the
+ * baseline, for the same command.
+ */
+typedef struct {
+	uint64_t count;
+	uint64_t faster;			/* Replied before the baseline. */
+	uint64_t slower;			/* Replied after the baseline. */
+	int64_t sum;				/* Microseconds, negative is faster. */
+} MetricsDelta;
+
+typedef struct metrics_block {
+	struct metrics_block *next;
+	int in_use;
+	Histogram *hist;
+	MetricsDelta *delta;
+} MetricsBlock;
+
+typedef struct {
+	char *data;
+	long length;
+	long size;
+} MetricsText;
+
+static Socket2 *metrics_socket;
+static pthread_t metrics_thread;
+static volatile int metrics_running;
+static pthread_key_t metrics_key;
+static MetricsBlock *metrics_blocks;
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+metricsRelease(void *data)
+{
+	MetricsBlock *block = data;
+
+	(void) pthread_mutex_lock(&metrics_mutex);
+	block->in_use = 0;
+	(void) pthread_mutex_unlock(&metrics_mutex);
+}
+
+static MetricsBlock *
+metricsClaim(void)
+{
+	MetricsBlock *block;
+
+	(void) pthread_mutex_lock(&metrics_mutex);
+	for (block = metrics_blocks; block != NULL; block = block->next) {
+		if (!block->in_use)
+			break;
+	}
+	if (block == NULL && (block = calloc(1, sizeof (*block) + nservers * PHASE_NONE * (sizeof (Histogram) + sizeof (MetricsDelta)))) != NULL) {
+		block->hist = (Histogram *) &block[1];
+		block->delta = (MetricsDelta *) &block->hist[nservers * PHASE_NONE];
+		block->next = metrics_blocks;
+		metrics_blocks = block;
+	}
+	if (block != NULL)
+		block->in_use = 1;
+	(void) pthread_mutex_unlock(&metrics_mutex);
+
+	if (block != NULL)
+		(void) pthread_setspecific(metrics_key, block);
+
+	return block;
+}
+
+static void
+metricsRecord(int index, Phase phase, uint64_t us)
+{
+	MetricsBlock *block;
+
+	if (metrics_socket == NULL || PHASE_NONE <= phase)
+		return;
+
+	if ((block = pthread_getspecific(metrics_key)) == NULL && (block = metricsClaim()) == NULL)
+		return;
+
+	histogramRecord(&block->hist[index * PHASE_NONE + phase], us);
+}
+
+static void
+metricsRecordDelta(int index, Phase phase, int64_t delta)
+{
+	MetricsBlock *block;
+	MetricsDelta *totals;
+
+	if ((block = pthread_getspecific(metrics_key)) == NULL && (block = metricsClaim()) == NULL)
+		return;
+
+	totals = &block->delta[index * PHASE_NONE + phase];
+	totals->count++;
+	totals->sum += delta;
+	if (delta < 0)
+		totals->faster++;
+	else if (0 < delta)
+		totals->slower++;
+}
+
+static void
+metricsPrintf(MetricsText *text, const char *fmt, ...)
+{
+	long length;
+	char *data;
+	va_list args;
+
+	for (;;) {
+		va_start(args, fmt);
+		length = vsnprintf(text->data + text->length, text->size - text->length, fmt, args);
+		va_end(args);
+
+		if (length < text->size - text->length) {
+			text->length += length;
+			return;
+		}
+		if ((data = realloc(text->data, text->size * 2 + length)) == NULL)
+			return;
+		text->data = data;
+		text->size = text->size * 2 + length;
+	}
+}
+
+/*
+ * Sum the per thread histograms and deltas.  Return NULL if out of
+ * memory, else the histograms followed by the deltas, to be freed.
+ */
+static Histogram *
+metricsSum(MetricsDelta **deltas)
+{
+	int i;
+	Histogram *totals;
+	MetricsBlock *block;
+
+	if ((totals = calloc(nservers * PHASE_NONE, sizeof (*totals) + sizeof (**deltas))) == NULL)
+		return NULL;
+	*deltas = (MetricsDelta *) &totals[nservers * PHASE_NONE];
+
+	/* Blocks are only ever added, so the list can be walked while
+	 * threads record; a count a moment stale does no harm.
+	 */
+	(void) pthread_mutex_lock(&metrics_mutex);
+	block = metrics_blocks;
+	(void) pthread_mutex_unlock(&metrics_mutex);
+	for ( ; block != NULL; block = block->next) {
+		for (i = 0; i < nservers * PHASE_NONE; i++) {
+			histogramAdd(&totals[i], &block->hist[i]);
+			(*deltas)[i].count += block->delta[i].count;
+			(*deltas)[i].faster += block->delta[i].faster;
+			(*deltas)[i].slower += block->delta[i].slower;
+			(*deltas)[i].sum += block->delta[i].sum;
+		}
+	}
+
+	return totals;
+}
+
+/*
+ * Write the sums out in the Prometheus text exposition format, the
+ * latencies as a histogram and as a summary with the usual quantiles
+ * already worked out, and the deltas from the first server.
+ */
+static void
+metricsReport(MetricsText *text)
+{
+	int i, j, k;
+	Histogram *totals;
+	MetricsDelta *deltas;
+	Resolved targets;
+	Health healths[MAX_ARGV_LENGTH];
+	char addr[IPV6_STRING_SIZE];
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+	if ((totals = metricsSum(&deltas)) == NULL)
+		return;
+
+	metricsPrintf(text, "# HELP roundhouse_reply_seconds Down stream server reply latency by SMTP phase.\n");
+	metricsPrintf(text, "# TYPE roundhouse_reply_seconds histogram\n");
+	for (i = 0; i < nservers; i++) {
+		for (j = 0; j < PHASE_NONE; j++) {
+			Histogram *hist = &totals[i * PHASE_NONE + j];
+			for (k = 0; k < sizeof (metrics_bounds) / sizeof (*metrics_bounds); k++) {
+				metricsPrintf(
+					text, "roundhouse_reply_seconds_bucket{server=\"%s\",phase=\"%s\",le=\"%g\"} %llu\n",
+					smtp_host[i], phase_names[j], metrics_bounds[k] / 1e6,
+					(unsigned long long) histogramCountBelow(hist, metrics_bounds[k])
+				);
+			}
+			metricsPrintf(text, "roundhouse_reply_seconds_bucket{server=\"%s\",phase=\"%s\",le=\"+Inf\"} %llu\n", smtp_host[i], phase_names[j], (unsigned long long) hist->count);
+			metricsPrintf(text, "roundhouse_reply_seconds_sum{server=\"%s\",phase=\"%s\"} %.6f\n", smtp_host[i], phase_names[j], hist->sum / 1e6);
+			metricsPrintf(text, "roundhouse_reply_seconds_count{server=\"%s\",phase=\"%s\"} %llu\n", smtp_host[i], phase_names[j], (unsigned long long) hist->count);
+		}
+	}
+
+	metricsPrintf(text, "# HELP roundhouse_reply_quantile_seconds Down stream server reply latency quantiles by SMTP phase.\n");
+	metricsPrintf(text, "# TYPE roundhouse_reply_quantile_seconds summary\n");
+	for (i = 0; i < nservers; i++) {
+		for (j = 0; j < PHASE_NONE; j++) {
+			Histogram *hist = &totals[i * PHASE_NONE + j];
+			for (k = 0; k < sizeof (quantiles) / sizeof (*quantiles); k++) {
+				metricsPrintf(
+					text, "roundhouse_reply_quantile_seconds{server=\"%s\",phase=\"%s\",quantile=\"%g\"} %.6f\n",
+					smtp_host[i], phase_names[j], quantiles[k], histogramQuantile(hist, quantiles[k]) / 1e6
+				);
+			}
+			metricsPrintf(text, "roundhouse_reply_quantile_seconds_sum{server=\"%s\",phase=\"%s\"} %.6f\n", smtp_host[i], phase_names[j], hist->sum / 1e6);
+			metricsPrintf(text, "roundhouse_reply_quantile_seconds_count{server=\"%s\",phase=\"%s\"} %llu\n", smtp_host[i], phase_names[j], (unsigned long long) hist->count);
+		}
+	}
+
+	metricsPrintf(text, "# HELP roundhouse_reply_delta_seconds Down stream server reply latency less that of the first server for the same command.\n");
+	metricsPrintf(text, "# TYPE roundhouse_reply_delta_seconds summary\n");
+	for (i = 1; i < nservers; i++) {
+		for (j = 0; j < PHASE_NONE; j++) {
+			MetricsDelta *delta = &deltas[i * PHASE_NONE + j];
+			metricsPrintf(text, "roundhouse_reply_delta_seconds_sum{server=\"%s\",baseline=\"%s\",phase=\"%s\"} %.6f\n", smtp_host[i], smtp_host[0], phase_names[j], delta->sum / 1e6);
+			metricsPrintf(text, "roundhouse_reply_delta_seconds_count{server=\"%s\",baseline=\"%s\",phase=\"%s\"} %llu\n", smtp_host[i], smtp_host[0], phase_names[j], (unsigned long long) delta->count);
+		}
+	}
+
+	metricsPrintf(text, "# HELP roundhouse_reply_faster_total Commands a down stream server answered before the first server.\n");
+	metricsPrintf(text, "# TYPE roundhouse_reply_faster_total counter\n");
+	for (i = 1; i < nservers; i++) {
+		for (j = 0; j < PHASE_NONE; j++)
+			metricsPrintf(text, "roundhouse_reply_faster_total{server=\"%s\",baseline=\"%s\",phase=\"%s\"} %llu\n", smtp_host[i], smtp_host[0], phase_names[j], (unsigned long long) deltas[i * PHASE_NONE + j].faster);
+	}
+
+	metricsPrintf(text, "# HELP roundhouse_reply_slower_total Commands a down stream server answered after the first server.\n");
+	metricsPrintf(text, "# TYPE roundhouse_reply_slower_total counter\n");
+	for (i = 1; i < nservers; i++) {
+		for (j = 0; j < PHASE_NONE; j++)
+			metricsPrintf(text, "roundhouse_reply_slower_total{server=\"%s\",baseline=\"%s\",phase=\"%s\"} %llu\n", smtp_host[i], smtp_host[0], phase_names[j], (unsigned long long) deltas[i * PHASE_NONE + j].slower);
+	}
+
+	(void) pthread_mutex_lock(&health_mutex);
+	memcpy(healths, health, nservers * sizeof (*health));
+	(void) pthread_mutex_unlock(&health_mutex);
+
+	metricsPrintf(text, "# HELP roundhouse_server_up Zero while a down stream server's circuit is open.\n");
+	metricsPrintf(text, "# TYPE roundhouse_server_up gauge\n");
+	for (i = 0; i < nservers; i++)
+		metricsPrintf(text, "roundhouse_server_up{server=\"%s\"} %d\n", smtp_host[i], healths[i].state == HEALTH_CLOSED);
+
+	metricsPrintf(text, "# HELP roundhouse_server_skips_total Connects to a down stream server not tried while its circuit was open.\n");
+	metricsPrintf(text, "# TYPE roundhouse_server_skips_total counter\n");
+	for (i = 0; i < nservers; i++)
+		metricsPrintf(text, "roundhouse_server_skips_total{server=\"%s\"} %lu\n", smtp_host[i], healths[i].skips);
+
+	metricsPrintf(text, "# HELP roundhouse_server_address_sessions Sessions connected to each address of a down stream server.\n");
+	metricsPrintf(text, "# TYPE roundhouse_server_address_sessions gauge\n");
+	for (i = 0; i < nservers; i++) {
+		(void) pthread_mutex_lock(&resolve_mutex);
+		targets = resolved[i];
+		(void) pthread_mutex_unlock(&resolve_mutex);
+		for (j = 0; j < targets.length; j++) {
+			(void) socketAddressGetString(&targets.targets[j].address, 0, addr, sizeof (addr));
+			metricsPrintf(text, "roundhouse_server_address_sessions{server=\"%s\",address=\"%s\"} %lu\n", smtp_host[i], addr, targets.targets[j].sessions);
+		}
+	}
+
+	free(totals);
+}
+
+/*
+ * A plain table of the servers side by side for each SMTP phase: the
+ * reply latencies and, for the same commands, how much faster or
+ * slower each server was than the first.
+ */
+static void
+metricsCompare(MetricsText *text)
+{
+	int i, j;
+	Histogram *totals, *hist;
+	MetricsDelta *deltas, *delta;
+
+	if ((totals = metricsSum(&deltas)) == NULL)
+		return;
+
+	metricsPrintf(text, "%-8s %-24s %10s %9s %9s %9s %10s %7s %7s\n", "phase", "server", "replies", "mean-ms", "p50-ms", "p99-ms", "delta-ms", "faster", "slower");
+	for (j = 0; j < PHASE_NONE; j++) {
+		for (i = 0; i < nservers; i++) {
+			hist = &totals[i * PHASE_NONE + j];
+			delta = &deltas[i * PHASE_NONE + j];
+			if (hist->count == 0)
+				continue;
+
+			metricsPrintf(
+				text, "%-8s %-24s %10llu %9.3f %9.3f %9.3f", phase_names[j], smtp_host[i],
+				(unsigned long long) hist->count, hist->sum / 1e3 / hist->count,
+				histogramQuantile(hist, 0.5) / 1e3, histogramQuantile(hist, 0.99) / 1e3
+			);
+			if (i == 0)
+				metricsPrintf(text, " %10s %7s %7s\n", "baseline", "-", "-");
+			else if (delta->count == 0)
+				metricsPrintf(text, " %10s %7s %7s\n", "-", "-", "-");
+			else
+				metricsPrintf(
+					text, " %+10.3f %6.1f%% %6.1f%%\n", delta->sum / 1e3 / delta->count,
+					100.0 * delta->faster / delta->count, 100.0 * delta->slower / delta->count
+				);
+		}
+	}
+
+	free(totals);
+}
+
+/*
+ * Answer GET /compare with the comparison table and any other HTTP
+ * request with the Prometheus report.
+ */
+static void *
+metricsWorker(void *data)
+{
+	int compare;
+	Socket2 *client;
+	MetricsText text;
+	char line[SMTP_TEXT_LINE_LENGTH], head[128];
+
+	while (metrics_running) {
+		if (!socketHasInput(metrics_socket, 1000))
+			continue;
+		if ((client = socketAccept(metrics_socket)) == NULL)
+			continue;
+
+		socketSetTimeout(client, 5000);
+		compare = 0 < socketReadLine2(client, line, sizeof (line), 0) && 0 < TextInsensitiveStartsWith(line, "GET /compare");
+		while (0 < socketReadLine2(client, line, sizeof (line), 0))
+			;
+
+		text.length = 0;
+		text.size = 4096;
+		if ((text.data = malloc(text.size)) != NULL) {
+			if (compare)
+				metricsCompare(&text);
+			else
+				metricsReport(&text);
+			(void) snprintf(head, sizeof (head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain%s\r\nContent-Length: %ld\r\n\r\n", compare ? "" : "; version=0.0.4", text.length);
+			if (0 < socketWrite(client, (unsigned char *) head, strlen(head)))
+				(void) socketWrite(client, (unsigned char *) text.data, text.length);
+			free(text.data);
+		}
+		socketClose(client);
+	}
+
+	return NULL;
+}
+
+/*
+ * Bind the metrics listener before dropping privileges.
+ */
+static int
+metricsListen(void)
+{
+	SocketAddress *address;
+
+	if (pthread_key_create(&metrics_key, metricsRelease))
+		return -1;
+
+	if ((address = socketAddressCreate(metrics_listen, 80)) == NULL) {
+		syslog(LOG_ERR, "metrics address error '%s': %s (%d)", metrics_listen, strerror(errno), errno);
+		return -1;
+	}
+	metrics_socket = socketOpen(address, 1);
+	free(address);
+	if (metrics_socket == NULL) {
+		syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
+		return -1;
+	}
+	if (socketServer(metrics_socket, 16)) {
+		syslog(LOG_ERR, "metrics bind error '%s': %s (%d)", metrics_listen, strerror(errno), errno);
+		socketClose(metrics_socket);
+		metrics_socket = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+metricsStart(void)
+{
+	metrics_running = 1;
+	if (pthread_create(&metrics_thread, NULL, metricsWorker, NULL)) {
+		syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
+		metrics_running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+metricsStop(void)
+{
+	if (metrics_running) {
+		metrics_running = 0;
+		(void) pthread_join(metrics_thread, NULL);
+	}
+	if (metrics_socket != NULL) {
+		socketClose(metrics_socket);
+		metrics_socket = NULL;
+	}
+}
+
+/***********************************************************************
+ *** Reply Timeouts
+ ***********************************************************************/
+
+/*
+ * How long to wait on a reply adapts to each server and SMTP phase,
+ * instead of the one -t for all.  Every session shares a smoothed
+ * reply time and mean deviation per server and phase, as RFC 6298
+ * keeps for TCP retransmits, and the timeout is twice what that RFC
+ * would allow, between reply_floor and the ceiling.  A hung server is
+ * dropped after seconds rather than minutes, while one that is slow
+ * as usual is given its usual time.  A reply that times out counts as
+ * taking that long, so a server that has slowed for good raises its
+ * own timeout rather than being cut off from then on.
+ *
+ * The time and deviation, in microseconds, share one word so they
+ * can be updated without a lock.
+ */
+static volatile uint64_t reply_estimates[MAX_ARGV_LENGTH][PHASE_NONE];
+
+#define ESTIMATE_TIME(e)	((e) >> 32)
+#define ESTIMATE_DEVIATION(e)	((e) & 0xffffffff)
+
+#define REPLIES_TIMED		(metrics_socket != NULL || 0 < reply_floor)
+
+/*
+ * A server's reply is not yet late while it is still being sent what
+ * it is to reply to, such as a long message.
+ */
+#define SERVER_DUE(s)		((s)->out_offset < (s)->out_length - (s)->out_held ? 0 : (s)->due)
+
+static void
+replyEstimate(int index, Phase phase, uint64_t us)
+{
+	uint64_t old, time, deviation, delta;
+
+	if (reply_floor <= 0 || PHASE_NONE <= phase)
+		return;
+	if (0xffffffff < us)
+		us = 0xffffffff;
+
+	do {
+		old = reply_estimates[index][phase];
+		if (old == 0) {
+			time = us;
+			deviation = us / 2;
+		} else {
+			time = ESTIMATE_TIME(old);
+			deviation = ESTIMATE_DEVIATION(old);
+			delta = time < us ? us - time : time - us;
+			deviation = deviation - deviation / 4 + delta / 4;
+			time = time - time / 8 + us / 8;
+		}
+	} while (!__sync_bool_compare_and_swap(&reply_estimates[index][phase], old, time << 32 | deviation));
+}
+
+/*
+ * Return when a reply from the server in this phase is due, waiting
+ * from now, or 0 for no limit.
+ */
+static uint64_t
+replyDue(int index, Phase phase, uint64_t now)
+{
+	long ms, ceiling;
+	uint64_t estimate;
+
+	ceiling = 0 < reply_ceiling ? reply_ceiling : socket_timeout;
+	if (reply_floor <= 0 || PHASE_NONE <= phase || (estimate = reply_estimates[index][phase]) == 0) {
+		ms = ceiling;
+	} else {
+		ms = (long) ((ESTIMATE_TIME(estimate) + 4 * ESTIMATE_DEVIATION(estimate)) * 2 / 1000);
+		if (ms < reply_floor)
+			ms = reply_floor;
+		if (0 < ceiling && ceiling < ms)
+			ms = ceiling;
+	}
+
+	return ms <= 0 ? 0 : now + (uint64_t) ms * 1000;
+}
+
+/***********************************************************************
+ *** Live Statistics
+ ***********************************************************************/
+
+/*
+ * Counters for roundhouse-top in a POSIX shared memory segment.  Each
+ * thread claims a slot of its own, so the counters are updated with
+ * plain adds and no locking.  Like the metrics blocks, a slot left by
+ * a thread that ends goes to the next thread that needs one.
+ */
+static StatsHeader *stats;
+static size_t stats_size;
+static pthread_key_t stats_key;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define STATS_ADD(conn, field, n) \
+	do { if ((conn)->stats != NULL) (conn)->stats->field += (n); } while (0)
+#define STATS_SERVER_ADD(conn, index, field, n) \
+	do { if ((conn)->stats != NULL) STATS_SERVER((conn)->stats, index)->field += (n); } while (0)
+
+#ifdef HAVE_SYS_MMAN_H
+static void
+statsRelease(void *data)
+{
+	StatsThread *slot = data;
+
+	(void) pthread_mutex_lock(&stats_mutex);
+	slot->in_use = 0;
+	(void) pthread_mutex_unlock(&stats_mutex);
+}
+
+/*
+ * Return this thread's slot, claiming one the first time, or NULL if
+ * there are no statistics or no free slots.
+ */
+static StatsThread *
+statsSlot(void)
+{
+	int i;
+	StatsThread *slot;
+
+	if (stats == NULL)
+		return NULL;
+	if ((slot = pthread_getspecific(stats_key)) != NULL)
+		return slot;
+
+	(void) pthread_mutex_lock(&stats_mutex);
+	for (i = 0; i < stats->nslots; i++) {
+		slot = STATS_SLOT(stats, i);
+		if (!slot->in_use) {
+			slot->in_use = 1;
+			break;
+		}
+	}
+	(void) pthread_mutex_unlock(&stats_mutex);
+
+	if (stats->nslots <= i)
+		return NULL;
+
+	(void) pthread_setspecific(stats_key, slot);
+
+	return slot;
+}
+
+static int
+statsOpen(void)
+{
+	int i, fd;
+
+	if (pthread_key_create(&stats_key, statsRelease))
+		return -1;
+
+	stats_size = STATS_SIZE(nservers, STATS_SLOTS);
+
+	if ((fd = shm_open(STATS_NAME, O_CREAT|O_RDWR, 0644)) < 0) {
+		syslog(LOG_ERR, "statistics %s error: %s (%d)", STATS_NAME, strerror(errno), errno);
+		return -1;
+	}
+	if (ftruncate(fd, 0) || ftruncate(fd, stats_size)) {
+		syslog(LOG_ERR, "statistics %s error: %s (%d)", STATS_NAME, strerror(errno), errno);
+		(void) close(fd);
+		return -1;
+	}
+	stats = mmap(NULL, stats_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	(void) close(fd);
+	if (stats == MAP_FAILED) {
+		syslog(LOG_ERR, "statistics %s error: %s (%d)", STATS_NAME, strerror(errno), errno);
+		stats = NULL;
+		return -1;
+	}
+
+	stats->version = STATS_VERSION;
+	stats->nservers = nservers;
+	stats->nslots = STATS_SLOTS;
+	stats->slot_size = STATS_SLOT_SIZE(nservers);
+	stats->started = time(NULL);
+	stats->pid = getpid();
+	for (i = 0; i < nservers && i < STATS_SERVERS; i++)
+		(void) TextCopy(stats->hosts[i], sizeof (stats->hosts[i]), smtp_host[i]);
+
+	/* Readers check the magic last. */
+	stats->magic = STATS_MAGIC;
+
+	return 0;
+}
+
+static void
+statsClose(void)
+{
+	if (stats != NULL) {
+		(void) shm_unlink(STATS_NAME);
+		(void) munmap(stats, stats_size);
+		stats = NULL;
+	}
+}
+#else
+# define statsSlot()	NULL
+#endif /* HAVE_SYS_MMAN_H */
+
+/***********************************************************************
+ *** Session Journal
+ ***********************************************************************/
+
+/*
+ * With -j, what each client sends is appended to a journal for
+ * roundhouse-replay.  Sessions copy records into the fill buffer
+ * under a mutex and never wait on the disk; a background thread
+ * writes out whichever buffer is full, or the fill buffer once a
+ * second.  When both buffers are in use records are dropped and
+ * counted rather than hold up a session.
+ */
+typedef struct {
+	long length;
+	char *data;
+} JournalBuffer;
+
+static int journal_fd = -1;
+static int journal_running;
+static uint32_t journal_sessions;
+static unsigned long journal_dropped;
+static pthread_t journal_thread;
+static JournalBuffer journal_buffers[2];
+static JournalBuffer *journal_fill = &journal_buffers[0];
+static JournalBuffer *journal_full;		/* Being written, if any. */
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t
+journalNow(void)
+{
+	struct timespec now;
+
+	(void) clock_gettime(CLOCK_REALTIME, &now);
+
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Hand the fill buffer to the writer thread, if it is free.  Called
+ * with journal_mutex held.
+ */
+static int
+journalSwap(void)
+{
+	if (journal_full != NULL)
+		return -1;
+
+	journal_full = journal_fill;
+	journal_fill = journal_fill == &journal_buffers[0] ? &journal_buffers[1] : &journal_buffers[0];
+	(void) pthread_cond_signal(&journal_cond);
+
+	return 0;
+}
+
+static void
+journalAppend(uint32_t session, JournalType type, const char *data, long length)
+{
+	long n;
+	JournalRecord record;
+
+	if (journal_fd < 0)
+		return;
+
+	record.when = journalNow();
+	record.session = session;
+	record.type = type;
+
+	(void) pthread_mutex_lock(&journal_mutex);
+	do {
+		n = length < JOURNAL_RECORD_MAX ? length : JOURNAL_RECORD_MAX;
+		if (JOURNAL_BUFFER_SIZE < journal_fill->length + sizeof (record) + n && journalSwap()) {
+			journal_dropped++;
+			break;
+		}
+		record.length = (uint16_t) n;
+		memcpy(journal_fill->data + journal_fill->length, &record, sizeof (record));
+		journal_fill->length += sizeof (record);
+		memcpy(journal_fill->data + journal_fill->length, data, n);
+		journal_fill->length += n;
+		data += n;
+		length -= n;
+	} while (0 < length);
+	(void) pthread_mutex_unlock(&journal_mutex);
+}
+
+static void
+journalInput(Connection *conn, const char *data, long length)
+{
+	if (0 < conn->journal && 0 < length)
+		journalAppend(conn->journal, JOURNAL_INPUT, data, length);
+}
+
+static void
+journalOpen(Connection *conn)
+{
+	if (journal_fd < 0)
+		return;
+
+	(void) pthread_mutex_lock(&journal_mutex);
+	if (++journal_sessions == 0)
+		journal_sessions++;
+	conn->journal = journal_sessions;
+	(void) pthread_mutex_unlock(&journal_mutex);
+
+	journalAppend(conn->journal, JOURNAL_OPEN, conn->client_addr, strlen(conn->client_addr));
+}
+
+static void
+journalClose(Connection *conn)
+{
+	if (0 < conn->journal)
+		journalAppend(conn->journal, JOURNAL_CLOSE, NULL, 0);
+	conn->journal = 0;
+}
+
+static void
+journalWriteOut(JournalBuffer *buffer)
+{
+	long n, offset;
+
+	for (offset = 0; offset < buffer->length; offset += n) {
+		if ((n = write(journal_fd, buffer->data + offset, buffer->length - offset)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			syslog(LOG_ERR, "journal %s error: %s (%d)", journal_path, strerror(errno), errno);
+			break;
+		}
+	}
+	buffer->length = 0;
+}
+
+static void *
+journalWriter(void *data)
+{
+	struct timespec until;
+	unsigned long dropped;
+
+	(void) pthread_mutex_lock(&journal_mutex);
+	while (journal_running || journal_full != NULL || 0 < journal_fill->length) {
+		if (journal_full == NULL) {
+			(void) clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec++;
+			if (journal_running)
+				(void) pthread_cond_timedwait(&journal_cond, &journal_mutex, &until);
+			if (journal_full == NULL && (0 < journal_fill->length))
+				(void) journalSwap();
+			if (journal_full == NULL)
+				continue;
+		}
+
+		dropped = journal_dropped;
+		journal_dropped = 0;
+		(void) pthread_mutex_unlock(&journal_mutex);
+
+		if (0 < dropped)
+			syslog(LOG_WARN, "journal %s dropped %lu records", journal_path, dropped);
+		journalWriteOut(journal_full);
+
+		(void) pthread_mutex_lock(&journal_mutex);
+		journal_full = NULL;
+	}
+	(void) pthread_mutex_unlock(&journal_mutex);
+
+	return NULL;
+}
+
+static int
+journalStart(void)
+{
+	struct stat sb;
+	JournalHeader header;
+
+	if ((journal_buffers[0].data = malloc(JOURNAL_BUFFER_SIZE)) == NULL
+	|| (journal_buffers[1].data = malloc(JOURNAL_BUFFER_SIZE)) == NULL) {
+		syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
+		return -1;
+	}
+	if ((journal_fd = open(journal_path, O_WRONLY|O_APPEND|O_CREAT, 0600)) < 0 || fstat(journal_fd, &sb)) {
+		syslog(LOG_ERR, "journal %s error: %s (%d)", journal_path, strerror(errno), errno);
+		return -1;
+	}
+
+	/* A new journal starts with a header; an old one is appended to. */
+	if (sb.st_size == 0) {
+		header.magic = JOURNAL_MAGIC;
+		header.version = JOURNAL_VERSION;
+		if (write(journal_fd, &header, sizeof (header)) != sizeof (header)) {
+			syslog(LOG_ERR, "journal %s error: %s (%d)", journal_path, strerror(errno), errno);
+			return -1;
+		}
+	}
+
+	journal_running = 1;
+	if (pthread_create(&journal_thread, NULL, journalWriter, NULL)) {
+		syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
+		journal_running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write out what is buffered and close the journal.  Called once the
+ * sessions are stopped.
+ */
+static void
+journalStop(void)
+{
+	if (journal_running) {
+		(void) pthread_mutex_lock(&journal_mutex);
+		journal_running = 0;
+		(void) pthread_cond_signal(&journal_cond);
+		(void) pthread_mutex_unlock(&journal_mutex);
+		(void) pthread_join(journal_thread, NULL);
+	}
+	if (0 <= journal_fd) {
+		(void) close(journal_fd);
+		journal_fd = -1;
+	}
+	free(journal_buffers[0].data);
+	free(journal_buffers[1].data);
+	journal_buffers[0].data = journal_buffers[1].data = NULL;
+}
+
+/***********************************************************************
+ *** Sampling
+ ***********************************************************************/
+
+/*
+ * A server given as host[:port]=percent[/by] only gets a share of the
+ * traffic.  Sessions are sampled before connecting, so a server not
+ * picked is never connected; messages are sampled at MAIL, and the
+ * servers not picked are set aside, still connected, until the next
+ * transaction.  A key, the client IP or the MAIL FROM address, picks
+ * the same way every time; without one the pick is random.  So that
+ * mail is never accepted for no one, a session or message that none
+ * of the servers pick goes to them all.
+ */
+typedef enum {
+	SAMPLE_SESSION,				/* Random share of sessions. */
+	SAMPLE_IP,				/* Sessions by client IP. */
+	SAMPLE_MESSAGE,				/* Random share of messages. */
+	SAMPLE_MAIL,				/* Messages by MAIL FROM. */
+} SampleBy;
+
+#define SAMPLE_OUT_SESSION	1
+#define SAMPLE_OUT_MESSAGE	2
+
+static const char *sample_names[] = { "session", "ip", "msg", "mail", NULL };
+static int sample_percent[MAX_ARGV_LENGTH];
+static SampleBy sample_by[MAX_ARGV_LENGTH];
+
+/*
+ * Parse the "=percent[/by]" after a server, return 0 or -1.
+ */
+static int
+sampleParse(int index, const char *spec)
+{
+	int i;
+	char *stop;
+
+	sample_percent[index] = 100;
+	sample_by[index] = SAMPLE_SESSION;
+	if (spec == NULL)
+		return 0;
+
+	sample_percent[index] = (int) strtol(spec, &stop, 10);
+	if (stop == spec || sample_percent[index] < 0 || 100 < sample_percent[index])
+		return -1;
+	if (*stop == '\0')
+		return 0;
+	if (*stop++ != '/')
+		return -1;
+
+	for (i = 0; sample_names[i] != NULL; i++) {
+		if (TextInsensitiveCompare(stop, sample_names[i]) == 0) {
+			sample_by[index] = (SampleBy) i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Return true if the server takes this session or message.  Keys are
+ * hashed with FNV-1a so that a server at 10% sees a subset of what one
+ * at 50% does.
+ */
+static int
+sampleTake(int index, const char *key)
+{
+	uint32_t hash;
+
+	/* The client always gets the primary's replies. */
+	if (100 <= sample_percent[index] || (primary_mode && index == 0))
+		return 1;
+	if (key == NULL)
+		return random() % 100 < sample_percent[index];
+
+	for (hash = 2166136261U; *key != '\0'; key++)
+		hash = (hash ^ (unsigned char) *key) * 16777619U;
+
+	return hash % 100 < (uint32_t) sample_percent[index];
+}
+
+static void
+smtpConnSampleSession(Connection *conn)
+{
+	int i, taken;
+
+	for (taken = i = 0; i < nservers; i++) {
+		conn->servers[i].sampled_out = 0;
+		if (sample_by[i] == SAMPLE_SESSION && !sampleTake(i, NULL))
+			conn->servers[i].sampled_out = SAMPLE_OUT_SESSION;
+		else if (sample_by[i] == SAMPLE_IP && !sampleTake(i, conn->client_addr))
+			conn->servers[i].sampled_out = SAMPLE_OUT_SESSION;
+		else
+			taken++;
+	}
+
+	if (taken == 0) {
+		for (i = 0; i < nservers; i++)
+			conn->servers[i].sampled_out = 0;
+	}
+}
+
+/*
+ * Put back the servers set aside for the last message.
+ */
+static void
+smtpConnUnpark(Connection *conn)
+{
+	int i;
+	Downstream *server;
+
+	for (i = 0; i < nservers; i++) {
+		server = &conn->servers[i];
+		if (server->sampled_out == SAMPLE_OUT_MESSAGE) {
+			server->sampled_out = 0;
+			if (server->parked != NULL) {
+				server->socket = server->parked;
+				server->parked = NULL;
+			}
+		}
+	}
+}
+
+/*
+ * Sample the message starting with this MAIL.  A server not picked
+ * is set aside by clearing its socket, so the relay loops pass it by.
+ * One still busy with earlier pipelined commands gets the message.
+ */
+static void
+smtpConnSampleMessage(Connection *conn)
+{
+	int i, taken;
+	Downstream *server;
+	const char *sender;
+
+	/* Sampled once -L has connected; -R routes whole sessions. */
+	if (conn->lazy || 0 <= conn->routed)
+		return;
+
+	smtpConnUnpark(conn);
+	sender = conn->mail == NULL ? "" : conn->mail->address.string;
+
+	for (taken = i = 0; i < nservers; i++) {
+		server = &conn->servers[i];
+		if (server->sampled_out != 0)
+			continue;
+		if (sample_by[i] == SAMPLE_MESSAGE ? sampleTake(i, NULL) : sample_by[i] != SAMPLE_MAIL || sampleTake(i, sender)) {
+			taken += server->socket != NULL || spool_dir != NULL;
+			continue;
+		}
+		if (server->socket != NULL) {
+			if (server->pending || 0 < server->out_length || server->connecting) {
+				taken++;
+				continue;
+			}
+			server->parked = server->socket;
+			server->socket = NULL;
+		}
+		server->sampled_out = SAMPLE_OUT_MESSAGE;
+	}
+
+	if (taken == 0)
+		smtpConnUnpark(conn);
+}
+
+/***********************************************************************
+ *** Balancing
+ ***********************************************************************/
+
+/*
+ * With -R each session is relayed to only one of the servers, so that
+ * roundhouse spreads the load over a pool of MTA rather than copy it
+ * to them all.  -R least picks the server with the fewest sessions
+ * routed to it; -R hash picks by the client IP on a hash ring, so a
+ * client keeps to the same server and adding or removing one only
+ * moves the clients in its share of the ring.  Should the server not
+ * connect or welcome, the session fails over to the next one in turn,
+ * or on the ring.  The servers not routed to are sampled out of the
+ * session, so the relay runs as it would for one server.
+ */
+typedef enum {
+	ROUTE_NONE,
+	ROUTE_LEAST,				/* Fewest sessions routed. */
+	ROUTE_HASH,				/* Client IP on a hash ring. */
+} RouteBy;
+
+typedef struct {
+	uint32_t hash;
+	int index;
+} RoutePoint;
+
+static RouteBy route_by;
+static const char *route_names[] = { "none", "least", "hash", NULL };
+static volatile unsigned long route_sessions[MAX_ARGV_LENGTH];
+static RoutePoint route_ring[MAX_ARGV_LENGTH * ROUTE_POINTS];
+static int route_ring_length;
+
+/*
+ * FNV-1a, as for sampling, with a final mix so that keys differing
+ * only at the end still land far apart on the ring.
+ */
+static uint32_t
+routeHash(const char *key)
+{
+	uint32_t hash;
+
+	for (hash = 2166136261U; *key != '\0'; key++)
+		hash = (hash ^ (unsigned char) *key) * 16777619U;
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35U;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+static int
+routeCompare(const void *a, const void *b)
+{
+	uint32_t x = ((RoutePoint *) a)->hash, y = ((RoutePoint *) b)->hash;
+
+	return x < y ? -1 : y < x;
+}
+
+/*
+ * Place ROUTE_POINTS points per server on the ring, by server name.
+ */
+static void
+routeInit(void)
+{
+	int i, j;
+	char key[SMTP_PATH_LENGTH];
+
+	route_ring_length = 0;
+	for (i = 0; i < nservers; i++) {
+		for (j = 0; j < ROUTE_POINTS; j++) {
+			(void) snprintf(key, sizeof (key), "%s#%d", smtp_host[i], j);
+			route_ring[route_ring_length].hash = routeHash(key);
+			route_ring[route_ring_length].index = i;
+			route_ring_length++;
+		}
+	}
+	qsort(route_ring, route_ring_length, sizeof (*route_ring), routeCompare);
+}
+
+/*
+ * Route the session to a server, in place of the one before if any.
+ */
+static void
+smtpConnRouteTo(Connection *conn, int index)
+{
+	if (0 <= conn->routed) {
+		conn->servers[conn->routed].sampled_out = SAMPLE_OUT_SESSION;
+		(void) __sync_fetch_and_sub(&route_sessions[conn->routed], 1);
+	}
+	if (0 <= index) {
+		conn->servers[index].sampled_out = 0;
+		(void) __sync_fetch_and_add(&route_sessions[index], 1);
+		syslog(LOG_DEBUG, LOG_FMT "#%d routed to %s", LOG_ARG, index, smtp_host[index]);
+	}
+	conn->routed = index;
+}
+
+/*
+ * Order the servers for the session, the first to route to then those
+ * to fail over to, and route it to the first.
+ */
+static void
+smtpConnRoute(Connection *conn)
+{
+	uint32_t hash;
+	unsigned long fewest;
+	int i, j, k, lo, hi, first;
+
+	for (i = 0; i < nservers; i++)
+		conn->servers[i].sampled_out = SAMPLE_OUT_SESSION;
+
+	conn->route_length = 0;
+	if (route_by == ROUTE_HASH) {
+		/* The first point at or after the client's, round the ring. */
+		hash = routeHash(conn->client_addr);
+		for (lo = 0, hi = route_ring_length; lo < hi; ) {
+			k = (lo + hi) / 2;
+			if (route_ring[k].hash < hash)
+				lo = k + 1;
+			else
+				hi = k;
+		}
+		for (k = 0; k < route_ring_length && conn->route_length < nservers; k++) {
+			i = route_ring[(lo + k) % route_ring_length].index;
+			for (j = 0; j < conn->route_length && conn->route[j] != i; j++)
+				;
+			if (j == conn->route_length)
+				conn->route[conn->route_length++] = i;
+		}
+	} else {
+		/* Ties start from a random server, so they spread out. */
+		first = random() % nservers;
+		fewest = route_sessions[first];
+		for (k = 1; k < nservers; k++) {
+			i = (first + k) % nservers;
+			if (route_sessions[i] < fewest) {
+				fewest = route_sessions[i];
+				first = i;
+			}
+		}
+		for (k = 0; k < nservers; k++)
+			conn->route[conn->route_length++] = (first + k) % nservers;
+	}
+
+	conn->route_next = 1;
+	smtpConnRouteTo(conn, conn->route[0]);
+}
+
+/*
+ * Fail over to the next server, if any.  Return -1 when none are left.
+ */
+static int
+smtpConnRouteNext(Connection *conn)
+{
+	if (conn->route_length <= conn->route_next)
+		return -1;
+
+	smtpConnRouteTo(conn, conn->route[conn->route_next++]);
+
+	return 0;
+}
+
+/***********************************************************************
+ *** Primary and Shadows
+ ***********************************************************************/
+
+/*
+ * With -P the first server is the primary and the session runs at its
+ * pace: only its replies are waited on, and they are what the client
+ * gets.  The other servers are shadows, sent the same commands through
+ * their output queues, whose replies are parsed and counted as they
+ * arrive but never waited on.  A shadow that falls too far behind, or
+ * whose queue fills, is dropped rather than hold up the client.  After
+ * QUIT the session stays open until the shadows catch up.
+ */
+#define IS_SHADOW(i)		(primary_mode && 0 < (i))
+
+/*
+ * True when the session waits on a server's replies.
+ */
+static int
+smtpConnWaits(Connection *conn, int index)
+{
+	return !IS_SHADOW(index) || conn->state == STATE_RESET || conn->state == STATE_SHADOWS;
+}
+
+/*
+ * Keep one of the primary's replies for the client.
+ */
+static void
+smtpConnAnswerAdd(Connection *conn, const char *reply)
+{
+	char *answer;
+	long length, size;
+
+	length = strlen(reply);
+	if (conn->answer_size < conn->answer_length + length + 1) {
+		for (size = conn->answer_size < SMTP_TEXT_LINE_LENGTH ? SMTP_TEXT_LINE_LENGTH : conn->answer_size; size < conn->answer_length + length + 1; size *= 2)
+			;
+		if ((answer = realloc(conn->answer, size)) == NULL) {
+			syslog(LOG_ERR, LOG_FMT "%s (%d)", LOG_ARG, strerror(errno), errno);
+			return;
+		}
+		conn->answer = answer;
+		conn->answer_size = size;
+	}
+
+	conn->answer_last = conn->answer_length;
+	memcpy(conn->answer + conn->answer_length, reply, length + 1);
+	conn->answer_length += length;
+}
+
+/***********************************************************************
+ *** Output Queues
+ ***********************************************************************/
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL		0
+#endif
+
+/*
+ * Send as much of a server's queued output as it will take without
+ * blocking.  Return 0 on success or -1 on error.
+ */
+static int
+smtpConnFlush(Connection *conn, int index)
+{
+	long length;
+	Downstream *server = &conn->servers[index];
+
+	if (server->socket == NULL || server->connecting)
+		return 0;
+
+	while (server->out_offset < server->out_length - server->out_held) {
+		length = send(server->socket->fd, server->out + server->out_offset, server->out_length - server->out_held - server->out_offset, MSG_NOSIGNAL);
+		if (length < 0 && errno == EINTR)
+			continue;
+		if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (length < 0) {
+			syslog(LOG_ERR, LOG_FMT "#%d write error: %s (%d)", LOG_ARG, index, strerror(errno), errno);
+			server->write_error = 1;
+			return -1;
+		}
+		server->out_offset += length;
+	}
+
+	if (server->out_offset == server->out_length)
+		server->out_offset = server->out_length = 0;
+
+	return 0;
+}
+
+/*
+ * Queue output for a server and send what it will take now, so that
+ * a slow server never holds up the client or the other servers.  When
+ * the queue would pass the high-water mark, either fail so that the
+ * server is dropped, or with -b wait, accept it and let the client
+ * wait until the queue drains; see smtpConnBlocked().
+ */
+static long
+smtpConnQueue(Connection *conn, int index, const char *line, long length)
+{
+	char *out;
+	long size, sent, queued;
+	struct iovec iov[2];
+	struct msghdr msg;
+	Downstream *server = &conn->servers[index];
+
+	STATS_SERVER_ADD(conn, index, bytes_out, length);
+
+	/* Gather what is already queued and the new output into one
+	 * write, so that only what the server doesn't take is copied.
+	 * A pipelined group of commands is held until the group ends;
+	 * see smtpConnBatchEnd().
+	 */
+	if (server->socket != NULL && !server->connecting && server->out_held == 0 && !(conn->state == STATE_COMMAND && 0 < conn->batch)) {
+		queued = server->out_length - server->out_offset;
+		iov[0].iov_base = server->out + server->out_offset;
+		iov[0].iov_len = queued;
+		iov[1].iov_base = (char *) line;
+		iov[1].iov_len = length;
+
+		memset(&msg, 0, sizeof (msg));
+		msg.msg_iov = queued <= 0 ? iov+1 : iov;
+		msg.msg_iovlen = queued <= 0 ? 1 : 2;
+
+		while ((sent = sendmsg(server->socket->fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+			;
+		if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			syslog(LOG_ERR, LOG_FMT "#%d write error: %s (%d)", LOG_ARG, index, strerror(errno), errno);
+			server->write_error = 1;
+			return -1;
+		}
+		if (0 < sent) {
+			if (sent < queued) {
+				server->out_offset += sent;
+			} else {
+				sent -= queued;
+				server->out_offset = server->out_length = 0;
+				line += sent;
+				length -= sent;
+			}
+		}
+		if (length <= 0)
+			return iov[1].iov_len;
+	}
+
+	if ((!output_wait || IS_SHADOW(index)) && output_high_water < server->out_length - server->out_offset + length) {
+		syslog(LOG_ERR, LOG_FMT "#%d output queue full, dropping %s", LOG_ARG, index, smtp_host[index]);
+		return -1;
+	}
+
+	if (server->out_size < server->out_length + length && 0 < server->out_offset) {
+		server->out_length -= server->out_offset;
+		memmove(server->out, server->out + server->out_offset, server->out_length);
+		server->out_offset = 0;
+	}
+
+	if (server->out_size < server->out_length + length) {
+		for (size = server->out_size < SMTP_TEXT_LINE_LENGTH ? SMTP_TEXT_LINE_LENGTH : server->out_size; size < server->out_length + length; size *= 2)
+			;
+		if ((out = realloc(server->out, size)) == NULL) {
+			syslog(LOG_ERR, LOG_FMT "#%d %s (%d)", LOG_ARG, index, strerror(errno), errno);
+			return -1;
+		}
+		server->out = out;
+		server->out_size = size;
+	}
+
+	memcpy(server->out + server->out_length, line, length);
+	server->out_length += length;
+
+	return length;
+}
+
+/*
+ * True when a server's output queue is over the high-water mark and
+ * the client should not be read until it drains.
+ */
+static int
+smtpConnBlocked(Connection *conn)
+{
+	int i;
+
+	for (i = 0; i < nservers; i++) {
+		if (conn->servers[i].socket != NULL && !IS_SHADOW(i) && output_high_water < conn->servers[i].out_length - conn->servers[i].out_offset)
+			return 1;
+	}
+
+	return 0;
+}
+
+static long
+smtpConnPrint(Connection *conn, int index, const char *line)
+{
+	Socket2 *s;
+
+	if (index < 0)
+		/* Sending to the client. */
+		syslog(LOG_DEBUG, LOG_FMT "< %s", LOG_ARG, line);
+
+	s = index < 0 ? conn->client : conn->servers[index].socket;
+	if (s == NULL) {
+		/* Server in this slot has been disconnected. */
+		return 0;
+	}
+
+	if (0 <= index)
+		return smtpConnQueue(conn, index, line, strlen(line));
+
+	STATS_ADD(conn, client_out, strlen(line));
+
+	return socketWrite(s, (unsigned char *) line, strlen(line));
+}
+
+static void
+smtpConnDisconnect(Connection *conn, int index)
+{
+	if (conn->servers[index].socket != NULL) {
+		syslog(LOG_DEBUG, LOG_FMT "#%d disconnecting from %s", LOG_ARG, index, smtp_host[index]);
+		STATS_SERVER_ADD(conn, index, disconnects, 1);
+		STATS_SERVER_ADD(conn, index, write_errors, conn->servers[index].write_error);
+		conn->servers[index].write_error = 0;
+		resolveDrop(index, &conn->servers[index].socket->address);
+		socketClose(conn->servers[index].socket);
+		conn->servers[index].socket = NULL;
+		conn->servers[index].pending = 0;
+		conn->servers[index].phase_first = 0;
+		conn->servers[index].connecting = 0;
+		conn->servers[index].length = 0;
+		conn->servers[index].out_offset = 0;
+		conn->servers[index].out_length = 0;
+		conn->servers[index].out_held = 0;
+		conn->connected--;
+	}
+}
+
+static void smtpConnWatch(Connection *conn, int index);
+static void smtpConnUnwatch(Connection *conn, int index);
+
+/*
+ * Return a server connection, that has just been reset, to the pool
+ * for another session to use, else disconnect.
+ */
+static void
+smtpConnRelease(Connection *conn, int index)
+{
+	SocketAddress address;
+	Downstream *server = &conn->servers[index];
+
+	if (server->socket == NULL)
+		return;
+
+	smtpConnUnwatch(conn, index);
+
+	/* Once pooled, another session may take the socket. */
+	address = server->socket->address;
+	if (server->pending == 0 && server->length == 0 && server->out_length == 0 && poolPut(index, server->socket) == 0) {
+		resolveDrop(index, &address);
+		syslog(LOG_DEBUG, LOG_FMT "#%d returned to pool %s", LOG_ARG, index, smtp_host[index]);
+		STATS_SERVER_ADD(conn, index, disconnects, 1);
+		server->socket = NULL;
+		server->pending = 0;
+		server->phase_first = 0;
+		conn->connected--;
+		return;
+	}
+
+	smtpConnDisconnect(conn, index);
+}
+
+/*
+ * Change the session state and restart the deadline for either the
+ * client's next input or the servers' replies.
+ */
+static void
+smtpConnSetState(Connection *conn, SessionState state)
+{
+	conn->state = state;
+	conn->deadline = socket_timeout <= 0 ? 0 : monotonicUs() + socket_timeout * 1000;
+}
+
+/***********************************************************************
+ *** Spool
+ ***********************************************************************/
+
+#ifdef HAVE_SYS_MMAN_H
+
+static volatile int spool_running;
+static pthread_t spool_threads[MAX_ARGV_LENGTH];
+static pthread_mutex_t spool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spool_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Discard the message being spooled, if any.
+ */
+static void
+spoolAbort(Connection *conn)
+{
+	char path[512];
+	Spool *spool = &conn->spool;
+
+	if (spool->fd < 0)
+		return;
+
+	if (spool->base != NULL)
+		(void) munmap(spool->base, SPOOL_SEGMENT_SIZE);
+	(void) close(spool->fd);
+
+	(void) snprintf(path, sizeof (path), "%s/tmp/%s", spool_dir, spool->name);
+	(void) unlink(path);
+
+	spool->base = NULL;
+	spool->fd = -1;
+}
+
+/*
+ * Append to the message being spooled, mapping the next segment of
+ * the file as each one fills.
+ */
+static int
+spoolWrite(Connection *conn, const char *data, size_t length)
+{
+	size_t n;
+	void *base;
+	Spool *spool = &conn->spool;
+
+	if (spool->fd < 0 || spool->error)
+		return -1;
+
+	while (0 < length) {
+		if (spool->base == NULL || SPOOL_SEGMENT_SIZE <= spool->length) {
+			if (spool->base != NULL) {
+				(void) munmap(spool->base, SPOOL_SEGMENT_SIZE);
+				spool->offset += SPOOL_SEGMENT_SIZE;
+				spool->base = NULL;
+			}
+			if (ftruncate(spool->fd, spool->offset + SPOOL_SEGMENT_SIZE)
+			|| (base = mmap(NULL, SPOOL_SEGMENT_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, spool->fd, spool->offset)) == MAP_FAILED) {
+				syslog(LOG_ERR, LOG_FMT "spool %s error: %s (%d)", LOG_ARG, spool->name, strerror(errno), errno);
+				spool->error = errno;
+				return -1;
+			}
+			spool->base = base;
+			spool->length = 0;
+		}
+
+		n = SPOOL_SEGMENT_SIZE - spool->length;
+		if (length < n)
+			n = length;
+
+		memcpy(spool->base + spool->length, data, n);
+		spool->length += n;
+		data += n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Start spooling a message with the session details needed to
+ * replay it: XCLIENT, HELO or EHLO, and AUTH.
+ */
+static int
+spoolOpen(Connection *conn)
+{
+	char path[512];
+	Spool *spool = &conn->spool;
+
+	spoolAbort(conn);
+
+	(void) snprintf(spool->name, sizeof (spool->name), "%lx-%s-%u", (unsigned long) time(NULL), conn->id, ++conn->spool_count);
+	(void) snprintf(path, sizeof (path), "%s/tmp/%s", spool_dir, spool->name);
+
+	if ((spool->fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0600)) < 0) {
+		syslog(LOG_ERR, LOG_FMT "spool %s error: %s (%d)", LOG_ARG, path, strerror(errno), errno);
+		return -1;
+	}
+
+	spool->error = 0;
+	spool->rcpts = 0;
+	spool->offset = 0;
+	spool->length = 0;
+
+	if (spoolWrite(conn, conn->xclient, strlen(conn->xclient)))
+		return -1;
+	if (conn->helo != NULL && spoolWrite(conn, conn->helo, strlen(conn->helo)))
+		return -1;
+	if (conn->auth != NULL && spoolWrite(conn, conn->auth, strlen(conn->auth)))
+		return -1;
+
+	return 0;
+}
+
+static void
+spoolSyncDir(const char *dir)
+{
+	int fd;
+
+	if (0 <= (fd = open(dir, O_RDONLY))) {
+		(void) fsync(fd);
+		(void) close(fd);
+	}
+}
+
+/*
+ * Make the spooled message durable, then queue it for each server
+ * with a hard link in the server's directory.
+ */
+static int
+spoolCommit(Connection *conn)
+{
+	int i, rc;
+	off_t size;
+	Spool *spool = &conn->spool;
+	char path[512], link_path[512];
+
+	if (spool->fd < 0 || spool->error) {
+		spoolAbort(conn);
+		return -1;
+	}
+
+	rc = -1;
+	size = spool->offset + spool->length;
+	(void) munmap(spool->base, SPOOL_SEGMENT_SIZE);
+	spool->base = NULL;
+
+	(void) snprintf(path, sizeof (path), "%s/tmp/%s", spool_dir, spool->name);
+
+	if (ftruncate(spool->fd, size) || fsync(spool->fd)) {
+		syslog(LOG_ERR, LOG_FMT "spool %s error: %s (%d)", LOG_ARG, spool->name, strerror(errno), errno);
+		goto error0;
+	}
+
+	for (i = 0; i < nservers; i++) {
+		if (conn->servers[i].sampled_out)
+			continue;
+		(void) snprintf(link_path, sizeof (link_path), "%s/%d/%s", spool_dir, i, spool->name);
+		if (link(path, link_path)) {
+			syslog(LOG_ERR, LOG_FMT "spool %s error: %s (%d)", LOG_ARG, link_path, strerror(errno), errno);
+			goto error1;
+		}
+	}
+	for (i = 0; i < nservers; i++) {
+		(void) snprintf(link_path, sizeof (link_path), "%s/%d", spool_dir, i);
+		spoolSyncDir(link_path);
+	}
+
+	syslog(LOG_INFO, LOG_FMT "spooled %s size=%ld", LOG_ARG, spool->name, (long) size);
+
+	(void) pthread_mutex_lock(&spool_mutex);
+	(void) pthread_cond_broadcast(&spool_cond);
+	(void) pthread_mutex_unlock(&spool_mutex);
+
+	rc = 0;
+error1:
+	/* Undo a partial queuing. */
+	while (rc != 0 && 0 <= --i) {
+		(void) snprintf(link_path, sizeof (link_path), "%s/%d/%s", spool_dir, i, spool->name);
+		(void) unlink(link_path);
+	}
+error0:
+	spoolAbort(conn);
+
+	return rc;
+}
+
+/*
+ * Read a server reply, noting any capabilities given.  Return the
+ * reply code, or -1 on I/O error.
+ */
+static int
+spoolReply(int index, Socket2 *s, unsigned *caps)
+{
+	long length;
+	char line[SMTP_REPLY_LINE_LENGTH+1];
+
+	do {
+		if ((length = socketReadLine2(s, line, sizeof (line), 0)) < 0) {
+			syslog(LOG_ERR, "spool #%d read error from %s", index, smtp_host[index]);
+			return -1;
+		}
+		if (caps != NULL)
+			*caps |= capabilityLine(line, NULL);
+	} while (3 < length && line[3] == '-');
+
+	return strtol(line, NULL, 10);
+}
+
+static int
+spoolSend(int index, Socket2 *s, const char *line, long length, unsigned *caps)
+{
+	if (socketWrite(s, (unsigned char *) line, length) != length) {
+		syslog(LOG_ERR, "spool #%d write error to %s", index, smtp_host[index]);
+		return -1;
+	}
+
+	return spoolReply(index, s, caps);
+}
+
+/*
+ * Replay a spooled message to one server.  Return 0 when the message
+ * is done with, even if the server rejected it, or -1 to try again
+ * later.
+ */
+static int
+spoolReplay(int index, const char *path)
+{
+	int fd, rc, code, n;
+	unsigned caps;
+	char *map, *line, *eol, *end, *data, *xclient;
+	SocketAddress address;
+	struct stat sb;
+	Socket2 *s;
+
+	rc = -1;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return errno == ENOENT ? 0 : -1;
+	if (fstat(fd, &sb) || sb.st_size <= 0)
+		goto error1;
+	if ((map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		goto error1;
+
+	/* Retried later, like any other failure. */
+	if (!healthAllow(index))
+		goto error2;
+
+	if ((s = poolGet(index)) != NULL) {
+		(void) socketSetNonBlocking(s, 0);
+	} else {
+		if (resolvePick(index, &address) || (s = socketOpen(&address, 1)) == NULL)
+			goto error2;
+		(void) resolveHold(index, &s->address);
+		(void) socketSetNagle(s, 0);
+		if (socketClient(s, connect_timeout)) {
+			if (healthDown(index))
+				syslog(LOG_ERR, "spool #%d connection to %s failed", index, smtp_host[index]);
+			goto error3;
+		}
+		socketSetTimeout(s, socket_timeout);
+		if ((code = spoolReply(index, s, NULL)) != 220) {
+			if (code < 0 || code == 421)
+				(void) healthDown(index);
+			goto error3;
+		}
+	}
+	healthUp(index);
+	socketSetTimeout(s, socket_timeout);
+
+	/* Replay the envelope up to and including DATA. */
+	caps = 0;
+	xclient = NULL;
+	end = map + sb.st_size;
+	for (line = eol = map; line < end; line = eol) {
+		if ((eol = memchr(line, '\n', end - line)) == NULL)
+			break;
+		eol++;
+
+		if (0 < TextInsensitiveStartsWith(line, "XCLIENT")) {
+			/* Sent once the server says it supports it. */
+			xclient = line;
+			continue;
+		}
+
+		if ((caps & CAP_PIPELINING) && 0 < TextInsensitiveStartsWith(line, "MAIL FROM:")) {
+			/* Send the rest of the envelope, through DATA, in
+			 * one write and collect the replies after.
+			 */
+			for (n = 1, data = line; eol < end && TextInsensitiveStartsWith(data, "DATA") <= 0; n++) {
+				data = eol;
+				if ((eol = memchr(eol, '\n', end - eol)) == NULL)
+					break;
+				eol++;
+			}
+			if (eol == NULL)
+				break;
+			if (socketWrite(s, (unsigned char *) line, eol - line) != eol - line) {
+				syslog(LOG_ERR, "spool #%d write error to %s", index, smtp_host[index]);
+				goto error3;
+			}
+			do {
+				if ((code = spoolReply(index, s, NULL)) < 0)
+					goto error3;
+			} while (0 < --n);
+			line = data;
+		} else {
+			if (0 < TextInsensitiveStartsWith(line, "EHLO") || 0 < TextInsensitiveStartsWith(line, "HELO"))
+				caps = 0;
+			if ((code = spoolSend(index, s, line, eol - line, &caps)) < 0)
+				goto error3;
+		}
+
+		if (xclient != NULL && (caps & CAP_XCLIENT) && 0 < TextInsensitiveStartsWith(line, "EHLO")) {
+			if (spoolSend(index, s, xclient, strcspn(xclient, "\n")+1, NULL) < 0)
+				goto error3;
+			if ((code = spoolSend(index, s, line, eol - line, NULL)) < 0)
+				goto error3;
+		}
+
+		if (0 < TextInsensitiveStartsWith(line, "DATA")) {
+			if (code != 354) {
+				syslog(LOG_ERR, "spool #%d %s DATA rejected %d", index, smtp_host[index], code);
+				rc = 0;
+				goto error3;
+			}
+			break;
+		}
+	}
+	if (eol == NULL || end <= line) {
+		syslog(LOG_ERR, "spool %s malformed", path);
+		rc = 0;
+		goto error3;
+	}
+
+	/* The content ends with the dot line. */
+	if (socketWrite(s, (unsigned char *) eol, end - eol) != end - eol || (code = spoolReply(index, s, NULL)) < 0)
+		goto error3;
+
+	syslog(LOG_INFO, "spool #%d %s replayed to %s reply=%d", index, strrchr(path, '/')+1, smtp_host[index], code);
+	rc = 0;
+
+	/* Keep the connection for the next message. */
+	if (spoolSend(index, s, "RSET\r\n", sizeof ("RSET\r\n")-1, NULL) == 250) {
+		(void) socketSetNonBlocking(s, 1);
+		address = s->address;
+		if (poolPut(index, s) == 0) {
+			resolveDrop(index, &address);
+			s = NULL;
+		}
+	}
+error3:
+	if (s != NULL) {
+		resolveDrop(index, &s->address);
+		socketClose(s);
+	}
+error2:
+	(void) munmap(map, sb.st_size);
+error1:
+	(void) close(fd);
+
+	return rc;
+}
+
+/*
+ * Wait for more work, or until a retry is due.
+ */
+static void
+spoolWait(long ms, int wake)
+{
+	struct timespec until;
+
+	(void) clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += ms / 1000;
+	until.tv_nsec += (ms % 1000) * 1000000;
+	if (1000000000 <= until.tv_nsec) {
+		until.tv_nsec -= 1000000000;
+		until.tv_sec++;
+	}
+
+	(void) pthread_mutex_lock(&spool_mutex);
+	while (spool_running && pthread_cond_timedwait(&spool_cond, &spool_mutex, &until) == 0 && !wake)
+		;
+	(void) pthread_mutex_unlock(&spool_mutex);
+}
+
+/*
+ * Replay the messages queued for one server at its own pace.
+ */
+static void *
+spoolWorker(void *data)
+{
+	DIR *dir;
+	struct dirent *entry;
+	int index, replayed, failed;
+	char dir_path[240], path[512];
+
+	index = (int) (intptr_t) data;
+	(void) snprintf(dir_path, sizeof (dir_path), "%s/%d", spool_dir, index);
+
+	while (spool_running) {
+		replayed = failed = 0;
+		if ((dir = opendir(dir_path)) != NULL) {
+			while (spool_running && !failed && (entry = readdir(dir)) != NULL) {
+				if (*entry->d_name == '.')
+					continue;
+				(void) snprintf(path, sizeof (path), "%s/%s", dir_path, entry->d_name);
+				if ((failed = spoolReplay(index, path)) == 0) {
+					(void) unlink(path);
+					replayed++;
+				}
+			}
+			(void) closedir(dir);
+		}
+
+		if (failed)
+			spoolWait(SPOOL_RETRY_INTERVAL, 0);
+		else if (replayed == 0)
+			spoolWait(1000, 1);
+	}
+
+	return NULL;
+}
+
+static int
+spoolMkdir(const char *path)
+{
+	if (mkdir(path, 0700) && errno != EEXIST) {
+		syslog(LOG_ERR, "spool %s error: %s (%d)", path, strerror(errno), errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+spoolStart(void)
+{
+	int i;
+	DIR *dir;
+	struct dirent *entry;
+	char path[512];
+
+	if (spoolMkdir(spool_dir))
+		return -1;
+
+	/* Incomplete messages were never accepted; discard them. */
+	(void) snprintf(path, sizeof (path), "%s/tmp", spool_dir);
+	if (spoolMkdir(path) || (dir = opendir(path)) == NULL)
+		return -1;
+	while ((entry = readdir(dir)) != NULL) {
+		if (*entry->d_name == '.')
+			continue;
+		(void) snprintf(path, sizeof (path), "%s/tmp/%s", spool_dir, entry->d_name);
+		(void) unlink(path);
+	}
+	(void) closedir(dir);
+
+	spool_running = 1;
+	for (i = 0; i < nservers; i++) {
+		(void) snprintf(path, sizeof (path), "%s/%d", spool_dir, i);
+		if (spoolMkdir(path))
+			return -1;
+		if (pthread_create(&spool_threads[i], NULL, spoolWorker, (void *) (intptr_t) i)) {
+			syslog(LOG_ERR, "spool #%d thread error: %s (%d)", i, strerror(errno), errno);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+spoolStop(void)
+{
+	int i;
+
+	if (!spool_running)
+		return;
+
+	(void) pthread_mutex_lock(&spool_mutex);
+	spool_running = 0;
+	(void) pthread_cond_broadcast(&spool_cond);
+	(void) pthread_mutex_unlock(&spool_mutex);
+
+	for (i = 0; i < nservers; i++) {
+		if (spool_threads[i] != 0)
+			(void) pthread_join(spool_threads[i], NULL);
+	}
+}
+
+#else
+
+static void
+spoolAbort(Connection *conn)
+{
+	/* Do nothing. */
+}
+
+static int
+spoolWrite(Connection *conn, const char *data, size_t length)
+{
+	return -1;
+}
+
+static int
+spoolOpen(Connection *conn)
+{
+	return -1;
+}
+
+static int
+spoolCommit(Connection *conn)
+{
+	return -1;
+}
+
+#endif /* HAVE_SYS_MMAN_H */
+
+/*
+ * Write a line to every connected server and optionally count on
+ * one more reply from each.  In spool mode, write it to the spool.
+ */
+static Phase
+smtpConnPhase(const char *line)
+{
+	if (line[0] == '.')
+		return PHASE_DOT;
+	if (0 < TextInsensitiveStartsWith(line, "EHLO") || 0 < TextInsensitiveStartsWith(line, "HELO"))
+		return PHASE_EHLO;
+	if (0 < TextInsensitiveStartsWith(line, "MAIL FROM:"))
+		return PHASE_MAIL;
+	if (0 < TextInsensitiveStartsWith(line, "RCPT TO:"))
+		return PHASE_RCPT;
+	if (0 < TextInsensitiveStartsWith(line, "DATA"))
+		return PHASE_DATA;
+	return PHASE_NONE;
+}
+
+/*
+ * Count on one more reply from a server, in the given phase.  The wait
+ * is timed from when the server has no other reply pending.
+ *
+ * Each command written to all the servers is one exchange, so their
+ * replies to it can be compared.  The servers are always visited in
+ * order, so a server expecting a second reply in the current exchange
+ * starts the next one.
+ */
+static void
+smtpConnExpect(Connection *conn, int index, Phase phase)
+{
+	int slot;
+	Downstream *server = &conn->servers[index];
+
+	/* Only a shadow can fall this far behind. */
+	if (PIPELINE_MAX < server->pending) {
+		syslog(LOG_ERR, LOG_FMT "#%d too far behind, dropping %s", LOG_ARG, index, smtp_host[index]);
+		smtpConnDisconnect(conn, index);
+		return;
+	}
+
+	if (server->pending == 0 && REPLIES_TIMED) {
+		server->sent = monotonicUs();
+		/* Connect first; the welcome is timed from there. */
+		server->due = server->connecting ? 0 : replyDue(index, phase, server->sent);
+	}
+	if (server->exchange == conn->exchange)
+		conn->exchange++;
+	server->exchange = conn->exchange;
+
+	slot = (server->phase_first + server->pending) % sizeof (server->phases);
+	server->phases[slot] = phase;
+	server->exchanges[slot] = server->exchange;
+	server->pending++;
+}
+
+/*
+ * Compare a server's reply time with the first server's for the same
+ * exchange, once both have replied.
+ */
+static void
+smtpConnCompare(Connection *conn, int index, ReplyTime *timed)
+{
+	int i;
+	ReplyTime *other;
+
+	if (index == 0) {
+		for (i = 1; i < nservers; i++) {
+			other = &conn->servers[i].timed[timed->exchange % COMPARE_WINDOW];
+			if (other->exchange == timed->exchange && other->phase == timed->phase) {
+				syslog(LOG_DEBUG, LOG_FMT "#%d %s %.3fms, #0 %.3fms", LOG_ARG, i, phase_names[timed->phase], other->us / 1e3, timed->us / 1e3);
+				metricsRecordDelta(i, timed->phase, (int64_t) other->us - (int64_t) timed->us);
+			}
+		}
+	} else {
+		other = &conn->servers[0].timed[timed->exchange % COMPARE_WINDOW];
+		if (other->exchange == timed->exchange && other->phase == timed->phase) {
+			syslog(LOG_DEBUG, LOG_FMT "#%d %s %.3fms, #0 %.3fms", LOG_ARG, index, phase_names[timed->phase], timed->us / 1e3, other->us / 1e3);
+			metricsRecordDelta(index, timed->phase, (int64_t) timed->us - (int64_t) other->us);
+		}
+	}
+}
+
+/*
+ * Time the reply just parsed.  A pipelined reply is timed from the one
+ * before it, which is the time the server took over that command.
+ */
+static void
+smtpConnReplyTime(Connection *conn, int index)
+{
+	uint64_t now;
+	ReplyTime *timed;
+	Downstream *server = &conn->servers[index];
+	Phase phase = server->phases[server->phase_first];
+
+	now = REPLIES_TIMED ? monotonicUs() : 0;
+	replyEstimate(index, phase, now - server->sent);
+	if (metrics_socket != NULL) {
+		metricsRecord(index, phase, now - server->sent);
+
+		if (phase < PHASE_NONE && 1 < nservers) {
+			timed = &server->timed[server->exchanges[server->phase_first] % COMPARE_WINDOW];
+			timed->exchange = server->exchanges[server->phase_first];
+			timed->phase = phase;
+			timed->us = now - server->sent;
+			smtpConnCompare(conn, index, timed);
+		}
+	}
+	server->phase_first = (server->phase_first + 1) % sizeof (server->phases);
+	if (REPLIES_TIMED) {
+		server->sent = now;
+		if (1 < server->pending)
+			server->due = replyDue(index, server->phases[server->phase_first], now);
+	}
+}
+
+static void
+smtpConnPrintAll(Connection *conn, const char *line, int want_reply)
+{
+	int i;
+	Phase phase;
+
+	if (spool_dir != NULL) {
+		(void) spoolWrite(conn, line, strlen(line));
+		return;
+	}
+
+	phase = want_reply ? smtpConnPhase(line) : PHASE_NONE;
+
+	for (i = 0; i < nservers; i++) {
+		if (conn->servers[i].socket == NULL)
+			continue;
+
+		if (smtpConnPrint(conn, i, line) < 0) {
+			smtpConnDisconnect(conn, i);
+			continue;
+		}
+
+		/* A server without PIPELINING gets the rest of a group
+		 * a command at a time, as each reply arrives.
+		 */
+		if (0 < conn->batch && 0 < conn->servers[i].pending && !(conn->servers[i].caps & CAP_PIPELINING))
+			conn->servers[i].out_held += strlen(line);
+
+		if (want_reply)
+			smtpConnExpect(conn, i, phase);
+	}
+}
+
+/*
+ * Extract the next complete, possibly multiline, reply from the
+ * server's input buffer into its reply buffer. Return 1 if a reply
+ * was found, 0 if more input is required, or -1 for a malformed
+ * reply.
+ */
+static int
+smtpReplyParse(Downstream *server)
+{
+	long size;
+	char *line, *eol, *stop;
+
+	for (line = server->buffer; (eol = memchr(line, '\n', server->length - (line - server->buffer))) != NULL; line = eol+1) {
+		/* Did we read sufficient characters for a response code? */
+		if (eol + 1 - line < 4)
+			return -1;
+
+		server->code = strtol(line, &stop, 10);
+		if (line + 3 != stop)
+			return -1;
+		if (line[3] == '-')
+			continue;
+
+		size = eol + 1 - server->buffer;
+		if (sizeof (server->reply) <= size)
+			size = sizeof (server->reply)-1;
+		memcpy(server->reply, server->buffer, size);
+		server->reply[size] = '\0';
+
+		size = eol + 1 - server->buffer;
+		server->length -= size;
+		memmove(server->buffer, eol+1, server->length);
+
+		return 1;
+	}
+
+	if (sizeof (server->buffer)-1 <= server->length) {
+		/* Reply longer than our buffer.  Discard the leading
+		 * continuation lines already seen and keep going.
+		 */
+		if (line == server->buffer)
+			return -1;
+		server->length -= line - server->buffer;
+		memmove(server->buffer, line, server->length);
+	}
+
+	return 0;
+}
+
+static void smtpConnParse(Connection *conn, int index);
+
+/*
+ * A server has failed; count it against the server's health if it was
+ * still to welcome us.  Return true if the failure should be logged.
+ */
+static int
+smtpConnFailed(Connection *conn, int index)
+{
+	Downstream *server = &conn->servers[index];
+
+	if (server->connecting || (server->pending && server->phases[server->phase_first] == PHASE_WELCOME))
+		return healthDown(index);
+
+	return 1;
+}
+
+/*
+ * Read what a server has sent without blocking.
+ */
+static void
+smtpConnServerRead(Connection *conn, int index)
+{
+	long length;
+	Downstream *server = &conn->servers[index];
+
+	if (server->connecting)
+		return;
+
+	while (server->socket != NULL && server->length < sizeof (server->buffer)-1) {
+		length = recv(server->socket->fd, server->buffer + server->length, sizeof (server->buffer)-1 - server->length, 0);
+		if (length < 0 && errno == EINTR)
+			continue;
+		if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		if (length < 0) {
+			if (smtpConnFailed(conn, index))
+				syslog(LOG_ERR, LOG_FMT "#%d read error: %s (%d)", LOG_ARG, index, strerror(errno), errno);
+			smtpConnDisconnect(conn, index);
+		} else if (length == 0) {
+			/* Take in any replies that came with the EOF. */
+			smtpConnParse(conn, index);
+			if (server->socket == NULL)
+				break;
+			/* Only an error if we're still waiting on it. */
+			if (server->pending && smtpConnFailed(conn, index))
+				syslog(LOG_ERR, LOG_FMT "#%d unexpected EOF", LOG_ARG, index);
+			smtpConnDisconnect(conn, index);
+		} else {
+			server->length += length;
+		}
+	}
+}
+
+/*
+ * Check if a non-blocking connect has finished.  Return 1 connected,
+ * 0 still in progress, or -1 on error.
+ */
+static int
+smtpConnConnected(Connection *conn, int index)
+{
+	int error;
+	uint64_t now;
+	socklen_t length;
+	struct pollfd fds;
+	Downstream *server = &conn->servers[index];
+
+	fds.fd = server->socket->fd;
+	fds.events = POLLOUT;
+	fds.revents = 0;
+
+	if (poll(&fds, 1, 0) <= 0)
+		return 0;
+
+	length = sizeof (error);
+	if (getsockopt(server->socket->fd, SOL_SOCKET, SO_ERROR, &error, &length))
+		error = errno;
+	if (error != 0) {
+		if (healthDown(index))
+			syslog(LOG_ERR, LOG_FMT "#%d connection to %s failed: %s (%d)", LOG_ARG, index, smtp_host[index], strerror(error), error);
+		return -1;
+	}
+
+	server->connecting = 0;
+	syslog(LOG_DEBUG, LOG_FMT "#%d connected to %s", LOG_ARG, index, smtp_host[index]);
+
+	/* The welcome is timed from here. */
+	if (REPLIES_TIMED) {
+		now = monotonicUs();
+		if (metrics_socket != NULL)
+			metricsRecord(index, PHASE_CONNECT, now - server->sent);
+		server->sent = now;
+		server->due = replyDue(index, PHASE_WELCOME, now);
+	}
+
+	return 1;
+}
+
+/*
+ * Release the next command held for a server without PIPELINING.
+ */
+static int
+smtpConnUnhold(Connection *conn, int index)
+{
+	char *start, *eol;
+	Downstream *server = &conn->servers[index];
+
+	start = server->out + server->out_length - server->out_held;
+	eol = memchr(start, '\n', server->out_held);
+	server->out_held -= eol == NULL ? server->out_held : eol + 1 - start;
+
+	return smtpConnFlush(conn, index);
+}
+
+/*
+ * A shadow's replies are only seen here.  Drop it if it refuses the
+ * session, and learn its extensions from its reply to EHLO.
+ */
+static void
+smtpConnShadowReply(Connection *conn, int index, Phase phase)
+{
+	Downstream *server = &conn->servers[index];
+
+	if (phase == PHASE_WELCOME && server->code != 220) {
+		syslog(LOG_ERR, LOG_FMT "#%d no welcome from %s", LOG_ARG, index, smtp_host[index]);
+		smtpConnDisconnect(conn, index);
+	} else if (phase == PHASE_EHLO && server->code == 250) {
+		server->caps = capabilityGet(index, server->reply);
+	}
+}
+
+/*
+ * Parse a server's buffered replies.  Replies to a pipelined group
+ * arrive in order; the last one, to the group's final command, is
+ * kept.  With -P those of the primary are also kept for the client.
+ */
+static void
+smtpConnParse(Connection *conn, int index)
+{
+	int rc;
+	Phase phase;
+	Downstream *server = &conn->servers[index];
+
+	rc = 0;
+	while (0 < server->pending && 0 < (rc = smtpReplyParse(server))) {
+		syslog(LOG_DEBUG, LOG_FMT "#%d < %s", LOG_ARG, index, server->reply);
+		phase = server->phases[server->phase_first];
+		smtpConnReplyTime(conn, index);
+		if (phase == PHASE_WELCOME && server->code == 220)
+			healthUp(index);
+		else if (phase == PHASE_WELCOME && server->code == 421)
+			(void) healthDown(index);
+		if (200 <= server->code && server->code < 600)
+			STATS_SERVER_ADD(conn, index, replies[server->code / 100 - 2], 1);
+		if (primary_mode && index == 0 && (conn->state == STATE_REPLIES || conn->state == STATE_DOT))
+			smtpConnAnswerAdd(conn, server->reply);
+		if (IS_SHADOW(index)) {
+			smtpConnShadowReply(conn, index, phase);
+			if (server->socket == NULL)
+				return;
+		}
+		if (--server->pending <= 0)
+			break;
+		if (0 < server->out_held && smtpConnUnhold(conn, index)) {
+			smtpConnDisconnect(conn, index);
+			return;
+		}
+	}
+	if (rc < 0) {
+		syslog(LOG_ERR, LOG_FMT "#%d invalid reply from %s", LOG_ARG, index, smtp_host[index]);
+		smtpConnDisconnect(conn, index);
+	}
+}
+
+/*
+ * Parse the buffered replies of the servers still pending. Return
+ * the number of servers yet to reply that the session waits on.
+ */
+static int
+smtpConnPending(Connection *conn)
+{
+	int i, n, waits, connecting, connected;
+	Downstream *server;
+
+	conn->due = 0;
+	connecting = connected = 0;
+	for (n = i = 0; i < nservers; i++) {
+		server = &conn->servers[i];
+		if (server->socket == NULL || !server->pending)
+			continue;
+
+		waits = smtpConnWaits(conn, i);
+		if (server->connecting) {
+			switch (smtpConnConnected(conn, i)) {
+			case 0:
+				connecting += waits;
+				n += waits;
+				continue;
+			case -1:
+				smtpConnDisconnect(conn, i);
+				continue;
+			}
+			/* A shadow may have commands queued already. */
+			if (!waits && smtpConnFlush(conn, i)) {
+				smtpConnDisconnect(conn, i);
+				continue;
+			}
+			/* The welcome may have arrived with the connect. */
+			smtpConnServerRead(conn, i);
+			if (server->socket == NULL)
+				continue;
+			connected += waits;
+		}
+
+		smtpConnParse(conn, i);
+		if (server->socket != NULL && 0 < server->pending && waits) {
+			n++;
+			if (SERVER_DUE(server) != 0 && (conn->due == 0 || SERVER_DUE(server) < conn->due))
+				conn->due = SERVER_DUE(server);
+		}
+	}
+
+	/* All connected, allow the full timeout for the welcomes. */
+	if (0 < connected && connecting == 0)
+		smtpConnSetState(conn, conn->state);
+
+	return n;
+}
+
+/*
+ * Read what the client has sent without blocking. Return the number
+ * of bytes added to the input buffer, zero if nothing is available or
+ * the buffer is full, or -1 on EOF or error.
+ */
+static long
+smtpConnFill(Connection *conn)
+{
+	long length, total;
+
+	if (0 < conn->clientOffset) {
+		conn->clientLength -= conn->clientOffset;
+		memmove(conn->clientBuffer, conn->clientBuffer + conn->clientOffset, conn->clientLength);
+		conn->clientOffset = 0;
+	}
+
+	for (total = 0; conn->clientLength < sizeof (conn->clientBuffer); total += length) {
+		errno = 0;
+		length = socket3_read(
+			conn->client->fd, (unsigned char *) conn->clientBuffer + conn->clientLength,
+			sizeof (conn->clientBuffer) - conn->clientLength, NULL
+		);
+		if (length < 0 && errno == EINTR) {
+			length = 0;
+			continue;
+		}
+		if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (length <= 0) {
+			syslog(LOG_ERR, LOG_FMT "client read error: %s (%d)%c", LOG_ARG, strerror(errno), errno, length == 0 ? '!' : ' ');
+			return -1;
+		}
+		conn->clientLength += length;
+	}
+
+	if (0 < total && STATE_IS_INPUT(conn->state))
+		smtpConnSetState(conn, conn->state);
+	STATS_ADD(conn, client_in, total);
+	journalInput(conn, conn->clientBuffer + conn->clientLength - total, total);
+
+	return total;
+}
+
+/*
+ * Remove the next line from the client input buffer, reading more
+ * input as needed. Like socketReadLine2(), an over long line is split.
+ * Return the line length or -1 if a complete line is not available
+ * yet. On EOF or error the session is closed.
+ */
+static long
+smtpConnReadLine(Connection *conn, char *line, long size, int keep_crlf)
+{
+	char *start, *eol;
+	long length, available;
+
+	for (;;) {
+		start = conn->clientBuffer + conn->clientOffset;
+		available = conn->clientLength - conn->clientOffset;
+
+		if ((eol = memchr(start, '\n', available)) != NULL && eol + 1 - start < size) {
+			length = eol + 1 - start;
+			break;
+		}
+		if (size-1 <= available) {
+			length = size-1;
+			break;
+		}
+
+		switch (smtpConnFill(conn)) {
+		case -1:
+			if (primary_mode && conn->state == STATE_COMMAND) {
+				/* Let the shadows finish what they were sent. */
+				smtpConnPrintAll(conn, "QUIT\r\n", 0);
+				smtpConnSetState(conn, STATE_SHADOWS);
+				return -1;
+			}
+			conn->state = STATE_CLOSE;
+			/*@fallthrough@*/
+		case 0:
+			return -1;
+		}
+	}
+
+	conn->clientOffset += length;
+	memcpy(line, start, length);
+
+	if (!keep_crlf) {
+		if (0 < length && line[length-1] == '\n')
+			length--;
+		if (0 < length && line[length-1] == '\r')
+			length--;
+	}
+	line[length] = '\0';
+
+	return length;
+}
+
+/*
+ * Perform man-in-the-middle AUTH LOGIN dialogue with the client
+ * and convert the AUTH LOGIN into an AUTH PLAIN. The conn->input
+ * buffer will then be forwarded to the SMTP servers.
+ *
+ *	>>> AUTH LOGIN
+ *	334 VXNlcm5hbWU6
+ *	>>> dGVzdA==
+ *	334 UGFzc3dvcmQ6
+ * 	>>> dEVzdDQy
+ *	235 2.0.0 OK Authenticated
+ */
+static void
+authLogin(Connection *conn)
+{
+	char *arg = conn->input+sizeof ("AUTH LOGIN")-1;
+
+	if (*arg == ' ') {
+		/* Initial response with the user name. */
+		(void) TextCopy(conn->login, sizeof (conn->login), arg+1);
+		conn->login[strcspn(conn->login, "\r\n")] = '\0';
+		smtpConnPrint(conn, -1, "334 UGFzc3dvcmQ6\r\n");
+		smtpConnSetState(conn, STATE_AUTH_PASS);
+	} else {
+		smtpConnPrint(conn, -1, "334 VXNlcm5hbWU6\r\n");
+		smtpConnSetState(conn, STATE_AUTH_USER);
+	}
+}
+
+static void
+authLoginUser(Connection *conn)
+{
+	if (smtpConnReadLine(conn, conn->login, sizeof (conn->login), 0) < 0)
+		return;
+
+	syslog(LOG_DEBUG, LOG_FMT "> %s", LOG_ARG, conn->login);
+
+	smtpConnPrint(conn, -1, "334 UGFzc3dvcmQ6\r\n");
+	smtpConnSetState(conn, STATE_AUTH_PASS);
+}
+
+/*
+ * Convert the AUTH LOGIN user name and password into an AUTH PLAIN
+ * command in conn->input.
+ */
+static int
+authLoginPlain(Connection *conn, char *passB64)
+{
+	int rx;
+	int rc = -1;
+	Base64 base64;
+	long userLen, passLen;
+	char *buffer;
+
+	if ((base64 = Base64Create()) == NULL) {
 		syslog(LOG_ERR, LOG_FMT "Base64Create() error", LOG_ARG);
 		goto error0;
 	}
 
-	buffer = NULL;
-	switch ((rx = base64->decodeBuffer(base64, userB64, userLen, &buffer, &userLen))) {
-	case BASE64_NEXT:
-	case BASE64_ERROR:
-		syslog(LOG_ERR, LOG_FMT "login Base64DecodeBuffer error rc=%d", LOG_ARG, rx);
-		goto error1;
+	buffer = NULL;
+	switch ((rx = base64->decodeBuffer(base64, conn->login, strlen(conn->login), &buffer, &userLen))) {
+	case BASE64_NEXT:
+	case BASE64_ERROR:
+		syslog(LOG_ERR, LOG_FMT "login Base64DecodeBuffer error rc=%d", LOG_ARG, rx);
+		goto error1;
+	}
+	if (255 < userLen) {
+		syslog(LOG_ERR, LOG_FMT "login too long, length=%ld", LOG_ARG, userLen);
+		goto error2;
+	}
+
+	/* Start building the PLAIN authentication details, RFC 2595:
+	 *
+	 *	[authorize-id] \0 authenticate-id \0 password
+	 */
+	memcpy(conn->input, buffer, userLen);
+	conn->input[userLen] = '\0';
+	memcpy(conn->input+userLen+1, buffer, userLen);
+	conn->input[userLen+1+userLen] = '\0';
+	free(buffer);
+
+	buffer = NULL;
+	base64->reset(base64);
+	switch ((rx = base64->decodeBuffer(base64, passB64, strlen(passB64), &buffer, &passLen))) {
+	case BASE64_NEXT:
+	case BASE64_ERROR:
+		syslog(LOG_ERR, LOG_FMT "password Base64DecodeBuffer error rc=%d", LOG_ARG, rx);
+		goto error1;
+	}
+	if (255 < passLen) {
+		syslog(LOG_ERR, LOG_FMT "password too long, length=%ld", LOG_ARG, passLen);
+		goto error2;
+	}
+
+	memcpy(conn->input+userLen+1+userLen+1, buffer, passLen);
+	conn->input[userLen+1+userLen+1+passLen] = '\0';
+	free(buffer);
+
+	base64->reset(base64);
+	if ((rx = base64->encodeBuffer(base64, conn->input, userLen+1+userLen+1+passLen, &buffer, &conn->inputLength, 1)) != 0) {
+		syslog(LOG_ERR, LOG_FMT "plain Base64EncodeBuffer error rc=%d", LOG_ARG, rx);
+		goto error1;
+	}
+	if (sizeof (conn->input) < conn->inputLength+sizeof ("AUTH PLAIN \r\n")) {
+		syslog(LOG_ERR, LOG_FMT "AUTH PLAIN conversion too long, length=%ld", LOG_ARG, conn->inputLength);
+		goto error2;
+	}
+
+	syslog(LOG_DEBUG, LOG_FMT "login=%s pass=%s", LOG_ARG, conn->input, conn->input+userLen+1+userLen+1);
+
+	(void) TextCopy(conn->input, sizeof (conn->input), "AUTH PLAIN ");
+	memcpy(conn->input+sizeof("AUTH PLAIN ")-1, buffer, conn->inputLength);
+	conn->inputLength += sizeof("AUTH PLAIN ")-1;
+	conn->input[conn->inputLength++] = '\r';
+	conn->input[conn->inputLength++] = '\n';
+	conn->input[conn->inputLength] = '\0';
+
+	syslog(LOG_DEBUG, LOG_FMT "plain=%s", LOG_ARG, conn->input);
+
+	rc = 0;
+error2:
+	free(buffer);
+error1:
+	Base64Destroy(base64);
+error0:
+	return rc;
+}
+
+static void smtpConnDataStart(Connection *conn);
+
+/*
+ * Write a block of message content to every connected server, or
+ * to the spool.
+ */
+static void
+smtpConnWriteAll(Connection *conn, const char *data, long length)
+{
+	int i;
+
+	if (spool_dir != NULL) {
+		(void) spoolWrite(conn, data, length);
+		return;
+	}
+
+	for (i = 0; i < nservers; i++) {
+		if (conn->servers[i].socket != NULL && smtpConnQueue(conn, i, data, length) < 0)
+			smtpConnDisconnect(conn, i);
+	}
+}
+
+/*
+ * In spool mode answer the client here, keeping what is needed to
+ * replay the message later.
+ */
+static void
+spoolRelay(Connection *conn)
+{
+	char **save;
+
+	if (0 < TextInsensitiveStartsWith(conn->input, "QUIT")) {
+		spoolAbort(conn);
+		smtpConnPrint(conn, -1, "221 closing connection\r\n");
+		conn->state = STATE_CLOSE;
+		return;
+	}
+
+	save = NULL;
+	if (0 < TextInsensitiveStartsWith(conn->input, "HELO") || 0 < TextInsensitiveStartsWith(conn->input, "EHLO")) {
+		free(conn->auth);
+		conn->auth = NULL;
+		save = &conn->helo;
+	} else if (0 < TextInsensitiveStartsWith(conn->input, "AUTH")) {
+		save = &conn->auth;
+	}
+	if (save != NULL) {
+		spoolAbort(conn);
+		free(*save);
+		if ((*save = strdup(conn->input)) == NULL) {
+			smtpConnPrint(conn, -1, reply_421);
+			conn->state = STATE_CLOSE;
+			return;
+		}
+	}
+
+	else if (0 < TextInsensitiveStartsWith(conn->input, "RSET")) {
+		spoolAbort(conn);
+	}
+
+	else if (0 < TextInsensitiveStartsWith(conn->input, "MAIL FROM:")) {
+		if (spoolOpen(conn) || spoolWrite(conn, conn->input, conn->inputLength)) {
+			spoolAbort(conn);
+			smtpConnPrint(conn, -1, "451 spool error\r\n");
+			return;
+		}
+	}
+
+	else if (0 < TextInsensitiveStartsWith(conn->input, "RCPT TO:")) {
+		if (conn->spool.fd < 0) {
+			smtpConnPrint(conn, -1, "503 need MAIL first\r\n");
+			return;
+		}
+		(void) spoolWrite(conn, conn->input, conn->inputLength);
+		conn->spool.rcpts++;
+	}
+
+	else if (0 < TextInsensitiveStartsWith(conn->input, "DATA")) {
+		if (conn->spool.fd < 0 || conn->spool.rcpts <= 0) {
+			smtpConnPrint(conn, -1, "503 need RCPT first\r\n");
+			return;
+		}
+		(void) spoolWrite(conn, conn->input, conn->inputLength);
+		smtpConnDataStart(conn);
+		return;
+	}
+
+	smtpConnPrint(conn, -1, conn->isEhlo ? ehlo_reply : "250 OK\r\n");
+}
+
+static int smtpConnOpen(Connection *conn);
+
+/*
+ * With -L answer the client here until it sends a command that needs
+ * the servers, most often MAIL; many clients never do.  Then connect,
+ * or take connections from the pool, and hold the command until the
+ * servers have been greeted with the client's HELO or EHLO.
+ */
+static void
+smtpConnLazy(Connection *conn)
+{
+	char *helo;
+
+	smtpConnSetState(conn, STATE_COMMAND);
+
+	if (0 < TextInsensitiveStartsWith(conn->input, "QUIT")) {
+		smtpConnPrint(conn, -1, "221 closing connection\r\n");
+		conn->state = STATE_CLOSE;
+		return;
+	}
+
+	if (0 < TextInsensitiveStartsWith(conn->input, "HELO") || 0 < TextInsensitiveStartsWith(conn->input, "EHLO")) {
+		if ((helo = strdup(conn->input)) == NULL) {
+			smtpConnPrint(conn, -1, reply_421);
+			conn->state = STATE_CLOSE;
+			return;
+		}
+		free(conn->helo);
+		conn->helo = helo;
+		smtpConnPrint(conn, -1, conn->isEhlo ? ehlo_reply : "250 OK\r\n");
+		return;
+	}
+
+	if (0 < TextInsensitiveStartsWith(conn->input, "RSET") || 0 < TextInsensitiveStartsWith(conn->input, "NOOP")) {
+		smtpConnPrint(conn, -1, "250 OK\r\n");
+		return;
+	}
+
+	syslog(LOG_DEBUG, LOG_FMT "connecting to SMTP servers", LOG_ARG);
+	conn->lazy = 0;
+	conn->replay = 1;
+	if (smtpConnOpen(conn))
+		conn->state = STATE_CLOSE;
+}
+
+/*
+ * RFC 2920 lets a client send MAIL, RCPT, and RSET without waiting
+ * for their replies, up to a final command like DATA.  True when the
+ * command just relayed is one of those and the client has already
+ * sent a next command that we relay as is, so that it joins the group.
+ */
+static int
+smtpConnPipelined(Connection *conn)
+{
+	long length;
+	const char **verb;
+	char next[16], *start;
+	static const char *relayed[] = {
+		"MAIL FROM:", "RCPT TO:", "RSET", "DATA", "NOOP",
+		"HELO", "EHLO", "VRFY", "EXPN", "HELP", NULL
+	};
+
+	if (PIPELINE_MAX <= conn->batch)
+		return 0;
+
+	if (TextInsensitiveStartsWith(conn->input, "MAIL FROM:") <= 0
+	&& TextInsensitiveStartsWith(conn->input, "RCPT TO:") <= 0
+	&& TextInsensitiveStartsWith(conn->input, "RSET") <= 0)
+		return 0;
+
+	start = conn->clientBuffer + conn->clientOffset;
+	length = conn->clientLength - conn->clientOffset;
+	if (memchr(start, '\n', length) == NULL)
+		return 0;
+
+	if (sizeof (next) <= length)
+		length = sizeof (next)-1;
+	memcpy(next, start, length);
+	next[length] = '\0';
+
+	for (verb = relayed; *verb != NULL; verb++) {
+		if (0 < TextInsensitiveStartsWith(next, *verb))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * End a group of commands: send them to each server in one write and
+ * wait on all the replies together.
+ */
+static void
+smtpConnBatchEnd(Connection *conn)
+{
+	int i;
+
+	smtpConnSetState(conn, STATE_REPLIES);
+
+	for (i = 0; i < nservers; i++) {
+		if (smtpConnFlush(conn, i))
+			smtpConnDisconnect(conn, i);
+	}
+}
+
+/*
+ * Answer the client's last command, or pipelined group of commands,
+ * in one write.  We can't report N different replies, so the commands
+ * ahead of the last in a group get 250 as they always have.  With -P
+ * the client gets the primary's replies instead, if there are any.
+ */
+static void
+smtpConnAnswer(Connection *conn, const char *reply)
+{
+	long length;
+	char buffer[PIPELINE_MAX * 8 + SMTP_TEXT_LINE_LENGTH];
+
+	if (0 < conn->answer_length) {
+		smtpConnPrint(conn, -1, conn->answer);
+		conn->answer_length = 0;
+		conn->batch = 0;
+		return;
+	}
+
+	for (length = 0; 1 < conn->batch; conn->batch--) {
+		memcpy(buffer + length, "250 OK\r\n", 8);
+		length += 8;
+	}
+	conn->batch = 0;
+	(void) snprintf(buffer + length, sizeof (buffer) - length, "%s", reply);
+
+	smtpConnPrint(conn, -1, buffer);
+}
+
+static void
+smtpConnRelay(Connection *conn)
+{
+	if (spool_dir != NULL) {
+		/* Back to commands, unless DATA or QUIT say otherwise. */
+		smtpConnSetState(conn, STATE_COMMAND);
+		spoolRelay(conn);
+		return;
+	}
+
+	if (conn->lazy) {
+		smtpConnLazy(conn);
+		return;
+	}
+
+	/* We don't wait for SMTP server responses to QUIT
+	 * since some SMTP servers just drop the connection
+	 * and so no point in waiting for the 221 reply.
+	 */
+	if (0 < TextInsensitiveStartsWith(conn->input, "QUIT")) {
+		if (0 < pool_max_idle) {
+			/* Reset the connections instead and return them
+			 * to the pool once they confirm.
+			 */
+			smtpConnPrintAll(conn, "RSET\r\n", 1);
+			smtpConnPrint(conn, -1, "221 closing connection\r\n");
+			smtpConnSetState(conn, STATE_RESET);
+			return;
+		}
+		smtpConnPrintAll(conn, conn->input, 0);
+		smtpConnPrint(conn, -1, "221 closing connection\r\n");
+		if (primary_mode) {
+			/* Let the shadows finish what they were sent. */
+			smtpConnSetState(conn, STATE_SHADOWS);
+			return;
+		}
+		conn->state = STATE_CLOSE;
+		return;
+	}
+
+	conn->batch++;
+	smtpConnPrintAll(conn, conn->input, 1);
+
+	if (smtpConnPipelined(conn))
+		return;
+
+	smtpConnBatchEnd(conn);
+}
+
+/*
+ * The servers woken by -L have been greeted; relay the command that
+ * woke them as if it had just been read.
+ */
+static void
+smtpConnWoken(Connection *conn)
+{
+	conn->replay = 0;
+	conn->isEhlo = 0;
+	conn->answer_length = 0;
+	smtpConnSetState(conn, STATE_COMMAND);
+
+	if (0 < TextInsensitiveStartsWith(conn->input, "MAIL FROM:"))
+		smtpConnSampleMessage(conn);
+
+	smtpConnRelay(conn);
+}
+
+static void
+authLoginPass(Connection *conn)
+{
+	char passB64[512];
+
+	if (smtpConnReadLine(conn, passB64, sizeof (passB64), 0) < 0)
+		return;
+
+	syslog(LOG_DEBUG, LOG_FMT "> %s", LOG_ARG, passB64);
+
+	if (authLoginPlain(conn, passB64)) {
+		conn->state = STATE_CLOSE;
+		return;
+	}
+
+	conn->isEhlo = 0;
+	smtpConnRelay(conn);
+}
+
+/*
+ * Our Return-Path and Received header for the start of the message.
+ */
+static void
+smtpConnReceived(Connection *conn, char *line, size_t size)
+{
+	time_t now;
+	struct tm local;
+	char stamp[40];
+
+	now = time(NULL);
+	(void) localtime_r(&now, &local);
+	(void) getRFC2821DateTime(&local, stamp, sizeof (stamp));
+	/* Note that conn->id is a session ID and does not
+	 * change (yet) with each MAIL transaction.
+	 */
+	(void) snprintf(
+		line, size,
+		"Return-Path: <%s>\r\nReceived: from %s ([%s]) id %s; %s\r\n",
+		conn->mail == NULL ? "" : conn->mail->address.string, conn->client_name, conn->client_addr, conn->id, stamp
+	);
+	if (1 < debug) {
+		syslog(LOG_DEBUG, LOG_FMT "> %s", LOG_ARG, line);
+	}
+}
+
+static void
+smtpConnDataStart(Connection *conn)
+{
+	char line[SMTP_TEXT_LINE_LENGTH];
+
+	smtpConnAnswer(conn, "354 enter mail, end with \".\" on a line by itself\r\n");
+
+	/* Add our Return-Path and Received header. */
+	smtpConnReceived(conn, line, sizeof (line));
+	smtpConnPrintAll(conn, line, 0);
+
+	conn->isEOH = 0;
+	smtpConnSetState(conn, STATE_DATA);
+}
+
+/*
+ * Relay client's message to each SMTP server, one line at a time.
+ * Return 0 if a line was relayed or -1 if waiting on more input.
+ */
+static int
+smtpConnData(Connection *conn)
+{
+	long length;
+	int isDot;
+
+	/* Read the next line trimming the CRLF. */
+	if ((length = smtpConnReadLine(conn, conn->input, sizeof (conn->input)-2, 0)) < 0)
+		return -1;
+
+	if (!conn->isEOH && 0 < TextInsensitiveStartsWith(conn->input, "Return-Path:")) {
+		/* We supply our Return-Path based on MAIL FROM: */
+		return 0;
+	}
+
+	isDot = conn->input[0] == '.' && conn->input[1] == '\0';
+	if (!conn->isEOH && length == 0) {
+		/* First blank line is EOH. */
+		conn->isEOH = 1;
+		if (0 < debug && debug < 3) {
+			syslog(LOG_DEBUG, LOG_FMT "message content not logged", LOG_ARG);
+		}
+	}
+
+	/* -v log dot, -vv log only headers, -vvv log everything. */
+	if (2 < debug || (1 < debug && !conn->isEOH) || (0 < debug && isDot)) {
+		syslog(LOG_DEBUG, LOG_FMT "> %s", LOG_ARG, conn->input);
+	}
+
+	/* Add back the CRLF removed by smtpConnReadLine(). */
+	conn->input[length++] = '\r';
+	conn->input[length++] = '\n';
+	conn->input[length] = '\0';
+
+	/* Get and ignore the responses to the dot leaving the
+	 * connections open for further MAIL.  Tell the client
+	 * success, since we can't report N differnet SMTP
+	 * replies to the client.
+	 */
+	smtpConnPrintAll(conn, conn->input, isDot);
+	if (isDot)
+		STATS_ADD(conn, messages, 1);
+	if (isDot && spool_dir != NULL) {
+		/* Accept once the message is safely on disk. */
+		smtpConnPrint(conn, -1, spoolCommit(conn) ? "451 spool error\r\n" : "250 OK\r\n");
+		smtpConnSetState(conn, STATE_COMMAND);
+	} else if (isDot) {
+		smtpConnSetState(conn, STATE_DOT);
+	}
+
+	return 0;
+}
+
+/*
+ * Relay the message content in blocks.  The complete CRLF terminated
+ * lines buffered from the client are sent as they are in one write per
+ * server.  Our Return-Path replacing the client's, the end of headers,
+ * the end of data dot, lines ending with a bare LF, long and partial
+ * lines, and -vv or -vvv logging are left to smtpConnData() one line
+ * at a time.  Return 0 when something was relayed, -1 while waiting
+ * on more input.
+ */
+static int
+smtpConnDataBlock(Connection *conn)
+{
+	Scanner scan;
+	char *start;
+
+	if (2 < debug || (1 < debug && !conn->isEOH))
+		return smtpConnData(conn);
+
+	start = conn->clientBuffer + conn->clientOffset;
+
+	/* Long lines are split by smtpConnData(). */
+	scanInit(&scan, conn->isEOH ? NULL : "Return-Path:", sizeof (conn->input)-2);
+	(void) scanNext(&scan, start, conn->clientLength - conn->clientOffset);
+
+	if (scan.line <= 0)
+		return smtpConnData(conn);
+
+	smtpConnWriteAll(conn, start, scan.line);
+	conn->clientOffset += scan.line;
+
+	return 0;
+}
+
+#ifdef HAVE_SPLICE
+static void
+smtpConnPipesClose(Connection *conn)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (0 <= conn->pipes[i])
+			(void) close(conn->pipes[i]);
+		conn->pipes[i] = -1;
+	}
+}
+
+/*
+ * Move what remains in a pipe, after a server took only part of it,
+ * to the server's output queue.  The bytes are those peeked into the
+ * client buffer, so the pipe only needs emptying.
+ */
+static void
+smtpConnPipeDrain(Connection *conn, int index, int fd, long sent, long length)
+{
+	char discard[512];
+
+	while (0 < read(fd, discard, sizeof (discard)))
+		;
+	if (conn->servers[index].socket != NULL && smtpConnQueue(conn, index, conn->clientBuffer + sent, length - sent) < 0)
+		smtpConnDisconnect(conn, index);
+}
+
+/*
+ * Return the last connected server when the client's input can be
+ * spliced to all the servers, otherwise -1.  TLS, spool mode, -vvv, a
+ * server still connecting or with queued output, and a BDAT chunk that
+ * some server gets as DATA use the copying path.
+ */
+static int
+smtpConnSpliceable(Connection *conn)
+{
+	int i, last;
+
+	if (2 < debug || spool_dir != NULL || socket3_is_tls(conn->client->fd))
+		return -1;
+
+	for (last = -1, i = 0; i < nservers; i++) {
+		if (conn->servers[i].socket == NULL)
+			continue;
+		if (conn->servers[i].connecting || 0 < conn->servers[i].out_length)
+			return -1;
+		if (conn->state == STATE_BDAT && conn->servers[i].chunk != CHUNK_BDAT)
+			return -1;
+		last = i;
+	}
+
+	return last;
+}
+
+/*
+ * Move the next length bytes of client input, already peeked into the
+ * start of the client buffer, to a pipe with splice(), copy them in the
+ * kernel to a second pipe with tee() for each extra server, and splice
+ * from there to each server.  Anything a server does not take now goes
+ * to its output queue as usual.  Return the number of bytes moved, or
+ * zero or -1 when nothing was and the copying path should be used.
+ */
+static long
+smtpConnSpliceAll(Connection *conn, int last, long length)
+{
+	int i, *pipes = conn->pipes;
+	long moved, sent;
+
+	if (pipes[0] < 0 && (pipe2(pipes, O_NONBLOCK) || pipe2(pipes+2, O_NONBLOCK))) {
+		syslog(LOG_ERR, LOG_FMT "pipe error: %s (%d)", LOG_ARG, strerror(errno), errno);
+		smtpConnPipesClose(conn);
+		return -1;
+	}
+
+	if ((moved = splice(conn->client->fd, NULL, pipes[1], NULL, length, SPLICE_F_MOVE|SPLICE_F_NONBLOCK)) <= 0)
+		return moved;
+
+	/* Refresh the client idle deadline as smtpConnFill() does. */
+	smtpConnSetState(conn, conn->state);
+	STATS_ADD(conn, client_in, moved);
+	journalInput(conn, conn->clientBuffer, moved);
+
+	for (i = 0; i <= last; i++) {
+		if (conn->servers[i].socket == NULL)
+			continue;
+
+		if (i < last) {
+			if (tee(pipes[0], pipes[3], moved, SPLICE_F_NONBLOCK) != moved) {
+				/* Should not happen with an empty pipe. */
+				smtpConnPipeDrain(conn, i, pipes[2], 0, moved);
+				continue;
+			}
+			sent = splice(pipes[2], NULL, conn->servers[i].socket->fd, NULL, moved, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+			STATS_SERVER_ADD(conn, i, bytes_out, sent < 0 ? 0 : sent);
+			if (sent < moved)
+				smtpConnPipeDrain(conn, i, pipes[2], sent < 0 ? 0 : sent, moved);
+		} else {
+			sent = splice(pipes[0], NULL, conn->servers[i].socket->fd, NULL, moved, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+			STATS_SERVER_ADD(conn, i, bytes_out, sent < 0 ? 0 : sent);
+			if (sent < moved)
+				smtpConnPipeDrain(conn, i, pipes[0], sent < 0 ? 0 : sent, moved);
+		}
+	}
+
+	/* No servers left, discard. */
+	if (conn->servers[last].socket == NULL)
+		while (0 < read(pipes[0], conn->clientBuffer, sizeof (conn->clientBuffer)))
+			;
+
+	return moved;
+}
+
+/*
+ * Plain text message body fast path for Linux.  Complete lines are
+ * found by peeking at the client's socket, then spliced to the servers
+ * by smtpConnSpliceAll(), so the body is only peeked at for the end of
+ * data and never written from user space.  Otherwise use the copying
+ * path.  Return 0 when something was relayed, -1 while waiting on more
+ * input.
+ */
+static int
+smtpConnDataSplice(Connection *conn)
+{
+	Scanner scan;
+	int last;
+	char *line, *eol, *end;
+	long length;
+
+	if (!conn->isEOH || (last = smtpConnSpliceable(conn)) < 0)
+		return smtpConnDataBlock(conn);
+
+	if (conn->clientOffset < conn->clientLength) {
+		/* Complete a partial line left in the client buffer by
+		 * reading no further than its end, so that once the
+		 * buffer is relayed the rest can be spliced.
+		 */
+		line = conn->clientBuffer + conn->clientOffset;
+		length = conn->clientLength - conn->clientOffset;
+		if (memchr(line, '\n', length) == NULL) {
+			memmove(conn->clientBuffer, line, length);
+			conn->clientOffset = 0;
+			conn->clientLength = length;
+			end = conn->clientBuffer + length;
+			if (0 < (length = recv(conn->client->fd, end, sizeof (conn->clientBuffer) - conn->clientLength, MSG_PEEK|MSG_DONTWAIT))
+			&& (eol = memchr(end, '\n', length)) != NULL
+			&& 0 < (length = recv(conn->client->fd, end, eol+1 - end, MSG_DONTWAIT))) {
+				conn->clientLength += length;
+				smtpConnSetState(conn, conn->state);
+				STATS_ADD(conn, client_in, length);
+				journalInput(conn, end, length);
+			}
+		}
+		return smtpConnDataBlock(conn);
+	}
+
+	/* Find the complete lines available, as smtpConnDataBlock(). */
+	if ((length = recv(conn->client->fd, conn->clientBuffer, sizeof (conn->clientBuffer), MSG_PEEK|MSG_DONTWAIT)) <= 0)
+		return smtpConnDataBlock(conn);
+
+	scanInit(&scan, NULL, sizeof (conn->input)-2);
+	(void) scanNext(&scan, conn->clientBuffer, length);
+	if ((length = scan.line) <= 0)
+		return smtpConnDataBlock(conn);
+
+	if (smtpConnSpliceAll(conn, last, length) <= 0)
+		return smtpConnDataBlock(conn);
+
+	return 0;
+}
+#else
+# define smtpConnDataSplice	smtpConnDataBlock
+#endif
+
+/***********************************************************************
+ *** BDAT
+ ***********************************************************************/
+
+#define CHUNK_CRLF		('\r' << 8 | '\n')
+
+/*
+ * Write chunk content to the servers getting the message one way, or
+ * to the spool.
+ */
+static void
+smtpConnChunkQueue(Connection *conn, int mode, const char *data, long length)
+{
+	int i;
+
+	if (length <= 0)
+		return;
+
+	if (spool_dir != NULL) {
+		(void) spoolWrite(conn, data, length);
+		return;
+	}
+
+	for (i = 0; i < nservers; i++) {
+		if (conn->servers[i].socket != NULL && conn->servers[i].chunk == mode && smtpConnQueue(conn, i, data, length) < 0)
+			smtpConnDisconnect(conn, i);
+	}
+}
+
+/*
+ * Relay chunk content as is to the servers getting BDAT, and with any
+ * line starting with a dot stuffed to those getting DATA.
+ */
+static void
+smtpConnChunkWrite(Connection *conn, const char *data, long length)
+{
+	const char *start, *mark, *eol, *end = data + length;
+
+	if (conn->chunking & CHUNK_BDAT)
+		smtpConnChunkQueue(conn, CHUNK_BDAT, data, length);
+	if (!(conn->chunking & CHUNK_DATA))
+		return;
+
+	for (mark = start = data; start < end; start = eol) {
+		if ((conn->chunk_tail & 0xff) == '\n' && *start == '.') {
+			smtpConnChunkQueue(conn, CHUNK_DATA, mark, start - mark);
+			smtpConnChunkQueue(conn, CHUNK_DATA, ".", 1);
+			mark = start;
+		}
+		eol = memchr(start, '\n', end - start);
+		eol = eol == NULL ? end : eol+1;
+		if (2 <= eol - start)
+			conn->chunk_tail = (unsigned char) eol[-2] << 8 | (unsigned char) eol[-1];
+		else
+			conn->chunk_tail = (conn->chunk_tail << 8 | (unsigned char) eol[-1]) & 0xffff;
+	}
+	smtpConnChunkQueue(conn, CHUNK_DATA, mark, end - mark);
+}
+
+/*
+ * Send the servers getting BDAT the chunk's command, then read the
+ * chunk.  The first chunk of a message is preceded by our Return-Path
+ * and Received header, counted in the chunk size for BDAT.
+ */
+static void
+smtpConnChunkBegin(Connection *conn, int first)
+{
+	int i;
+	long extra;
+	char line[SMTP_TEXT_LINE_LENGTH], command[48];
+
+	extra = 0;
+	if (first) {
+		smtpConnReceived(conn, line, sizeof (line));
+		extra = strlen(line);
+	}
+
+	for (i = 0; i < nservers; i++) {
+		if (conn->servers[i].socket == NULL)
+			continue;
+
+		if (conn->servers[i].chunk == CHUNK_BDAT) {
+			(void) snprintf(command, sizeof (command), "BDAT %ld%s\r\n", conn->chunk_length + extra, conn->chunk_last ? " LAST" : "");
+			if (smtpConnPrint(conn, i, command) < 0 || (0 < extra && smtpConnQueue(conn, i, line, extra) < 0)) {
+				smtpConnDisconnect(conn, i);
+				continue;
+			}
+			smtpConnExpect(conn, i, conn->chunk_last ? PHASE_DOT : PHASE_NONE);
+		} else if (conn->servers[i].chunk == CHUNK_DATA && 0 < extra) {
+			if (smtpConnQueue(conn, i, line, extra) < 0)
+				smtpConnDisconnect(conn, i);
+		}
+	}
+
+	smtpConnSetState(conn, STATE_BDAT);
+}
+
+/*
+ * The whole chunk has been relayed.  Wait on the BDAT replies, and
+ * after the last chunk those to the end of the converted DATA.
+ */
+static void
+smtpConnChunkEnd(Connection *conn)
+{
+	int i;
+	const char *reply;
+
+	if (conn->chunk_last && (conn->chunking & CHUNK_DATA)) {
+		if (conn->chunk_tail == CHUNK_CRLF)
+			smtpConnChunkQueue(conn, CHUNK_DATA, ".\r\n", 3);
+		else
+			smtpConnChunkQueue(conn, CHUNK_DATA, "\r\n.\r\n", 5);
+		for (i = 0; i < nservers; i++) {
+			if (conn->servers[i].socket != NULL && conn->servers[i].chunk == CHUNK_DATA)
+				smtpConnExpect(conn, i, PHASE_DOT);
+		}
+	}
+	if (conn->chunk_last) {
+		STATS_ADD(conn, messages, 1);
+		conn->chunking = 0;
+	}
+
+	if (spool_dir != NULL || conn->chunk_error != NULL) {
+		/* Accept once the message is safely on disk. */
+		if ((reply = conn->chunk_error) == NULL)
+			reply = conn->chunk_last && spoolCommit(conn) ? "451 spool error\r\n" : "250 OK\r\n";
+		conn->chunk_error = NULL;
+		smtpConnPrint(conn, -1, reply);
+		smtpConnSetState(conn, STATE_COMMAND);
+		return;
+	}
+
+	smtpConnSetState(conn, STATE_DOT);
+}
+
+/*
+ * Relay a BDAT chunk to each server as an opaque run of bytes, without
+ * looking for lines, except to dot stuff those going to DATA.  Return
+ * 0 when something was relayed, -1 while waiting on more input.
+ */
+static int
+smtpConnChunk(Connection *conn)
+{
+	long length;
+#ifdef HAVE_SPLICE
+	int last;
+#endif
+
+	if (0 < conn->chunk_length) {
+		if (conn->clientLength <= conn->clientOffset) {
+#ifdef HAVE_SPLICE
+			/* Nothing buffered, so splice the chunk when every
+			 * server gets BDAT; see smtpConnDataSplice().
+			 */
+			if (0 <= (last = smtpConnSpliceable(conn))
+			&& 0 < (length = recv(conn->client->fd, conn->clientBuffer, conn->chunk_length < sizeof (conn->clientBuffer) ? conn->chunk_length : sizeof (conn->clientBuffer), MSG_PEEK|MSG_DONTWAIT))
+			&& 0 < (length = smtpConnSpliceAll(conn, last, length))) {
+				conn->chunk_length -= length;
+				return 0;
+			}
+#endif
+			switch (smtpConnFill(conn)) {
+			case -1:
+				conn->state = STATE_CLOSE;
+				/*@fallthrough@*/
+			case 0:
+				return -1;
+			}
+		}
+
+		length = conn->clientLength - conn->clientOffset;
+		if (conn->chunk_length < length)
+			length = conn->chunk_length;
+
+		smtpConnChunkWrite(conn, conn->clientBuffer + conn->clientOffset, length);
+		conn->clientOffset += length;
+		conn->chunk_length -= length;
+
+		if (0 < conn->chunk_length)
+			return 0;
+	}
+
+	smtpConnChunkEnd(conn);
+
+	return 0;
+}
+
+/*
+ * A command other than BDAT ends a BDAT message early.  Those servers
+ * converting to DATA can only abandon it by disconnecting.
+ */
+static void
+smtpConnChunkAbort(Connection *conn)
+{
+	int i;
+
+	if (spool_dir != NULL) {
+		spoolAbort(conn);
+	} else {
+		for (i = 0; i < nservers; i++) {
+			if (conn->servers[i].socket != NULL && conn->servers[i].chunk == CHUNK_DATA) {
+				syslog(LOG_ERR, LOG_FMT "#%d BDAT message abandoned, dropping %s", LOG_ARG, i, smtp_host[i]);
+				smtpConnDisconnect(conn, i);
+			}
+		}
+	}
+
+	conn->chunking = 0;
+}
+
+/*
+ * RFC 3030 BDAT chunk-size [LAST].  The first chunk of a message picks
+ * how each server gets it: BDAT when it offers CHUNKING, else DATA,
+ * which has to be accepted with 354 before the chunk is relayed.
+ */
+static void
+smtpConnBdat(Connection *conn)
+{
+	int i;
+	long size;
+	char *stop, line[SMTP_TEXT_LINE_LENGTH];
+
+	if (conn->input[4] != ' ' || !isdigit((unsigned char) conn->input[5])) {
+		smtpConnPrint(conn, -1, "501 syntax error\r\n");
+		return;
+	}
+	size = strtol(conn->input+5, &stop, 10);
+	stop += strspn(stop, " ");
+	if ((conn->chunk_last = 0 < TextInsensitiveStartsWith(stop, "LAST")))
+		stop += sizeof ("LAST")-1;
+	if (*stop != '\r' && *stop != '\n') {
+		smtpConnPrint(conn, -1, "501 syntax error\r\n");
+		return;
+	}
+
+	conn->chunk_length = size;
+
+	if (spool_dir != NULL) {
+		if (!conn->chunking) {
+			if (conn->spool.fd < 0 || conn->spool.rcpts <= 0) {
+				/* Discard the chunk, then reply. */
+				conn->chunk_error = "503 need RCPT first\r\n";
+			} else {
+				smtpConnReceived(conn, line, sizeof (line));
+				(void) spoolWrite(conn, "DATA\r\n", 6);
+				(void) spoolWrite(conn, line, strlen(line));
+				conn->chunking = CHUNK_DATA;
+				conn->chunk_tail = CHUNK_CRLF;
+			}
+		}
+		smtpConnSetState(conn, STATE_BDAT);
+		return;
+	}
+
+	if (conn->lazy) {
+		/* No MAIL yet, so no server has been woken to take it. */
+		conn->chunk_error = "503 need MAIL first\r\n";
+		smtpConnSetState(conn, STATE_BDAT);
+		return;
+	}
+
+	if (conn->chunking) {
+		smtpConnChunkBegin(conn, 0);
+		return;
+	}
+
+	for (i = 0; i < nservers; i++) {
+		if (conn->servers[i].socket == NULL)
+			continue;
+
+		if (conn->servers[i].caps & CAP_CHUNKING) {
+			conn->servers[i].chunk = CHUNK_BDAT;
+		} else {
+			conn->servers[i].chunk = CHUNK_DATA;
+			if (smtpConnPrint(conn, i, "DATA\r\n") < 0) {
+				smtpConnDisconnect(conn, i);
+				continue;
+			}
+			smtpConnExpect(conn, i, PHASE_DATA);
+		}
+		conn->chunking |= conn->servers[i].chunk;
+	}
+	conn->chunk_tail = CHUNK_CRLF;
+
+	if (conn->chunking & CHUNK_DATA) {
+		smtpConnSetState(conn, STATE_BDAT_DATA);
+		return;
+	}
+
+	smtpConnChunkBegin(conn, 1);
+}
+
+static void
+smtpConnCommand(Connection *conn)
+{
+	if ((conn->inputLength = smtpConnReadLine(conn, conn->input, sizeof (conn->input), 1)) < 0) {
+		/* A group ended without its final command. */
+		if (conn->state == STATE_COMMAND && 0 < conn->batch)
+			smtpConnBatchEnd(conn);
+		return;
+	}
+
+	syslog(LOG_DEBUG, LOG_FMT "> %s", LOG_ARG, conn->input);
+
+	if (conn->input[0] == '\0') {
+		smtpConnPrint(conn, -1, "500 command unrecognized: \"\"\r\n");
+		return;
+	}
+
+	if (0 < TextInsensitiveStartsWith(conn->input, "BDAT")) {
+		smtpConnBdat(conn);
+		return;
+	}
+
+	if (conn->chunking)
+		smtpConnChunkAbort(conn);
+
+	if (0 < TextInsensitiveStartsWith(conn->input, "STARTTLS")) {
+		if (key_crt_pem == NULL) {
+			(void) smtpConnPrint(conn, -1, "502 command not recognised\r\n");
+			return;
+		}
+
+		if (socket3_is_tls(conn->client->fd)) {
+			(void) smtpConnPrint(conn, -1, "503 TLS already started\r\n");
+			return;
+		}
+
+		syslog(LOG_INFO, "starting TLS...");
+
+		if (socket3_start_tls(conn->client->fd, SOCKET3_SERVER_TLS, socket_timeout)) {
+			syslog(LOG_ERR, log_io, SERVER_FILE_LINENO, strerror(errno), errno);
+			(void) smtpConnPrint(conn, -1, "454 TLS not available\r\n");
+			return;
+		}
+
+		syslog(LOG_INFO, "TLS started");
+
+		/* Discard any plain text pipelined after STARTTLS. */
+		conn->clientOffset = conn->clientLength = 0;
+
+		if (smtpConnPrint(conn, -1, "220 OK\r\n") < 0)
+			conn->state = STATE_CLOSE;
+		return;
+	}
+
+	if (0 < TextInsensitiveStartsWith(conn->input, "AUTH LOGIN")) {
+		authLogin(conn);
+		return;
+	}
+
+	if (0 < TextInsensitiveStartsWith(conn->input, "MAIL FROM:")) {
+		free(conn->mail);
+		conn->mail = NULL;
+		const char *error = parsePath(conn->input, 0, 0, &conn->mail);
+		if (error != NULL) {
+			syslog(LOG_ERROR, "%s", error);
+			return;
+		}
+		smtpConnSampleMessage(conn);
+	} else if (0 < TextInsensitiveStartsWith(conn->input, "RSET")
+	|| 0 < TextInsensitiveStartsWith(conn->input, "QUIT")
+	|| 0 < TextInsensitiveStartsWith(conn->input, "HELO")
+	|| 0 < TextInsensitiveStartsWith(conn->input, "EHLO")) {
+		smtpConnUnpark(conn);
+	}
+
+	conn->isEhlo = 0 < TextInsensitiveStartsWith(conn->input, "EHLO");
+
+	/* Leave room for the CRLF. */
+	if (sizeof (conn->input) <= conn->inputLength+3)
+		conn->inputLength = sizeof (conn->input)-3;
+
+	smtpConnRelay(conn);
+}
+
+/*
+ * All the servers have replied, or timed out, to the last command
+ * relayed; answer the client.
+ */
+static void
+smtpConnReplied(Connection *conn)
+{
+	int i, isData;
+	char *eol;
+
+	switch (conn->state) {
+	case STATE_WELCOME:
+		for (i = 0; i < nservers; i++) {
+			if (conn->servers[i].socket != NULL && !IS_SHADOW(i) && conn->servers[i].code != 220) {
+				syslog(LOG_ERR, LOG_FMT "#%d no welcome from %s", LOG_ARG, i, smtp_host[i]);
+				smtpConnDisconnect(conn, i);
+			}
+		}
+
+		/* With -R, fail over to the next server of the route. */
+		if (route_by != ROUTE_NONE && !connect_all && spool_dir == NULL && !conn->lazy && conn->connected <= 0 && smtpConnRouteNext(conn) == 0) {
+			if (smtpConnOpen(conn))
+				conn->state = STATE_CLOSE;
+			return;
+		}
+
+		if (primary_mode && !conn->lazy && conn->servers[0].socket == NULL) {
+			syslog(LOG_ERR, LOG_FMT "no answer from primary SMTP server", LOG_ARG);
+			smtpConnPrint(conn, -1, reply_421);
+			conn->state = STATE_CLOSE;
+			return;
+		}
+
+		if (spool_dir == NULL && !conn->lazy && (conn->connected <= 0 || (connect_all && conn->connected < nservers))) {
+			syslog(LOG_ERR, LOG_FMT "no answer from %s SMTP server", LOG_ARG, conn->connected <= 0 ? "any" : "every");
+			smtpConnPrint(conn, -1, reply_421);
+			conn->state = STATE_CLOSE;
+			return;
+		}
+
+		if (conn->replay) {
+			/* Woken by -L; greet the servers as the client did
+			 * us, then relay its command.
+			 */
+			if (conn->helo == NULL) {
+				smtpConnWoken(conn);
+				return;
+			}
+			conn->isEhlo = 0 < TextInsensitiveStartsWith(conn->helo, "EHLO");
+			smtpConnPrintAll(conn, conn->helo, 1);
+			smtpConnBatchEnd(conn);
+			return;
+		}
+
+		/* Multiline welcome message can throw off some spam engines. */
+		(void) snprintf(conn->input, sizeof (conn->input), "220-" _DISPLAY " switch yard for mail.\r\n220 Session ID %s.\r\n", conn->id);
+		smtpConnPrint(conn, -1, conn->input);
+		smtpConnSetState(conn, STATE_COMMAND);
+		return;
+
+	case STATE_REPLIES:
+		for (i = 0; i < nservers; i++) {
+			conn->servers[i].xclient = 0;
+			if (IS_SHADOW(i)) {
+				/* Only if its EHLO reply is already in, and
+				 * without waiting on the XCLIENT reply.
+				 */
+				if (conn->isEhlo && conn->servers[i].socket != NULL && (conn->servers[i].caps & CAP_XCLIENT)) {
+					if (smtpConnPrint(conn, i, conn->xclient) < 0)
+						smtpConnDisconnect(conn, i);
+					else
+						smtpConnExpect(conn, i, PHASE_NONE);
+				}
+				continue;
+			}
+			if (conn->isEhlo && conn->servers[i].socket != NULL)
+				conn->servers[i].caps = capabilityGet(i, conn->servers[i].reply);
+			if (conn->isEhlo && conn->servers[i].socket != NULL && (conn->servers[i].caps & CAP_XCLIENT)) {
+				/* Send XCLIENT ADDR= NAME=, ignore response since its a Postfix thing. */
+				syslog(LOG_DEBUG, LOG_FMT "#%d > %s", LOG_ARG, i, conn->xclient);
+				if (smtpConnPrint(conn, i, conn->xclient) < 0) {
+					smtpConnDisconnect(conn, i);
+					continue;
+				}
+				smtpConnExpect(conn, i, PHASE_NONE);
+				conn->servers[i].xclient = 1;
+				conn->state = STATE_XCLIENT;
+			}
+		}
+		if (conn->state == STATE_XCLIENT) {
+			smtpConnSetState(conn, STATE_XCLIENT);
+			return;
+		}
+		break;
+
+	case STATE_XCLIENT:
+		for (i = 0; i < nservers; i++) {
+			/* See reply codes http://www.postfix.org/XCLIENT_README.html */
+			if (conn->servers[i].xclient && conn->servers[i].socket != NULL && conn->servers[i].code == 421) {
+				/* Unable to proceed, disconnecting.  Assume "we don't like them."
+				 * A server's ACL could opt to disconnect immediately rather than
+				 * return a negative code and wait for QUIT.  Postfix is a little
+				 * vague.
+				 */
+				smtpConnPrint(conn, -1, reply_421);
+				conn->state = STATE_CLOSE;
+				return;
+			}
+		}
+		break;
+
+	case STATE_BDAT_DATA:
+		for (i = 0; i < nservers; i++) {
+			if (conn->servers[i].socket != NULL && !IS_SHADOW(i) && conn->servers[i].chunk == CHUNK_DATA && conn->servers[i].code != 354) {
+				/* Discard the content for it. */
+				conn->servers[i].chunk = 0;
+			}
+		}
+		smtpConnChunkBegin(conn, 1);
+		return;
+
+	case STATE_DOT:
+		conn->isEhlo = 0;
+		break;
+
+	case STATE_RESET:
+		for (i = 0; i < nservers; i++) {
+			if (conn->servers[i].socket != NULL && conn->servers[i].code == 250)
+				smtpConnRelease(conn, i);
+		}
+		conn->state = STATE_CLOSE;
+		return;
+
+	case STATE_SHADOWS:
+		conn->state = STATE_CLOSE;
+		return;
+
+	default:
+		return;
 	}
-	if (255 < userLen) {
-		syslog(LOG_ERR, LOG_FMT "login too long, length=%ld", LOG_ARG, userLen);
-		goto error2;
+
+	if (primary_mode && conn->servers[0].socket == NULL) {
+		syslog(LOG_ERR, LOG_FMT "lost primary SMTP server", LOG_ARG);
+		conn->answer_length = 0;
+		smtpConnPrint(conn, -1, reply_421);
+		conn->state = STATE_CLOSE;
+		return;
 	}
 
-	/* Start building the PLAIN authentication details, RFC 2595:
-	 *
-	 *	[authorize-id] \0 authenticate-id \0 password
-	 */
-	memcpy(conn->input, buffer, userLen);
-	conn->input[userLen] = '\0';
-	memcpy(conn->input+userLen+1, buffer, userLen);
-	conn->input[userLen+1+userLen] = '\0';
-	free(buffer);
+	if (conn->replay) {
+		smtpConnWoken(conn);
+		return;
+	}
 
-	buffer = NULL;
-	base64->reset(base64);
-	switch ((rx = base64->decodeBuffer(base64, passB64, passLen, &buffer, &passLen))) {
-	case BASE64_NEXT:
-	case BASE64_ERROR:
-		syslog(LOG_ERR, LOG_FMT "password Base64DecodeBuffer error rc=%d", LOG_ARG, rx);
-		goto error1;
+	if (conn->state == STATE_REPLIES) {
+		for (isData = i = 0; i < nservers; i++) {
+			if (conn->servers[i].socket != NULL && !IS_SHADOW(i) && conn->servers[i].code == 354)
+				isData++;
+		}
+		if (isData) {
+			smtpConnDataStart(conn);
+			return;
+		}
+		if (primary_mode && 0 < TextInsensitiveStartsWith(conn->input, "DATA")) {
+			/* A shadow that took DATA would take the next
+			 * commands as content; end the message.
+			 */
+			for (i = 1; i < nservers; i++) {
+				if (conn->servers[i].socket == NULL)
+					continue;
+				if (smtpConnPrint(conn, i, ".\r\n") < 0)
+					smtpConnDisconnect(conn, i);
+				else
+					smtpConnExpect(conn, i, PHASE_NONE);
+			}
+		}
 	}
-	if (255 < passLen) {
-		syslog(LOG_ERR, LOG_FMT "password too long, length=%ld", LOG_ARG, passLen);
-		goto error2;
+
+	if (conn->connected <= 0) {
+		conn->state = STATE_CLOSE;
+		return;
 	}
 
-	memcpy(conn->input+userLen+1+userLen+1, buffer, passLen);
-	conn->input[userLen+1+userLen+1+passLen] = '\0';
-	free(buffer);
+	if (conn->isEhlo) {
+		/* We have to feed a reasonable EHLO response,
+		 * because some mail clients will abort if
+		 * STARTTLS and AUTH are not supported.  With
+		 * -P it follows the greeting line of the
+		 * primary's reply, unless that is a refusal.
+		 */
+		if (0 < conn->answer_length && strncmp(conn->answer + conn->answer_last, "250", 3) == 0
+		&& (eol = strchr(conn->answer + conn->answer_last, '\n')) != NULL) {
+			conn->answer[conn->answer_last + 3] = '-';
+			conn->answer_length = eol + 1 - conn->answer;
+			smtpConnAnswerAdd(conn, ehlo_reply);
+		}
+		smtpConnAnswer(conn, ehlo_reply);
+	}
 
-	base64->reset(base64);
-	if ((rx = base64->encodeBuffer(base64, conn->input, userLen+1+userLen+1+passLen, &buffer, &conn->inputLength, 1)) != 0) {
-		syslog(LOG_ERR, LOG_FMT "plain Base64EncodeBuffer error rc=%d", LOG_ARG, rx);
-		goto error1;
+	else {
+		smtpConnAnswer(conn, "250 OK\r\n");
 	}
-	if (sizeof (conn->input) < conn->inputLength+3) {
-		syslog(LOG_ERR, LOG_FMT "AUTH PLAIN conversion too long, length=%ld", LOG_ARG, conn->inputLength);
-		goto error2;
+
+	smtpConnSetState(conn, STATE_COMMAND);
+}
+
+/*
+ * Advance the session as far as the buffered input allows, until it
+ * has to wait on the client or the servers. This is the common core
+ * of both the thread per session and event loop engines.
+ */
+static void
+smtpConnRun(Connection *conn)
+{
+	SessionState previous;
+
+	do {
+		previous = conn->state;
+
+		/* Take in the shadows' replies as they come. */
+		if (primary_mode && STATE_IS_INPUT(conn->state))
+			(void) smtpConnPending(conn);
+
+		/* Hold the client until the output queues drain. */
+		if (STATE_IS_INPUT(conn->state) && smtpConnBlocked(conn))
+			return;
+
+		switch (conn->state) {
+		case STATE_COMMAND:
+			smtpConnCommand(conn);
+			break;
+		case STATE_AUTH_USER:
+			authLoginUser(conn);
+			break;
+		case STATE_AUTH_PASS:
+			authLoginPass(conn);
+			break;
+		case STATE_DATA:
+			/* Relay as many lines as are buffered. */
+			while (conn->state == STATE_DATA && !smtpConnBlocked(conn) && smtpConnDataSplice(conn) == 0)
+				;
+			break;
+		case STATE_BDAT:
+			while (conn->state == STATE_BDAT && !smtpConnBlocked(conn) && smtpConnChunk(conn) == 0)
+				;
+			break;
+		case STATE_CLOSE:
+			return;
+		default:
+			if (smtpConnPending(conn) == 0)
+				smtpConnReplied(conn);
+		}
+	} while (conn->state != previous || (STATE_IS_INPUT(conn->state) && conn->clientOffset < conn->clientLength && memchr(conn->clientBuffer + conn->clientOffset, '\n', conn->clientLength - conn->clientOffset) != NULL));
+}
+
+/*
+ * When the session next needs attention, input aside: the client or
+ * session deadline, or the first reply due from a server.
+ */
+static uint64_t
+smtpConnWake(Connection *conn)
+{
+	if (STATE_IS_INPUT(conn->state) || conn->due == 0 || (conn->deadline != 0 && conn->deadline <= conn->due))
+		return conn->deadline;
+
+	return conn->due;
+}
+
+/*
+ * The session deadline has passed, either the client has been idle
+ * too long or some servers failed to reply in time.
+ */
+static void
+smtpConnTimeout(Connection *conn)
+{
+	int i, expired;
+	uint64_t now;
+	Downstream *server;
+
+	if (STATE_IS_INPUT(conn->state) && smtpConnBlocked(conn)) {
+		for (i = 0; i < nservers; i++) {
+			if (conn->servers[i].socket != NULL && output_high_water < conn->servers[i].out_length - conn->servers[i].out_offset) {
+				syslog(LOG_ERR, LOG_FMT "#%d write timeout to %s", LOG_ARG, i, smtp_host[i]);
+				smtpConnDisconnect(conn, i);
+			}
+		}
+		smtpConnSetState(conn, conn->state);
+		smtpConnRun(conn);
+		return;
 	}
 
-	syslog(LOG_DEBUG, LOG_FMT "login=%s pass=%s", LOG_ARG, conn->input, conn->input+userLen+1+userLen+1);
+	if (STATE_IS_INPUT(conn->state)) {
+		syslog(LOG_ERR, LOG_FMT "client timeout", LOG_ARG);
+		conn->state = STATE_CLOSE;
+		return;
+	}
 
-	(void) TextCopy(conn->input, sizeof (conn->input), "AUTH PLAIN ");
-	memcpy(conn->input+sizeof("AUTH PLAIN ")-1, buffer, conn->inputLength);
-	conn->inputLength += sizeof("AUTH PLAIN ")-1;
-	conn->input[conn->inputLength] = '\0';
+	now = monotonicUs();
+	expired = conn->deadline != 0 && conn->deadline <= now;
 
-	syslog(LOG_DEBUG, LOG_FMT "plain=%s", LOG_ARG, conn->input);
+	for (i = 0; i < nservers; i++) {
+		server = &conn->servers[i];
+		if (server->socket == NULL || !server->pending || !smtpConnWaits(conn, i))
+			continue;
+		if (!expired && (SERVER_DUE(server) == 0 || now < SERVER_DUE(server)))
+			continue;
+		if (!server->connecting && REPLIES_TIMED)
+			replyEstimate(i, server->phases[server->phase_first], now - server->sent);
+		if (smtpConnFailed(conn, i))
+			syslog(LOG_ERR, LOG_FMT "#%d %s timeout from %s", LOG_ARG, i, server->connecting ? "connect" : "read", smtp_host[i]);
+		smtpConnDisconnect(conn, i);
+	}
 
-	rc = 0;
-error2:
-	free(buffer);
-error1:
-	Base64Destroy(base64);
-error0:
-	return rc;
+	smtpConnRun(conn);
 }
 
-static int
-smtpConnData(Connection *conn)
+static Connection *
+smtpConnCreate(Socket2 *client, char *id)
 {
-	time_t now;
-	long length;
-	struct tm local;
-	int i, code, isDot, isEOH = 0;
-	char stamp[40], line[SMTP_TEXT_LINE_LENGTH];
+	Connection *conn;
 
-	smtpConnPrint(conn, -1, "354 enter mail, end with \".\" on a line by itself\r\n");
+	if ((conn = calloc(1, sizeof (*conn))) == NULL)
+		return NULL;
+
+	conn->id = id;
+	conn->client = client;
+	conn->event.conn = conn;
+	conn->event.slot = -1;
+	conn->spool.fd = -1;
+	conn->routed = -1;
+	conn->pipes[0] = conn->pipes[1] = conn->pipes[2] = conn->pipes[3] = -1;
+	(void) socketAddressGetName(&conn->client->address, conn->client_name, sizeof (conn->client_name));
+	(void) socketAddressGetString(&conn->client->address, 0, conn->client_addr, sizeof (conn->client_addr));
 
-	/* Add our Return-Path and Received header. */
-	now = time(NULL);
-	(void) localtime_r(&now, &local);
-	(void) getRFC2821DateTime(&local, stamp, sizeof (stamp));
-	/* Note that conn->id is a session ID and does not
-	 * change (yet) with each MAIL transaction.
-	 */
+	(void) socketSetNagle(conn->client, 0);
+	(void) socketSetLinger(conn->client, 0);
+	(void) socketSetNonBlocking(conn->client, 1);
+
+	/* Prepare XCLIENT just in case. */
+	int is_ipv4 = conn->client->address.sa.sa_family == AF_INET;
 	(void) snprintf(
-		line, sizeof (line),
-		"Return-Path: <%s>\r\nReceived: from %s ([%s]) id %s; %s\r\n",
-		conn->mail->address.string, conn->client_name, conn->client_addr, conn->id, stamp
+		conn->xclient, sizeof (conn->xclient), "XCLIENT ADDR=%s%s NAME=%s\r\n",
+		is_ipv4 ? "" : IPV6_TAG, conn->client_addr, conn->client_name
 	);
-	if (1 < debug) {
-		syslog(LOG_DEBUG, LOG_FMT "> %s", LOG_ARG, line);
+
+	if ((conn->servers = calloc(nservers, sizeof (*conn->servers))) == NULL) {
+		syslog(LOG_ERR, LOG_FMT "%s (%d)", LOG_ARG, strerror(errno), errno);
+		smtpConnPrint(conn, -1, reply_421);
+		free(conn);
+		return NULL;
+	}
+
+	conn->stats = statsSlot();
+	STATS_ADD(conn, sessions, 1);
+	journalOpen(conn);
+
+	return conn;
+}
+
+static void
+smtpConnClose(Connection *conn)
+{
+	int i;
+
+	conn->state = STATE_CLOSE;
+	smtpConnUnpark(conn);
+	for (i = 0; i < nservers; i++)
+		smtpConnDisconnect(conn, i);
+}
+
+static void
+smtpConnFree(Connection *conn)
+{
+	int i;
+
+	if (conn != NULL) {
+		smtpConnClose(conn);
+		smtpConnRouteTo(conn, -1);
+		STATS_ADD(conn, sessions_ended, 1);
+		journalClose(conn);
+		spoolAbort(conn);
+#ifdef HAVE_SPLICE
+		smtpConnPipesClose(conn);
+#endif
+		for (i = 0; i < nservers; i++)
+			free(conn->servers[i].out);
+		free(conn->helo);
+		free(conn->auth);
+		free(conn->answer);
+		free(conn->servers);
+		free(conn->mail);
+		free(conn);
 	}
+}
+
+/*
+ * Connect to all the SMTP servers and wait for their welcome. Idle
+ * connections from the pool are used first; they have already been
+ * greeted and are told who the new client is after the next EHLO.
+ */
+static int
+smtpConnOpen(Connection *conn)
+{
+	int i, connecting;
+	uint64_t deadline;
+	SocketAddress address;
+	char addr[IPV6_STRING_SIZE];
+
+	connecting = 0;
+	conn->connected = 0;
+retry:
 	for (i = 0; i < nservers; i++) {
-		if (conn->servers[i] == NULL) {
+		conn->servers[i].event.conn = conn;
+		conn->servers[i].event.slot = i;
+
+		if (conn->servers[i].sampled_out)
+			continue;
+
+		if (!healthAllow(i)) {
+			syslog(LOG_DEBUG, LOG_FMT "#%d skipping %s, circuit open", LOG_ARG, i, smtp_host[i]);
+			if (connect_all) {
+				smtpConnPrint(conn, -1, reply_421);
+				return -1;
+			}
 			continue;
 		}
-		if (smtpConnPrint(conn, i, (const char *) line) < 0) {
-			smtpConnDisconnect(conn, i);
+
+		if ((conn->servers[i].socket = poolGet(i)) != NULL) {
+			healthUp(i);
+			conn->connected++;
+			syslog(LOG_DEBUG, LOG_FMT "#%d reusing pooled connection to %s", LOG_ARG, i, smtp_host[i]);
+			STATS_SERVER_ADD(conn, i, connects, 1);
+			smtpConnWatch(conn, i);
+			conn->servers[i].code = 220;
+			continue;
+		}
+
+		if (resolvePick(i, &address) || (conn->servers[i].socket = socketOpen(&address, 1)) == NULL)
 			continue;
+		(void) resolveHold(i, &address);
+
+		conn->connected++;
+		(void) socketAddressGetString(&address, 0, addr, sizeof (addr));
+		syslog(LOG_DEBUG, LOG_FMT "#%d connecting to %s [%s]", LOG_ARG, i, smtp_host[i], addr);
+		STATS_SERVER_ADD(conn, i, connects, 1);
+
+		/* Start all the connects together; they complete, or not,
+		 * while waiting on the welcome banners.  Like the client,
+		 * Nagle is off so a short write like the dot is not held
+		 * for the ACK of the body.
+		 */
+		(void) socketSetNagle(conn->servers[i].socket, 0);
+		(void) socketSetNonBlocking(conn->servers[i].socket, 1);
+		if (connect(conn->servers[i].socket->fd, &address.sa, socketAddressLength(&address))) {
+			if (errno != EINPROGRESS && errno != EINTR) {
+				if (healthDown(i))
+					syslog(LOG_ERR, LOG_FMT "#%d connection to %s failed: %s (%d)", LOG_ARG, i, smtp_host[i], strerror(errno), errno);
+				smtpConnDisconnect(conn, i);
+				if (connect_all) {
+					smtpConnPrint(conn, -1, reply_421);
+					return -1;
+				}
+				continue;
+			}
+			conn->servers[i].connecting = 1;
+			connecting++;
 		}
+
+		smtpConnExpect(conn, i, PHASE_WELCOME);
+		smtpConnWatch(conn, i);
+	}
+
+	/* With -R, fail over to the next server of the route. */
+	if (conn->connected <= 0 && route_by != ROUTE_NONE && smtpConnRouteNext(conn) == 0)
+		goto retry;
+
+	if (conn->connected <= 0) {
+		syslog(LOG_ERR, LOG_FMT "no answer from any SMTP server", LOG_ARG);
+		smtpConnPrint(conn, -1, reply_421);
+		return -1;
+	}
+
+	/* Collect the welcome banners together. */
+	smtpConnSetState(conn, STATE_WELCOME);
+
+	/* Bound the connects by the connect timeout, the slowest of
+	 * which sets the session setup time.
+	 */
+	if (0 < connecting && 0 < connect_timeout) {
+		deadline = monotonicUs() + (uint64_t) connect_timeout * 1000;
+		if (conn->deadline == 0 || deadline < conn->deadline)
+			conn->deadline = deadline;
+	}
+
+	return 0;
+}
+
+static int
+smtpConnStart(Connection *conn)
+{
+	if (route_by != ROUTE_NONE)
+		smtpConnRoute(conn);
+	else
+		smtpConnSampleSession(conn);
+
+	/* Spool mode replays to the servers later, and with -L they
+	 * wait until the client needs them.  Either way we answer the
+	 * welcome ourselves.
+	 */
+	if (spool_dir != NULL || lazy_connect) {
+		conn->lazy = spool_dir == NULL;
+		smtpConnSetState(conn, STATE_WELCOME);
+		return 0;
 	}
 
-	/* Relay client's message to each SMTP server in turn. */
-	for (isDot = 0; !isDot && socketHasInput(conn->client, socket_timeout); ) {
-		/* Read the next line trimming the CRLF. */
-		if ((length = socketReadLine2(conn->client, conn->input, sizeof (conn->input), 0)) < 0) {
-			syslog(LOG_ERR, LOG_FMT "client read error during message: %s (%d)%c", LOG_ARG, strerror(errno), errno, length == SOCKET_EOF ? '!' : ' ');
-			return -1;
-		}
-		if (0 < TextInsensitiveStartsWith(conn->input, "Return-Path:")) {
-			/* We supply our Return-Path based on MAIL FROM: */
-			continue;
-		}
+	return smtpConnOpen(conn);
+}
 
-		isDot = conn->input[0] == '.' && conn->input[1] == '\0';
-		if (!isEOH && length == 0) {
-			/* First blank line is EOH. */
-			isEOH = 1;
-			if (0 < debug && debug < 3) {
-				syslog(LOG_DEBUG, LOG_FMT "message content not logged", LOG_ARG);
-			}
-		}
+/***********************************************************************
+ *** Thread Per Session Engine
+ ***********************************************************************/
 
-		/* -v log dot, -vv log only headers, -vvv log everything. */
-		if (2 < debug || (1 < debug && !isEOH) || (0 < debug && isDot)) {
-			syslog(LOG_DEBUG, LOG_FMT "> %s", LOG_ARG, conn->input);
-		}
+int
+roundhouse(ServerSession *session)
+{
+	uint64_t now, wake;
+	Connection *conn;
+	int i, n, ready, slots[MAX_ARGV_LENGTH+1];
+	struct pollfd fds[MAX_ARGV_LENGTH+1];
+
+	syslog(LOG_INFO, "%s start interface=[%s] client=[%s]", session->id_log, session->if_addr, session->address);
+
+	if ((conn = smtpConnCreate(session->client, session->id_log)) == NULL)
+		return -1;
+
+	session->data = conn;
 
-		/* Add back the CRLF removed by socketReadLine2(). */
-		conn->input[length++] = '\r';
-		conn->input[length++] = '\n';
-		conn->input[length] = '\0';
+	if (smtpConnStart(conn) == 0)
+		smtpConnRun(conn);
 
+	while (conn->state != STATE_CLOSE) {
+		n = 0;
+		if (STATE_IS_INPUT(conn->state) && !smtpConnBlocked(conn)) {
+			fds[n].fd = conn->client->fd;
+			fds[n].events = POLLIN;
+			slots[n++] = -1;
+		}
 		for (i = 0; i < nservers; i++) {
-			if (conn->servers[i] == NULL)
-				continue;
+			if (conn->servers[i].socket != NULL && (conn->servers[i].pending || 0 < conn->servers[i].out_length)) {
+				fds[n].fd = conn->servers[i].socket->fd;
+				fds[n].events = conn->servers[i].connecting ? POLLOUT : POLLIN;
+				if (conn->servers[i].out_offset < conn->servers[i].out_length - conn->servers[i].out_held)
+					fds[n].events |= POLLOUT;
+				slots[n++] = i;
+			}
+		}
 
-			if (smtpConnPrint(conn, i, (const char *) conn->input) < 0) {
-				smtpConnDisconnect(conn, i);
+		now = monotonicUs();
+		wake = smtpConnWake(conn);
+		if (wake != 0 && wake <= now) {
+			ready = 0;
+		} else if ((ready = poll(fds, n, wake == 0 ? -1 : (int) ((wake - now + 999) / 1000))) < 0) {
+			if (errno == EINTR)
 				continue;
-			}
+			syslog(LOG_ERR, LOG_FMT "poll error: %s (%d)", LOG_ARG, strerror(errno), errno);
+			break;
+		}
 
-			if (isDot) {
-				/* Get and ignore the response leaving the
-				 * connection open for further MAIL.  Tell
-				 * the client success, since we can't report
-				 * N differnet SMTP replies to the client.
-				 */
-				(void) smtpConnGetResponse(conn, i, conn->reply, sizeof (conn->reply), &code);
+		if (ready == 0) {
+			smtpConnTimeout(conn);
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (fds[i].revents != 0 && 0 <= slots[i]) {
+				if (smtpConnFlush(conn, slots[i]))
+					smtpConnDisconnect(conn, slots[i]);
+				smtpConnServerRead(conn, slots[i]);
 			}
 		}
+		smtpConnRun(conn);
 	}
 
+	smtpConnFree(conn);
+
+	syslog(LOG_INFO, "%s end interface=[%s] client=[%s]", session->id_log, session->if_addr, session->address);
+
 	return 0;
 }
 
-int
-roundhouse(ServerSession *session)
-{
-	Connection *conn;
-	char xclient[SMTP_TEXT_LINE_LENGTH];
-	int i, code, isQuit, isData, isEhlo;
+/***********************************************************************
+ *** Event Loop Engine
+ ***********************************************************************/
 
-	syslog(LOG_INFO, "%s start interface=[%s] client=[%s]", session->id_log, session->if_addr, session->address);
+#ifdef HAVE_SYS_EPOLL_H
 
-	if ((conn = calloc(1, sizeof (*conn))) == NULL)
-		return -1;
+#ifndef EVENT_BATCH
+#define EVENT_BATCH			64
+#endif
 
-	session->data = conn;
-	conn->id = session->id_log;
-	conn->client = session->client;
-	(void) socketAddressGetName(&conn->client->address, conn->client_name, sizeof (conn->client_name));
-	(void) socketAddressGetString(&conn->client->address, 0, conn->client_addr, sizeof (conn->client_addr));
+typedef struct {
+	int epfd;
+	pthread_t thread;
+	Connection *sessions;			/* Active sessions. */
+	Connection *closed;			/* Freed at the end of each batch. */
+	uint64_t next_sweep;
+} EventLoop;
 
-	(void) socketSetNagle(conn->client, 0);
-	(void) socketSetLinger(conn->client, 0);
-	(void) socketSetNonBlocking(conn->client, 1);
+typedef struct {
+	Socket2 *socket;
+	EventSource event;
+	char if_addr[IPV6_STRING_SIZE+8];
+} EventListener;
+
+static volatile int event_running;
+static EventLoop *event_loops;
+static int event_nlisteners;
+static EventListener event_listeners[MAX_ARGV_LENGTH];
+static unsigned long event_session_count;
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-	if ((conn->servers = calloc(nservers, sizeof (*conn->servers))) == NULL) {
-		syslog(LOG_ERR, LOG_FMT "%s (%d)", LOG_ARG, strerror(errno), errno);
-		smtpConnPrint(conn, -1, reply_421);
-		goto error0;
+static void
+smtpConnWatch(Connection *conn, int index)
+{
+	struct epoll_event ev;
+	EventLoop *loop = conn->loop;
+
+	if (loop == NULL)
+		return;
+
+	/* Writable signals a server's non-blocking connect finished. */
+	ev.events = index < 0 ? EPOLLIN | EPOLLET : EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = index < 0 ? &conn->event : &conn->servers[index].event;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, index < 0 ? conn->client->fd : conn->servers[index].socket->fd, &ev)) {
+		syslog(LOG_ERR, LOG_FMT "#%d epoll_ctl error: %s (%d)", LOG_ARG, index, strerror(errno), errno);
 	}
+}
 
-	/* Connect to all the SMTP servers. */
-	conn->connected = 0;
-	for (i = 0; i < nservers; i++) {
-		if ((conn->servers[i] = socketOpen(servers[i], 1)) == NULL)
-			continue;
+static void
+smtpConnUnwatch(Connection *conn, int index)
+{
+	EventLoop *loop = conn->loop;
 
-		conn->connected++;
-		syslog(LOG_DEBUG, LOG_FMT "#%d connecting to %s", LOG_ARG, i, smtp_host[i]);
+	/* A pooled connection can be checked out by another loop. */
+	if (loop != NULL)
+		(void) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->servers[index].socket->fd, NULL);
+}
 
-		if (socketClient(conn->servers[i], CONNECT_TIMEOUT)) {
-			syslog(LOG_ERR, LOG_FMT "#%d connection to %s failed", LOG_ARG, i, smtp_host[i]);
-			smtpConnDisconnect(conn, i);
-			if (connect_all) {
-				smtpConnPrint(conn, -1, reply_421);
-				goto error1;
-			}
-			continue;
-		}
+static void
+eventSessionEnd(EventLoop *loop, Connection *conn)
+{
+	syslog(LOG_INFO, "%s end client=[%s]", conn->id, conn->client_addr);
 
-		(void) socketSetNonBlocking(conn->servers[i], 1);
+	/* Unlink from the active list. */
+	if (conn->prev == NULL)
+		loop->sessions = conn->next;
+	else
+		conn->prev->next = conn->next;
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
 
-		if (smtpConnGetResponse(conn, i, conn->reply, sizeof (conn->reply), &code) || code != 220) {
-			syslog(LOG_ERR, LOG_FMT "#%d no welcome from %s", LOG_ARG, i, smtp_host[i]);
-			smtpConnDisconnect(conn, i);
+	/* Close the sockets now, but defer freeing the connection
+	 * until the rest of the event batch has been processed.
+	 */
+	smtpConnClose(conn);
+	socketClose(conn->client);
+	conn->client = NULL;
+	conn->next = loop->closed;
+	loop->closed = conn;
+}
+
+static void
+eventAccept(EventLoop *loop, EventListener *listener)
+{
+	Socket2 *client;
+	Connection *conn;
+	unsigned long count;
+
+	while ((client = socketAccept(listener->socket)) != NULL) {
+		(void) pthread_mutex_lock(&event_mutex);
+		count = ++event_session_count;
+		(void) pthread_mutex_unlock(&event_mutex);
+
+		if ((conn = smtpConnCreate(client, NULL)) == NULL) {
+			socketClose(client);
 			continue;
 		}
-	}
-
-	if (conn->connected <= 0) {
-		syslog(LOG_ERR, LOG_FMT "no answer from any SMTP server", LOG_ARG);
-		smtpConnPrint(conn, -1, reply_421);
-		goto error1;
-	}
 
-	/* Multiline welcome message can throw off some spam engines. */
-	(void) snprintf(conn->input, sizeof (conn->input), "220-" _DISPLAY " switch yard for mail.\r\n220 Session ID %s.\r\n", conn->id);
-	smtpConnPrint(conn, -1, conn->input);
+		(void) snprintf(conn->session_id, sizeof (conn->session_id), "%08lx%05lu", (unsigned long) time(NULL), count % 100000);
+		conn->id = conn->session_id;
+		conn->loop = loop;
 
-	/* Prepare XCLIENT just in case. */
-	int is_ipv4 = conn->client->address.sa.sa_family == AF_INET;
-	(void) snprintf(
-		xclient, sizeof (xclient), "XCLIENT ADDR=%s%s NAME=%s\r\n",
-		is_ipv4 ? "" : IPV6_TAG, conn->client_addr, conn->client_name
-	);
+		syslog(LOG_INFO, "%s start interface=[%s] client=[%s]", conn->id, listener->if_addr, conn->client_addr);
 
-	/* Relay client SMTP commands to each SMTP server in turn. */
-	while (socketHasInput(conn->client, socket_timeout)) {
-		if ((conn->inputLength = socketReadLine2(conn->client, conn->input, sizeof (conn->input), 1)) < 0) {
-			syslog(LOG_ERR, LOG_FMT "client read error: %s (%d)%c", LOG_ARG, strerror(errno), errno, conn->inputLength == SOCKET_EOF ? '!' : ' ');
-			goto error1;
-		}
+		conn->next = loop->sessions;
+		if (loop->sessions != NULL)
+			loop->sessions->prev = conn;
+		loop->sessions = conn;
 
-		syslog(LOG_DEBUG, LOG_FMT "> %s", LOG_ARG, conn->input);
+		smtpConnWatch(conn, -1);
+		if (smtpConnStart(conn) == 0)
+			smtpConnRun(conn);
+		if (conn->state == STATE_CLOSE)
+			eventSessionEnd(loop, conn);
+	}
+}
 
-		if (conn->input[0] == '\0') {
-			smtpConnPrint(conn, -1, "500 command unrecognized: \"\"\r\n");
-			continue;
+static void *
+eventLoop(void *data)
+{
+	int i, n;
+	uint64_t now, wake;
+	EventSource *source;
+	Connection *conn, *next;
+	EventLoop *loop = data;
+	struct epoll_event events[EVENT_BATCH];
+
+	while (event_running) {
+		if ((n = epoll_wait(loop->epfd, events, EVENT_BATCH, 1000)) < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "epoll_wait error: %s (%d)", strerror(errno), errno);
+			break;
 		}
 
-		if (0 < TextInsensitiveStartsWith(conn->input, "STARTTLS")) {
-			if (key_crt_pem == NULL) {
-				(void) smtpConnPrint(conn, -1, "502 command not recognised\r\n");
+		for (i = 0; i < n; i++) {
+			source = events[i].data.ptr;
+			if ((conn = source->conn) == NULL) {
+				eventAccept(loop, &event_listeners[source->slot]);
 				continue;
 			}
-
-			if (socket3_is_tls(conn->client->fd)) {
-				(void) smtpConnPrint(conn, -1, "503 TLS already started\r\n");
+			if (conn->state == STATE_CLOSE)
 				continue;
+			if (0 <= source->slot) {
+				if (smtpConnFlush(conn, source->slot))
+					smtpConnDisconnect(conn, source->slot);
+				smtpConnServerRead(conn, source->slot);
 			}
+			smtpConnRun(conn);
+			if (conn->state == STATE_CLOSE)
+				eventSessionEnd(loop, conn);
+		}
 
-			syslog(LOG_INFO, "starting TLS...");
-
-			if (socket3_start_tls(conn->client->fd, SOCKET3_SERVER_TLS, socket_timeout)) {
-				syslog(LOG_ERR, log_io, SERVER_FILE_LINENO, strerror(errno), errno);
-				(void) smtpConnPrint(conn, -1, "454 TLS not available\r\n");
-				continue;
+		/* Check session deadlines about once a second. */
+		now = monotonicUs();
+		if (loop->next_sweep <= now) {
+			loop->next_sweep = now + 1000000;
+			for (conn = loop->sessions; conn != NULL; conn = next) {
+				next = conn->next;
+				if ((wake = smtpConnWake(conn)) != 0 && wake <= now) {
+					smtpConnTimeout(conn);
+					if (conn->state == STATE_CLOSE)
+						eventSessionEnd(loop, conn);
+				}
 			}
+		}
+
+		for (conn = loop->closed; conn != NULL; conn = next) {
+			next = conn->next;
+			smtpConnFree(conn);
+		}
+		loop->closed = NULL;
+	}
 
-			syslog(LOG_INFO, "TLS started");
+	for (conn = loop->sessions; conn != NULL; conn = next) {
+		next = conn->next;
+		eventSessionEnd(loop, conn);
+	}
+	for (conn = loop->closed; conn != NULL; conn = next) {
+		next = conn->next;
+		smtpConnFree(conn);
+	}
+	loop->closed = NULL;
 
-			if (smtpConnPrint(conn, -1, "220 OK\r\n") < 0) {
-				break;
-			}
+	return NULL;
+}
+
+/*
+ * Bind the listening sockets. This must be done before dropping
+ * privileges in order to bind to port 25.
+ */
+static int
+eventListen(void)
+{
+	int on = 1;
+	char *list, *next, *token;
+	SocketAddress *address;
+	EventListener *listener;
+
+	if ((list = strdup(interfaces)) == NULL)
+		return -1;
+
+	for (token = list; token != NULL && event_nlisteners < MAX_ARGV_LENGTH; token = next) {
+		if ((next = strchr(token, ',')) != NULL)
+			*next++ = '\0';
+		if (*token == '\0')
 			continue;
-		}
 
-		if (0 < TextInsensitiveStartsWith(conn->input, "AUTH LOGIN") && authLogin(conn))
-			break;
+		listener = &event_listeners[event_nlisteners];
+		(void) TextCopy(listener->if_addr, sizeof (listener->if_addr), token);
 
-		i = TextInsensitiveStartsWith(conn->input, "MAIL FROM:");
-		if (0 < i) {
-			free(conn->mail);
-			conn->mail = NULL;
-			const char *error = parsePath(conn->input, 0, 0, &conn->mail);
-			if (error != NULL) {
-				syslog(LOG_ERROR, "%s", error);
-				continue;
-			}
+		if ((address = socketAddressCreate(token, SMTP_PORT)) == NULL) {
+			syslog(LOG_ERR, "interface address error '%s': %s (%d)", token, strerror(errno), errno);
+			goto error1;
+		}
+		listener->socket = socketOpen(address, 1);
+		free(address);
+		if (listener->socket == NULL) {
+			syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
+			goto error1;
+		}
+#ifdef IPV6_V6ONLY
+		/* Allow [::0]:25 and 0.0.0.0:25 to be bound together. */
+		if (listener->socket->address.sa.sa_family == AF_INET6)
+			(void) setsockopt(listener->socket->fd, IPPROTO_IPV6, IPV6_V6ONLY, (void *) &on, sizeof (on));
+#endif
+		if (socketServer(listener->socket, SOMAXCONN)) {
+			syslog(LOG_ERR, "interface bind error '%s': %s (%d)", token, strerror(errno), errno);
+			socketClose(listener->socket);
+			goto error1;
 		}
+		(void) socketSetNonBlocking(listener->socket, 1);
+		listener->event.conn = NULL;
+		listener->event.slot = event_nlisteners++;
+	}
 
-		isEhlo = 0 < TextInsensitiveStartsWith(conn->input, "EHLO");
-		isQuit = 0 < TextInsensitiveStartsWith(conn->input, "QUIT");
-		isData = 0;
+	free(list);
 
-		/* Add back the CRLF removed by socketReadLine(). */
-		if (sizeof (conn->input) <= conn->inputLength+3)
-			conn->inputLength = sizeof (conn->input)-3;
+	return 0;
+error1:
+	free(list);
 
-		for (i = 0; i < nservers; i++) {
-			if (conn->servers[i] == NULL)
-				continue;
+	return -1;
+}
 
-			if (smtpConnPrint(conn, i, (const char *) conn->input) < 0) {
-				smtpConnDisconnect(conn, i);
-				continue;
-			}
+static int
+eventStart(void)
+{
+	int i, j;
+	struct epoll_event ev;
 
-			/* We don't wait for SMTP server responses to QUIT
-			 * since some SMTP servers just drop the connection
-			 * and so no point in waiting for the 221 reply.
-			 */
-			if (isQuit)
-				continue;
+	if ((event_loops = calloc(event_threads, sizeof (*event_loops))) == NULL)
+		return -1;
 
-			if (smtpConnGetResponse(conn, i, conn->reply, sizeof (conn->reply), &code) != 0) {
-				smtpConnDisconnect(conn, i);
-			} else if (isEhlo && strcasestr(conn->reply, "XCLIENT") != NULL) {
-				/* Send XCLIENT ADDR= NAME=, ignore response since its a Postfix thing. */
-				syslog(LOG_DEBUG, LOG_FMT "> %s", LOG_ARG, xclient);
-				(void) smtpConnPrint(conn, i, (const char *) xclient);
-				(void) smtpConnGetResponse(conn, i, conn->reply, sizeof (conn->reply), &code);
-
-				/* See reply codes http://www.postfix.org/XCLIENT_README.html */
-				if (code == 421) {
-					/* Unable to proceed, disconnecting.  Assume "we don't like them."
-					 * A server's ACL could opt to disconnect immediately rather than
-					 * return a negative code and wait for QUIT.  Postfix is a little
-					 * vague.
-					 */
-					smtpConnPrint(conn, -1, reply_421);
-					goto error1;
-				}
+	event_running = 1;
 
-			} else if (code == 354) {
-				isData++;
+	for (i = 0; i < event_threads; i++) {
+		if ((event_loops[i].epfd = epoll_create1(0)) < 0) {
+			syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
+			return -1;
+		}
+
+		/* Every loop waits on every listener; the kernel wakes
+		 * only one of them for each new connection.
+		 */
+		for (j = 0; j < event_nlisteners; j++) {
+			ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+			ev.events |= EPOLLEXCLUSIVE;
+#endif
+			ev.data.ptr = &event_listeners[j].event;
+			if (epoll_ctl(event_loops[i].epfd, EPOLL_CTL_ADD, event_listeners[j].socket->fd, &ev)) {
+				syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
+				return -1;
 			}
 		}
 
-		if (isQuit) {
-			smtpConnPrint(conn, -1, "221 closing connection\r\n");
-			break;
+		if (pthread_create(&event_loops[i].thread, NULL, eventLoop, &event_loops[i])) {
+			syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
+			return -1;
 		}
+	}
 
-		if (isData && smtpConnData(conn))
-			goto error1;
+	return 0;
+}
 
-		if (conn->connected <= 0)
-			goto error1;
+static void
+eventStop(void)
+{
+	int i;
 
-		if (isEhlo) {
-			/* We have to feed a reasonable EHLO response,
-			 * because some mail clients will abort if
-			 * STARTTLS and AUTH are not supported.
-			 */
-			smtpConnPrint(conn, -1, ehlo_reply);
-		}
+	event_running = 0;
 
-		else {
-			smtpConnPrint(conn, -1, "250 OK\r\n");
+	if (event_loops != NULL) {
+		for (i = 0; i < event_threads; i++) {
+			if (event_loops[i].thread != 0)
+				(void) pthread_join(event_loops[i].thread, NULL);
+			if (0 <= event_loops[i].epfd)
+				(void) close(event_loops[i].epfd);
 		}
+		free(event_loops);
+		event_loops = NULL;
 	}
-error1:
-	for (i = 0; i < nservers; i++)
-		smtpConnDisconnect(conn, i);
-error0:
-	free(conn->servers);
-	free(conn);
 
-	syslog(LOG_INFO, "%s end interface=[%s] client=[%s]", session->id_log, session->if_addr, session->address);
+	for (i = 0; i < event_nlisteners; i++)
+		socketClose(event_listeners[i].socket);
+	event_nlisteners = 0;
+}
 
-	return 0;
+#else
+
+static void
+smtpConnWatch(Connection *conn, int index)
+{
+	/* Do nothing. */
+}
+
+static void
+smtpConnUnwatch(Connection *conn, int index)
+{
+	/* Do nothing. */
 }
 
+#endif /* HAVE_SYS_EPOLL_H */
+
 int
 serverMain(void)
 {
@@ -776,6 +6198,9 @@ serverMain(void)
 
 	rc = EXIT_FAILURE;
 
+	/* Carry on writing log lines directly if need be. */
+	(void) logStart();
+
 	syslog(LOG_INFO, _DISPLAY "/" _VERSION " " _COPYRIGHT);
 
 	if (socket3_init_tls()) {
@@ -796,12 +6221,32 @@ serverMain(void)
 		goto error1;
 	}
 
-	if ((smtp = serverCreate(interfaces, SMTP_PORT)) == NULL)
+	srandom((unsigned) time(NULL) ^ (unsigned) getpid());
+
+	if (poolInit()) {
+		syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
 		goto error1;
+	}
+	routeInit();
+
+	smtp = NULL;
+#ifdef HAVE_SYS_EPOLL_H
+	if (0 < event_threads) {
+		if (eventListen())
+			goto error2;
+	} else
+#endif
+	{
+		if ((smtp = serverCreate(interfaces, SMTP_PORT)) == NULL)
+			goto error1;
+
+		smtp->debug.level = debug;
+		smtp->hook.session_process = roundhouse;
+		serverSetStackSize(smtp, SERVER_STACK_SIZE);
+	}
 
-	smtp->debug.level = debug;
-	smtp->hook.session_process = roundhouse;
-	serverSetStackSize(smtp, SERVER_STACK_SIZE);
+	if (metrics_listen != NULL && metricsListen())
+		goto error2;
 
 	if (serverSignalsInit(&signals))
 		goto error2;
@@ -813,6 +6258,26 @@ serverMain(void)
 		goto error3;
 #if defined(__linux__)
 	(void) processDumpCore(1);
+#endif
+#ifdef HAVE_SYS_MMAN_H
+	if (spool_dir != NULL && spoolStart())
+		goto error3;
+#endif
+	if (metrics_socket != NULL && metricsStart())
+		goto error3;
+	if (journal_path != NULL && journalStart())
+		goto error3;
+	if (resolveStart())
+		goto error3;
+#ifdef HAVE_SYS_MMAN_H
+	/* Carry on without, roundhouse-top is only a convenience. */
+	(void) statsOpen();
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+	if (smtp == NULL) {
+		if (eventStart())
+			goto error3;
+	} else
 #endif
 	if (serverStart(smtp))
 		goto error3;
@@ -821,17 +6286,39 @@ serverMain(void)
 	signal = serverSignalsLoop(&signals);
 
 	syslog(LOG_INFO, "signal %d, stopping sessions", signal);
+#ifdef HAVE_SYS_EPOLL_H
+	if (smtp == NULL)
+		eventStop();
+	else
+#endif
 	serverStop(smtp, signal == SIGQUIT);
+#ifdef HAVE_SYS_MMAN_H
+	spoolStop();
+#endif
+	metricsStop();
+	journalStop();
+	resolveStop();
+#ifdef HAVE_SYS_MMAN_H
+	statsClose();
+#endif
 	syslog(LOG_INFO, "signal %d, terminating process", signal);
 
 	rc = EXIT_SUCCESS;
 error3:
 	serverSignalsFini(&signals);
 error2:
+	metricsStop();
+	journalStop();
+	resolveStop();
+#ifdef HAVE_SYS_EPOLL_H
+	eventStop();
+#endif
 	serverFree(smtp);
 error1:
+	poolFini();
 	socket3_fini();
 error0:
+	logStop();
 	return rc;
 }
 
@@ -839,9 +6326,10 @@ void
 serverOptions(int argc, char **argv)
 {
 	int ch, i;
+	char *stop;
 
 	optind = 1;
-	while ((ch = getopt(argc, argv, "Adqvw:u:g:t:i:" GETOPT_TLS)) != -1) {
+	while ((ch = getopt(argc, argv, "AdLPqvw:u:g:t:i:b:D:F:j:m:p:R:T:" GETOPT_TLS GETOPT_EVENT GETOPT_SPOOL)) != -1) {
 		switch (ch) {
 #ifdef HAVE_OPENSSL_SSL_H
 		case 'c':
@@ -866,6 +6354,15 @@ serverOptions(int argc, char **argv)
 		case 'A':
 			connect_all = 1;
 			break;
+		case 'L':
+			lazy_connect = 1;
+			break;
+		case 'P':
+			primary_mode = 1;
+			break;
+		case 'E':
+			event_threads = strtol(optarg, NULL, 10);
+			break;
 		case 'u':
 			/* Unix only. */
 			user_id = optarg;
@@ -884,6 +6381,71 @@ serverOptions(int argc, char **argv)
 			interfaces = optarg;
 			break;
 
+		case 'b':
+			output_high_water = strtol(optarg, &stop, 10);
+			if (*stop == ',')
+				output_wait = strcmp(stop+1, "wait") == 0;
+			break;
+
+		case 'S':
+			spool_dir = optarg;
+			break;
+
+		case 'j':
+			journal_path = optarg;
+			break;
+
+		case 'm':
+			metrics_listen = optarg;
+			break;
+
+		case 'T':
+			reply_floor = strtol(optarg, &stop, 10) * 1000;
+			if (*stop == ',')
+				reply_ceiling = strtol(stop+1, &stop, 10) * 1000;
+			break;
+
+		case 'D':
+			if (strcmp(optarg, "least") == 0) {
+				resolve_least = 1;
+			} else if (strcmp(optarg, "rr") == 0) {
+				resolve_least = 0;
+			} else {
+				fprintf(stderr, usage_message);
+				exit(EX_USAGE);
+			}
+			break;
+
+		case 'R':
+			for (i = 1; route_names[i] != NULL; i++) {
+				if (TextInsensitiveCompare(optarg, route_names[i]) == 0)
+					break;
+			}
+			if (route_names[i] == NULL) {
+				fprintf(stderr, usage_message);
+				exit(EX_USAGE);
+			}
+			route_by = (RouteBy) i;
+			break;
+
+		case 'F':
+			health_failures = strtol(optarg, &stop, 10);
+			if (*stop == ',') {
+				health_retry = strtol(stop+1, &stop, 10) * 1000;
+				if (*stop == ',')
+					health_retry_max = strtol(stop+1, &stop, 10) * 1000;
+			}
+			break;
+
+		case 'p':
+			pool_max_idle = strtol(optarg, &stop, 10);
+			if (*stop == ',') {
+				pool_idle_timeout = strtol(stop+1, &stop, 10) * 1000;
+				if (*stop == ',')
+					pool_probe_interval = strtol(stop+1, &stop, 10) * 1000;
+			}
+			break;
+
 		case 'd':
 			daemon_mode = 0;
 			break;
@@ -909,13 +6471,32 @@ serverOptions(int argc, char **argv)
 		}
 	}
 
+	if (primary_mode && spool_dir != NULL) {
+		/* Spool mode accepts before any server has replied. */
+		fprintf(stderr, "-P and -S cannot be used together\n");
+		exit(EX_USAGE);
+	}
+	if (primary_mode && route_by != ROUTE_NONE) {
+		/* The primary would only get its share of the sessions. */
+		fprintf(stderr, "-P and -R cannot be used together\n");
+		exit(EX_USAGE);
+	}
+
 	if (windows_service != NULL)
 		return;
 
 	for (i = nservers; optind < argc && nservers < MAX_ARGV_LENGTH; optind++, i++) {
 		smtp_host[i] = argv[optind];
 
-		if ((servers[i] = socketAddressCreate(smtp_host[i], SMTP_PORT)) == NULL) {
+		/* host[:port][=percent[/by]] */
+		if ((stop = strchr(smtp_host[i], '=')) != NULL)
+			*stop++ = '\0';
+		if (sampleParse(i, stop)) {
+			syslog(LOG_ERR, "server sampling error '%s=%s'", smtp_host[i], stop);
+			exit(1);
+		}
+
+		if (resolveInit(i, smtp_host[i])) {
 			syslog(LOG_ERR, "server address error '%s': %s (%d)", smtp_host[i], strerror(errno), errno);
 			exit(1);
 		}
@@ -0,0 +1,636 @@
+/*
+ * scanner.c
+ *
+ * Copyright 2013 by Anthony Howe. All rights reserved.
+ *
+ *
+ * Description
+ * -----------
+ *
+ * Streaming scanner for SMTP message content.  In one pass over chunks
+ * of any size it finds the end of data dot, the end of the headers, a
+ * header of interest, lines ending with a bare LF, and over-long lines,
+ * carrying its state across chunk edges.
+ *
+ * In the message body, which is most of the content, blocks of 64 bytes
+ * are compared at once with SSE2 or AVX2 where available, and only the
+ * blocks with a bare LF, a line starting with a dot, or the end of a
+ * long line are looked at one line at a time.  The headers are always
+ * scanned a line at a time, being short and few.
+ *
+ *
+ * Microbenchmark
+ * --------------
+ *
+ *	gcc -DTEST -O2 -o scanner scanner.c
+ *	./scanner [-c chunk][-m messages][-n loops] [message ...]
+ *
+ * Each message file, eg. from a maildir, is converted to CRLF line
+ * endings, dot-stuffed, and terminated with a dot line.  Without any
+ * files a corpus of mixed plain text and MIME messages with base64
+ * attachments is generated.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scanner.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_SCAN_X86
+# include <immintrin.h>
+#endif
+
+/* Block of body examined at once; see scanNext(). */
+#define SCAN_BLOCK		64
+
+typedef const char *(*ScanFast)(Scanner *, const char *, const char *, const char *);
+
+typedef struct {
+	long column;
+	long limit;
+	int previous;
+	int first;
+	const char *line;
+} ScanFastState;
+
+static int scan_isa = -1;
+static ScanFast scan_fast;
+
+/*
+ * Examine one line, or the rest of the chunk when the line continues
+ * into the next, and return where to continue.
+ */
+static const char *
+scanLine(Scanner *s, const char *buffer, const char *p, const char *end)
+{
+	int prev;
+	const char *lf, *stop, *q;
+
+	if (s->column == 0) {
+		s->line = p - buffer;
+		s->first = (unsigned char) *p;
+		s->match = (s->flags & SCAN_HEADERS) && s->header != NULL ? 0 : -1;
+	}
+
+	lf = memchr(p, '\n', end - p);
+	stop = lf == NULL ? end : lf;
+
+	/* The header name may be split across chunks. */
+	for (q = p; 0 <= s->match && s->match < s->header_length && q < stop; q++, s->match++) {
+		if (tolower(*(unsigned char *) q) != tolower(((unsigned char *) s->header)[s->match])) {
+			s->match = -1;
+			break;
+		}
+	}
+
+	if (lf == NULL) {
+		s->column += end - p;
+		s->previous = (unsigned char) end[-1];
+		return end;
+	}
+
+	s->column += lf + 1 - p;
+	prev = p < lf ? (unsigned char) lf[-1] : s->previous;
+
+	if (prev != '\r')
+		s->event |= SCAN_BARE_LF;
+	if (0 < s->limit && s->limit <= s->column)
+		s->event |= SCAN_LONG;
+	if (s->first == '.' && (s->column == 2 || (s->column == 3 && prev == '\r')))
+		s->event |= SCAN_DOT;
+	if (s->flags & SCAN_HEADERS) {
+		if (s->column == 1 || (s->column == 2 && prev == '\r')) {
+			s->event |= SCAN_EOH;
+			s->flags &= ~SCAN_HEADERS;
+		} else if (0 < s->header_length && s->match == s->header_length) {
+			s->event |= SCAN_HEADER;
+		}
+	}
+
+	s->previous = '\n';
+	s->column = 0;
+
+	return lf + 1;
+}
+
+#ifdef HAVE_SCAN_X86
+static void
+scanFastLoad(ScanFastState *f, Scanner *s, const char *buffer)
+{
+	f->column = s->column;
+	f->limit = s->limit;
+	f->previous = s->previous;
+	f->first = s->first;
+	f->line = s->line < 0 ? NULL : buffer + s->line;
+}
+
+static void
+scanFastSave(ScanFastState *f, Scanner *s, const char *buffer)
+{
+	s->column = f->column;
+	s->previous = f->previous;
+	s->first = f->first;
+	s->line = f->line == NULL ? -1 : f->line - buffer;
+}
+
+/*
+ * Given the LF, CR, and dot bit masks of a 64 byte block of body, pass
+ * over it when it needs no closer look: every LF preceded by CR, no
+ * line starting with a dot, and no long line ending.  Return 0 when it
+ * does.
+ */
+static inline int
+scanBlock(ScanFastState *f, const char *p, uint64_t lf, uint64_t cr, uint64_t dot)
+{
+	int k;
+	uint64_t bad;
+
+	bad = lf & ~((cr << 1) | (f->previous == '\r'));
+	bad |= dot & ((lf << 1) | (f->column == 0));
+
+	/* The line in progress ends here and is long or began
+	 * with a dot in an earlier block.
+	 */
+	if (lf != 0 && 0 < f->column && (f->first == '.' || (0 < f->limit && f->limit <= f->column + __builtin_ctzll(lf) + 1)))
+		bad = 1;
+	if (bad != 0)
+		return 0;
+
+	if (lf == 0) {
+		if (f->column == 0) {
+			f->line = p;
+			f->first = (unsigned char) p[0];
+		}
+		f->column += 64;
+	} else {
+		k = 63 - __builtin_clzll(lf);
+		f->column = 63 - k;
+		f->line = p + k + 1;
+		if (k < 63)
+			f->first = (unsigned char) p[k + 1];
+	}
+	f->previous = (unsigned char) p[63];
+
+	return 1;
+}
+
+/*
+ * Skip whole blocks of body that need no closer look, returning the
+ * start of the first block that does, or of the tail shorter than a
+ * block.  The state is kept in locals, since the Scanner could alias
+ * the content as far as the compiler knows.
+ */
+__attribute__((target("sse2")))
+static const char *
+scanFastSSE2(Scanner *s, const char *buffer, const char *p, const char *end)
+{
+	int i;
+	ScanFastState f;
+	uint64_t lf, cr, dot;
+	__m128i v, nl_x16, cr_x16, dot_x16;
+
+	scanFastLoad(&f, s, buffer);
+	nl_x16 = _mm_set1_epi8('\n');
+	cr_x16 = _mm_set1_epi8('\r');
+	dot_x16 = _mm_set1_epi8('.');
+
+	for ( ; SCAN_BLOCK <= end - p; p += SCAN_BLOCK) {
+		lf = cr = dot = 0;
+		for (i = 0; i < SCAN_BLOCK; i += 16) {
+			v = _mm_loadu_si128((const __m128i *) (p + i));
+			lf |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl_x16)) << i;
+			cr |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr_x16)) << i;
+			dot |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, dot_x16)) << i;
+		}
+		if (!scanBlock(&f, p, lf, cr, dot))
+			break;
+	}
+
+	scanFastSave(&f, s, buffer);
+
+	return p;
+}
+
+__attribute__((target("avx2")))
+static const char *
+scanFastAVX2(Scanner *s, const char *buffer, const char *p, const char *end)
+{
+	ScanFastState f;
+	uint64_t lf, cr, dot;
+	__m256i lo, hi, nl_x32, cr_x32, dot_x32;
+
+	scanFastLoad(&f, s, buffer);
+	nl_x32 = _mm256_set1_epi8('\n');
+	cr_x32 = _mm256_set1_epi8('\r');
+	dot_x32 = _mm256_set1_epi8('.');
+
+	for ( ; SCAN_BLOCK <= end - p; p += SCAN_BLOCK) {
+		lo = _mm256_loadu_si256((const __m256i *) p);
+		hi = _mm256_loadu_si256((const __m256i *) (p + 32));
+		lf = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl_x32))
+			| (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl_x32)) << 32;
+		cr = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, cr_x32))
+			| (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, cr_x32)) << 32;
+		dot = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, dot_x32))
+			| (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, dot_x32)) << 32;
+		if (!scanBlock(&f, p, lf, cr, dot))
+			break;
+	}
+
+	scanFastSave(&f, s, buffer);
+
+	return p;
+}
+#endif /* HAVE_SCAN_X86 */
+
+int
+scanUse(int isa)
+{
+#ifdef HAVE_SCAN_X86
+	if (SCAN_ISA_AVX2 <= isa && __builtin_cpu_supports("avx2")) {
+		scan_fast = scanFastAVX2;
+		return scan_isa = SCAN_ISA_AVX2;
+	}
+	if (SCAN_ISA_SSE2 <= isa && __builtin_cpu_supports("sse2")) {
+		scan_fast = scanFastSSE2;
+		return scan_isa = SCAN_ISA_SSE2;
+	}
+#endif
+	scan_fast = NULL;
+
+	return scan_isa = SCAN_ISA_SCALAR;
+}
+
+void
+scanInit(Scanner *scan, const char *header, long limit)
+{
+	/* Every caller picks the same, so a race here is harmless. */
+	if (scan_isa < 0)
+		(void) scanUse(SCAN_ISA_AVX2);
+
+	memset(scan, 0, sizeof (*scan));
+	scan->header = header;
+	scan->header_length = header == NULL ? 0 : (long) strlen(header);
+	scan->flags = SCAN_HEADERS;
+	scan->previous = '\n';
+	scan->limit = limit;
+	scan->match = -1;
+	if (header == NULL)
+		scan->flags = 0;
+}
+
+long
+scanNext(Scanner *s, const char *buffer, long length)
+{
+	const char *p, *end, *block;
+
+	s->event = 0;
+	s->line = s->column == 0 ? 0 : -1;
+	end = buffer + length;
+
+	for (p = buffer; p < end; ) {
+		block = end;
+		if (scan_fast != NULL && !(s->flags & SCAN_HEADERS) && (s->limit == 0 || SCAN_BLOCK < s->limit)) {
+			if (end <= (p = (*scan_fast)(s, buffer, p, end)))
+				break;
+			/* Examine the lines of the block that stopped the
+			 * fast scan, or the short tail, then resume.
+			 */
+			if (p + SCAN_BLOCK < end)
+				block = p + SCAN_BLOCK;
+		}
+		while (p < block) {
+			p = scanLine(s, buffer, p, end);
+			if (s->event != 0)
+				return p - buffer;
+		}
+	}
+
+	if (s->column == 0)
+		s->line = length;
+
+	return length;
+}
+
+#ifdef TEST
+#include <stdio.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+static char usage[] =
+"usage: scanner [-c chunk][-m messages][-n loops] [message ...]\n"
+"\n"
+"-c chunk\tchunk size fed to the scanner; default 16016\n"
+"-m messages\tmessages to generate without files; default 200\n"
+"-n loops\tpasses over the corpus per method; default 200\n"
+"\n"
+"Compare a line at a time relay, as smtpConnData() did, with the\n"
+"scanner using each instruction set available.\n"
+;
+
+typedef struct {
+	unsigned long dots;
+	unsigned long eohs;
+	unsigned long headers;
+	unsigned long bare;
+} Counts;
+
+static char *corpus;
+static long corpus_length, corpus_size;
+static unsigned long corpus_messages;
+static unsigned long seed = 1;
+
+static void
+corpusAppend(const char *data, long length)
+{
+	if (corpus_size < corpus_length + length) {
+		for (corpus_size = corpus_size < 65536 ? 65536 : corpus_size; corpus_size < corpus_length + length; corpus_size *= 2)
+			;
+		if ((corpus = realloc(corpus, corpus_size)) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(corpus + corpus_length, data, length);
+	corpus_length += length;
+}
+
+/* Append one message with CRLF line endings, dot-stuffed and dot terminated. */
+static void
+corpusMessage(const char *message, long length)
+{
+	const char *line, *eol, *end;
+
+	end = message + length;
+	for (line = message; line < end; line = eol + 1) {
+		if ((eol = memchr(line, '\n', end - line)) == NULL)
+			eol = end;
+		if (*line == '.')
+			corpusAppend(".", 1);
+		corpusAppend(line, eol - line - (line < eol && eol[-1] == '\r'));
+		corpusAppend("\r\n", 2);
+	}
+	corpusAppend(".\r\n", 3);
+	corpus_messages++;
+}
+
+static unsigned long
+corpusRandom(unsigned long n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) % n;
+}
+
+static void
+corpusGenerate(unsigned long count)
+{
+	long i, j, lines, length;
+	int mime;
+	char *message, *m;
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const char *words[] = {
+		"the", "message", "server", "relay", "of", "and", "queue", "to",
+		"delivery", "a", "roundhouse", "mail", "in", "is", "for", "test",
+	};
+
+	if ((message = malloc(1 << 20)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for ( ; 0 < count; count--) {
+		m = message;
+		m += sprintf(m, "Return-Path: <sender%lu@example.com>\n", corpusRandom(1000));
+		for (i = corpusRandom(4) + 1; 0 < i; i--) {
+			m += sprintf(m,
+				"Received: from mx%lu.example.net (mx%lu.example.net [192.0.2.%lu])\n"
+				"\tby mail.example.org with ESMTP id %08lX\n"
+				"\tfor <user@example.org>; Mon, 1 Jul 2013 12:%02lu:00 +0000\n",
+				i, i, corpusRandom(255), corpusRandom(0xFFFFFFFF), corpusRandom(60)
+			);
+		}
+		m += sprintf(m,
+			"From: Sender <sender@example.com>\n"
+			"To: User <user@example.org>\n"
+			"Subject: Report %lu\n"
+			"Date: Mon, 1 Jul 2013 12:00:00 +0000\n"
+			"Message-ID: <%lu.%lu@example.com>\n"
+			"MIME-Version: 1.0\n",
+			corpusRandom(10000), corpusRandom(100000), corpusRandom(100000)
+		);
+
+		if ((mime = corpusRandom(10) < 3)) {
+			m += sprintf(m, "Content-Type: multipart/mixed; boundary=\"b\"\n\n--b\nContent-Type: text/plain\n\n");
+		} else {
+			m += sprintf(m, "Content-Type: text/plain; charset=us-ascii\n\n");
+		}
+
+		/* Plain text paragraphs. */
+		for (lines = corpusRandom(60) + 5; 0 < lines; lines--) {
+			length = corpusRandom(72) + 4;
+			if (corpusRandom(40) == 0)
+				*m++ = '.';
+			for (j = 0; j < length; ) {
+				j += sprintf(m + j, "%s ", words[corpusRandom(16)]);
+			}
+			m += j;
+			*m++ = '\n';
+			if (corpusRandom(8) == 0)
+				*m++ = '\n';
+		}
+
+		/* Base64 attachment. */
+		if (mime) {
+			m += sprintf(m, "--b\nContent-Type: application/octet-stream\nContent-Transfer-Encoding: base64\n\n");
+			for (lines = (corpusRandom(60) + 4) * 1024 / 57; 0 < lines; lines--) {
+				for (j = 0; j < 76; j++)
+					*m++ = b64[corpusRandom(64)];
+				*m++ = '\n';
+			}
+			m += sprintf(m, "--b--\n");
+		}
+
+		corpusMessage(message, m - message);
+	}
+
+	free(message);
+}
+
+static void
+corpusLoad(const char *file)
+{
+	FILE *fp;
+	long length;
+	char *message;
+
+	if ((fp = fopen(file, "rb")) == NULL) {
+		perror(file);
+		exit(1);
+	}
+	(void) fseek(fp, 0, SEEK_END);
+	length = ftell(fp);
+	(void) fseek(fp, 0, SEEK_SET);
+
+	if ((message = malloc(length + 1)) == NULL || fread(message, 1, length, fp) != (size_t) length) {
+		perror(file);
+		exit(1);
+	}
+	corpusMessage(message, length);
+	(void) fclose(fp);
+	free(message);
+}
+
+/*
+ * A line at a time as smtpConnData() relayed the content: find the
+ * line, copy it, trim the CRLF, check for Return-Path, the dot, and
+ * the end of headers.
+ */
+static void
+benchLines(Counts *counts)
+{
+	long length;
+	int isEOH = 0;
+	char *line, *eol, *end, input[1001];
+
+	end = corpus + corpus_length;
+	for (line = corpus; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if ((length = eol + 1 - line) < (long) sizeof (input) - 2) {
+			memcpy(input, line, length);
+		} else {
+			/* Split as smtpConnReadLine() does. */
+			length = sizeof (input) - 3;
+			memcpy(input, line, length);
+			eol = line + length - 1;
+		}
+		if (input[length-1] == '\n')
+			length--;
+		if (0 < length && input[length-1] == '\r')
+			length--;
+		else
+			counts->bare++;
+		input[length] = '\0';
+
+		if (!isEOH && strncasecmp(input, "Return-Path:", sizeof ("Return-Path:")-1) == 0) {
+			counts->headers++;
+			continue;
+		}
+		if (input[0] == '.' && input[1] == '\0') {
+			counts->dots++;
+			isEOH = 0;
+			continue;
+		}
+		if (!isEOH && length == 0) {
+			counts->eohs++;
+			isEOH = 1;
+		}
+	}
+}
+
+static void
+benchScanner(Counts *counts, long chunk)
+{
+	Scanner scan;
+	long offset, length, n;
+
+	scanInit(&scan, "Return-Path:", 999);
+
+	for (offset = 0; offset < corpus_length; offset += length) {
+		length = corpus_length - offset < chunk ? corpus_length - offset : chunk;
+		for (n = 0; n < length; ) {
+			n += scanNext(&scan, corpus + offset + n, length - n);
+			if (scan.event & SCAN_HEADER)
+				counts->headers++;
+			if (scan.event & SCAN_EOH)
+				counts->eohs++;
+			if (scan.event & SCAN_BARE_LF)
+				counts->bare++;
+			if (scan.event & SCAN_DOT) {
+				counts->dots++;
+				scanInit(&scan, "Return-Path:", 999);
+			}
+		}
+	}
+}
+
+static double
+benchTime(int method, long chunk, int loops, Counts *counts)
+{
+	int i;
+	struct timeval start, stop;
+
+	(void) gettimeofday(&start, NULL);
+	for (i = 0; i < loops; i++) {
+		memset(counts, 0, sizeof (*counts));
+		if (method < 0)
+			benchLines(counts);
+		else
+			benchScanner(counts, chunk);
+	}
+	(void) gettimeofday(&stop, NULL);
+
+	return (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+int
+main(int argc, char **argv)
+{
+	Counts counts;
+	double seconds;
+	int ch, loops, isa, method;
+	long chunk, messages;
+	static const char *names[] = { "line", "scalar", "sse2", "avx2" };
+
+	loops = 200;
+	chunk = 16016;
+	messages = 200;
+
+	while ((ch = getopt(argc, argv, "c:m:n:")) != -1) {
+		switch (ch) {
+		case 'c':
+			chunk = strtol(optarg, NULL, 10);
+			break;
+		case 'm':
+			messages = strtol(optarg, NULL, 10);
+			break;
+		case 'n':
+			loops = strtol(optarg, NULL, 10);
+			break;
+		default:
+			(void) fputs(usage, stderr);
+			return 2;
+		}
+	}
+
+	if (optind < argc) {
+		for ( ; optind < argc; optind++)
+			corpusLoad(argv[optind]);
+	} else {
+		corpusGenerate(messages);
+	}
+
+	if (chunk <= 0 || loops <= 0 || corpus_length <= 0) {
+		(void) fputs(usage, stderr);
+		return 2;
+	}
+
+	printf("%lu messages, %.1f MB, chunk %ld, %d loops\n", corpus_messages, corpus_length / 1048576.0, chunk, loops);
+
+	for (method = -1; method <= SCAN_ISA_AVX2; method++) {
+		if (0 <= method && (isa = scanUse(method)) != method)
+			continue;
+		seconds = benchTime(method, chunk, loops, &counts);
+		printf(
+			"%-8s %8.1f MB/s  dots=%lu eoh=%lu return-path=%lu bare-lf=%lu\n",
+			names[method+1], corpus_length / 1048576.0 * loops / seconds,
+			counts.dots, counts.eohs, counts.headers, counts.bare
+		);
+	}
+
+	return 0;
+}
+#endif /* TEST */
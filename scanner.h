@@ -0,0 +1,93 @@
+/*
+ * scanner.h
+ *
+ * Copyright 2013 by Anthony Howe. All rights reserved.
+ *
+ * Streaming message content scanner.
+ */
+
+#ifndef __scanner_h__
+#define __scanner_h__	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Scanner.flags */
+#define SCAN_HEADERS		0x0001		/* Still in the message headers. */
+
+/* Scanner.event */
+#define SCAN_DOT		0x0001		/* Line is the end of data dot. */
+#define SCAN_EOH		0x0002		/* Line is the end of headers. */
+#define SCAN_HEADER		0x0004		/* Line starts with Scanner.header. */
+#define SCAN_BARE_LF		0x0008		/* Line ends with LF without CR. */
+#define SCAN_LONG		0x0010		/* Line, with LF, is Scanner.limit or longer. */
+
+/* scanUse() */
+#define SCAN_ISA_SCALAR		0
+#define SCAN_ISA_SSE2		1
+#define SCAN_ISA_AVX2		2
+
+typedef struct {
+	const char *header;			/* Header name of interest with colon. */
+	long header_length;
+	long limit;				/* SCAN_LONG line length. */
+	long column;				/* Bytes of the current line seen. */
+	long line;				/* Line offset in the last chunk, or -1. */
+	long match;				/* Header bytes matched, -1 on mismatch. */
+	int previous;				/* Last byte of the last chunk. */
+	int first;				/* First byte of the current line. */
+	unsigned flags;
+	unsigned event;
+} Scanner;
+
+/**
+ * @param scan
+ *	A pointer to a Scanner to initialise for the start of a message.
+ *
+ * @param header
+ *	A header name, with colon, to report with SCAN_HEADER while in the
+ *	message headers, eg. "Return-Path:".  NULL to start in the body.
+ *
+ * @param limit
+ *	Report lines of this length or longer, counting the CRLF, with
+ *	SCAN_LONG.  Zero for no limit.
+ */
+extern void scanInit(Scanner *scan, const char *header, long limit);
+
+/**
+ * @param scan
+ *	A pointer to a Scanner.
+ *
+ * @param buffer
+ *	The next chunk of message content.  Chunks may split lines at
+ *	any point; the scanner carries what it needs across them.
+ *
+ * @param length
+ *	The length of the chunk.
+ *
+ * @return
+ *	The number of bytes consumed.  If scan->event is not zero, the
+ *	line ending at the last byte consumed raised the events and
+ *	scan->line is its offset in this chunk, or -1 when it started in
+ *	an earlier chunk.  Otherwise the whole chunk was consumed and
+ *	scan->line is the offset of its trailing partial line, or length
+ *	when it ends on a line boundary.
+ */
+extern long scanNext(Scanner *scan, const char *buffer, long length);
+
+/**
+ * @param isa
+ *	SCAN_ISA_SCALAR, SCAN_ISA_SSE2, or SCAN_ISA_AVX2.
+ *
+ * @return
+ *	The instruction set used from now on, which is the best available
+ *	at or below that requested.  The default is the best available.
+ */
+extern int scanUse(int isa);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __scanner_h__ */
@@ -0,0 +1,76 @@
+/*
+ * stats.h
+ *
+ * Copyright 2013 by Anthony Howe. All rights reserved.
+ *
+ * Live statistics shared memory segment, written by roundhouse and
+ * read by roundhouse-top.
+ */
+
+#ifndef __stats_h__
+#define __stats_h__	1
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef STATS_NAME
+#define STATS_NAME		"/roundhouse"
+#endif
+
+#define STATS_MAGIC		0x52485354	/* RHST */
+#define STATS_VERSION		1
+#define STATS_LINE		64		/* Cache line size. */
+#define STATS_SERVERS		32
+#define STATS_HOST_SIZE		64
+
+/*
+ * The segment is a header followed by one slot per thread.  A slot is
+ * a StatsThread line followed by a StatsServer line for each server.
+ * Each thread only ever writes its own slot, without locking, and the
+ * counters only ever grow, so a reader sums the slots and works out
+ * rates from two readings.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nservers;
+	uint32_t nslots;
+	uint64_t slot_size;
+	uint64_t started;			/* time() the daemon started. */
+	uint64_t pid;
+	char hosts[STATS_SERVERS][STATS_HOST_SIZE];
+} StatsHeader;
+
+typedef struct {
+	uint64_t in_use;			/* Slot has an owning thread. */
+	uint64_t sessions;			/* Sessions started. */
+	uint64_t sessions_ended;
+	uint64_t messages;			/* Messages relayed or spooled. */
+	uint64_t client_in;			/* Bytes read from clients. */
+	uint64_t client_out;			/* Bytes written to clients. */
+	uint64_t unused[2];
+} StatsThread;
+
+typedef struct {
+	uint64_t connects;			/* Connected or taken from the pool. */
+	uint64_t disconnects;			/* Closed or returned to the pool. */
+	uint64_t write_errors;			/* Disconnects after a write error. */
+	uint64_t bytes_out;			/* Bytes written to the server. */
+	uint64_t replies[4];			/* Replies 2xx, 3xx, 4xx, 5xx. */
+} StatsServer;
+
+#define STATS_HEADER_SIZE	((sizeof (StatsHeader) + STATS_LINE-1) / STATS_LINE * STATS_LINE)
+#define STATS_SLOT_SIZE(n)	(sizeof (StatsThread) + (n) * sizeof (StatsServer))
+#define STATS_SIZE(n, slots)	(STATS_HEADER_SIZE + (slots) * STATS_SLOT_SIZE(n))
+
+#define STATS_SLOT(hdr, i)	((StatsThread *) ((char *) (hdr) + STATS_HEADER_SIZE + (i) * (hdr)->slot_size))
+#define STATS_SERVER(slot, j)	(&((StatsServer *) ((slot) + 1))[j])
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __stats_h__ */